@@ -4,6 +4,10 @@
 #include "terrain_node.h"
 #include "terrain_editor.h"
 #include "terrain_data.h"
+#include "terrain_generator.h"
+#include "terrain_erosion.h"
+#include "terrain_importer.h"
+#include "terrain_light_baker.h"
 
 #endif // _3D_DISABLED
 
@@ -12,6 +16,10 @@ void register_terrain_types()
 #ifndef _3D_DISABLED
     ObjectTypeDB::register_type<TerrainNode>();
     ObjectTypeDB::register_type<TerrainData>();
+    ObjectTypeDB::register_type<TerrainGenerator>();
+    ObjectTypeDB::register_type<TerrainErosion>();
+    ObjectTypeDB::register_type<TerrainImporter>();
+    ObjectTypeDB::register_type<TerrainLightBaker>();
 #ifdef TOOLS_ENABLED
     EditorPlugins::add_by_type<TerrainEditorPlugin>();
 #endif // tools
@@ -0,0 +1,255 @@
+#include "terrain_brush.h"
+#include "math_funcs.h"
+
+bool TerrainBrush::Key::operator<(const Key& other) const
+{
+    if (shape != other.shape) {
+        return shape < other.shape;
+    }
+
+    if (size != other.size) {
+        return size < other.size;
+    }
+
+    if (hardness != other.hardness) {
+        return hardness < other.hardness;
+    }
+
+    if (rotation != other.rotation) {
+        return rotation < other.rotation;
+    }
+
+    return custom < other.custom;
+}
+
+TerrainBrush::TerrainBrush()
+{
+    m_shape = SHAPE_SQUARE;
+    m_size = 3;
+    m_hardness = 0.5;
+    m_rotation = 0;
+    m_spacing = 0.25;
+    m_custom_w = 0;
+    m_custom_h = 0;
+    m_custom_version = 0;
+
+    _update();
+}
+
+void TerrainBrush::set_shape(Shape shape)
+{
+    m_shape = shape;
+    _update();
+}
+
+TerrainBrush::Shape TerrainBrush::get_shape() const
+{
+    return m_shape;
+}
+
+void TerrainBrush::set_size(int size)
+{
+    m_size = MAX(size, 1);
+    _update();
+}
+
+int TerrainBrush::get_size() const
+{
+    return m_size;
+}
+
+void TerrainBrush::set_hardness(float hardness)
+{
+    m_hardness = CLAMP(hardness, 0.0f, 1.0f);
+    _update();
+}
+
+float TerrainBrush::get_hardness() const
+{
+    return m_hardness;
+}
+
+void TerrainBrush::set_rotation(float rotation)
+{
+    m_rotation = Math::fposmod(rotation, 360.0f);
+    _update();
+}
+
+float TerrainBrush::get_rotation() const
+{
+    return m_rotation;
+}
+
+void TerrainBrush::set_spacing(float spacing)
+{
+    m_spacing = MAX(spacing, 0.01f);
+}
+
+float TerrainBrush::get_spacing() const
+{
+    return m_spacing;
+}
+
+void TerrainBrush::set_custom_image(const Image& image)
+{
+    Image gray = image;
+
+    if (gray.is_compressed()) {
+        gray.decompress();
+    }
+
+    gray.convert(Image::FORMAT_GRAYSCALE);
+
+    m_custom_w = gray.get_width();
+    m_custom_h = gray.get_height();
+    m_custom.resize(m_custom_w * m_custom_h);
+
+    DVector<uint8_t> data = gray.get_data();
+    DVector<uint8_t>::Read r = data.read();
+
+    for (int i = 0; i < m_custom.size(); i++) {
+        m_custom[i] = r[i] / 255.0f;
+    }
+
+    // masks of the previous image are never looked up again
+    m_custom_version++;
+
+    _update();
+}
+
+const float* TerrainBrush::get_mask() const
+{
+    return &m_mask[0];
+}
+
+void TerrainBrush::_update()
+{
+    Key key;
+    key.shape = m_shape;
+    key.size = m_size;
+    key.hardness = Math::fast_ftoi(m_hardness * 100.0f);
+    key.rotation = Math::fast_ftoi(m_rotation);
+    key.custom = m_shape == SHAPE_CUSTOM ? m_custom_version : 0;
+
+    // round shapes look the same at any angle
+    if (m_shape == SHAPE_CIRCLE || m_shape == SHAPE_SMOOTH_CIRCLE) {
+        key.rotation = 0;
+    }
+
+    // hard shapes
+    if (m_shape == SHAPE_SQUARE || m_shape == SHAPE_CIRCLE || m_shape == SHAPE_CUSTOM) {
+        key.hardness = 100;
+    }
+
+    Map<Key, Vector<float> >::Element* E = m_cache.find(key);
+
+    if (!E) {
+        if (m_cache.size() >= MAX_CACHED_MASKS) {
+            m_cache.clear();
+        }
+
+        Vector<float> mask;
+        mask.resize(m_size * m_size);
+        _build(key, &mask[0]);
+
+        E = m_cache.insert(key, mask);
+    }
+
+    m_mask = E->get();
+}
+
+float TerrainBrush::_sample_custom(float u, float v) const
+{
+    if (m_custom.empty() || u < 0 || v < 0 || u > 1 || v > 1) {
+        return 0;
+    }
+
+    float x = CLAMP(u * m_custom_w - 0.5f, 0.0f, m_custom_w - 1.0f);
+    float y = CLAMP(v * m_custom_h - 0.5f, 0.0f, m_custom_h - 1.0f);
+
+    int x0 = x;
+    int y0 = y;
+    int x1 = MIN(x0 + 1, m_custom_w - 1);
+    int y1 = MIN(y0 + 1, m_custom_h - 1);
+    float fx = x - x0;
+    float fy = y - y0;
+
+    float a = m_custom[y0 * m_custom_w + x0] + (m_custom[y0 * m_custom_w + x1] - m_custom[y0 * m_custom_w + x0]) * fx;
+    float b = m_custom[y1 * m_custom_w + x0] + (m_custom[y1 * m_custom_w + x1] - m_custom[y1 * m_custom_w + x0]) * fx;
+
+    return a + (b - a) * fy;
+}
+
+// texels are sampled at their centers in [-1, 1] brush space, rotated back
+// into the unrotated shape
+void TerrainBrush::_build(const Key& key, float* mask) const
+{
+    int size = key.size;
+    float hardness = key.hardness / 100.0f;
+    float angle = Math::deg2rad((float)key.rotation);
+    float c = Math::cos(angle);
+    float s = Math::sin(angle);
+    float texel = 2.0f / size;
+
+    for (int y = 0; y < size; y++) {
+        for (int x = 0; x < size; x++) {
+            float px = (x + 0.5f) * texel - 1.0f;
+            float py = (y + 0.5f) * texel - 1.0f;
+            float u = px * c + py * s;
+            float v = -px * s + py * c;
+            float d = Math::sqrt(px * px + py * py);
+
+            // fades from 'hardness' to the edge
+            float falloff = 1.0f;
+
+            if (d >= 1.0f) {
+                falloff = 0;
+            }
+            else if (d > hardness) {
+                float t = (d - hardness) / (1.0f - hardness);
+                falloff = 1.0f - t * t * (3.0f - 2.0f * t);
+            }
+
+            float value = 0;
+
+            switch (key.shape) {
+
+            case SHAPE_SQUARE: {
+                value = (ABS(u) <= 1.0f && ABS(v) <= 1.0f) ? 1.0f : 0.0f;
+                break;
+            }
+
+            case SHAPE_CIRCLE: {
+                // antialiased over one texel
+                value = CLAMP((1.0f - d) / texel + 0.5f, 0.0f, 1.0f);
+                break;
+            }
+
+            case SHAPE_SMOOTH_CIRCLE: {
+                value = falloff;
+                break;
+            }
+
+            case SHAPE_NOISE: {
+                // hashed in rotated brush space so it turns with the brush
+                int nx = Math::fast_ftoi((u + 1.0f) * size);
+                int ny = Math::fast_ftoi((v + 1.0f) * size);
+                uint32_t h = (uint32_t)(nx * 73856093) ^ (uint32_t)(ny * 19349663);
+
+                h = (h ^ (h >> 13)) * 0x5bd1e995;
+                h ^= h >> 15;
+
+                value = (h & 0xFFFF) / 65535.0f * falloff;
+                break;
+            }
+
+            case SHAPE_CUSTOM: {
+                value = _sample_custom((u + 1.0f) * 0.5f, (v + 1.0f) * 0.5f);
+                break;
+            }
+            }
+
+            mask[y * size + x] = value;
+        }
+    }
+}
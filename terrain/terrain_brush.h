@@ -0,0 +1,78 @@
+#ifndef _TERRAIN_BRUSH_H
+#define _TERRAIN_BRUSH_H
+
+#include "image.h"
+#include "map.h"
+
+// size x size float masks for the editor brushes. Masks are built once per
+// shape, size, hardness and rotation and kept, painting only reads them
+class TerrainBrush {
+public:
+    enum Shape {
+        SHAPE_SQUARE,
+        SHAPE_CIRCLE,
+        SHAPE_SMOOTH_CIRCLE,
+        SHAPE_NOISE,
+        SHAPE_CUSTOM,
+    };
+
+    enum {
+        MAX_CACHED_MASKS = 32,
+    };
+
+    TerrainBrush();
+
+    void set_shape(Shape shape);
+    Shape get_shape() const;
+
+    void set_size(int size);
+    int get_size() const;
+
+    // fraction of the radius at full strength
+    void set_hardness(float hardness);
+    float get_hardness() const;
+
+    // degrees
+    void set_rotation(float rotation);
+    float get_rotation() const;
+
+    // distance between dabs in brush sizes
+    void set_spacing(float spacing);
+    float get_spacing() const;
+
+    // grayscale of the image, scaled to the brush size
+    void set_custom_image(const Image& image);
+
+    const float* get_mask() const;
+
+private:
+    struct Key {
+        int shape;
+        int size;
+        int hardness; // percent
+        int rotation; // degrees
+        uint32_t custom;
+
+        bool operator<(const Key& other) const;
+    };
+
+    void _update();
+    void _build(const Key& key, float* mask) const;
+    float _sample_custom(float u, float v) const;
+
+    Shape m_shape;
+    int m_size;
+    float m_hardness;
+    float m_rotation;
+    float m_spacing;
+
+    Vector<float> m_custom; // decoded custom image
+    int m_custom_w;
+    int m_custom_h;
+    uint32_t m_custom_version;
+
+    Map<Key, Vector<float> > m_cache;
+    Vector<float> m_mask; // shares the cached buffer
+};
+
+#endif
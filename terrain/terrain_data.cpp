@@ -1,18 +1,50 @@
 #include "terrain_data.h"
+#include "terrain_threads.h"
+#include "io/compression.h"
+#include "io/marshalls.h"
+#include "io/resource_saver.h"
+#include "os/dir_access.h"
+#include "os/os.h"
 
-#define HEIGHT_SCALE 1000.0f
+#define BLEND_FORMAT_SPLAT 1
+#define RESIDENCY_IDLE_MSEC 10000
+#define RESIZE_BAND_ROWS 16
 
 TerrainData::TerrainData()
 {
     m_size = 0;
-    m_blends_tex = VS::get_singleton()->texture_create();
-    m_heights_tex = VS::get_singleton()->texture_create();
+    m_delta_version = 0;
+    m_delta_step = 1;
+    m_save_full = false;
+    m_journal_pending = false;
+
+    for (int i = 0; i < LAYER_COUNT; i++) {
+        m_residency[i] = RESIDENCY_CPU;
+        m_modified[i] = false;
+        m_resident[i] = true;
+        m_access_time[i] = 0;
+        m_pins[i] = 0;
+        m_swapped[i] = false;
+    }
 }
 
 TerrainData::~TerrainData()
 {
-    VS::get_singleton()->free(m_blends_tex);
-    VS::get_singleton()->free(m_heights_tex);
+    if (m_heights_tex.is_valid()) {
+        VS::get_singleton()->free(m_heights_tex);
+    }
+
+    if (m_lighting_tex.is_valid()) {
+        VS::get_singleton()->free(m_lighting_tex);
+    }
+
+    for (int i = 0; i < LAYER_COUNT; i++) {
+        if (m_swapped[i]) {
+            DirAccess* da = DirAccess::create_for_path(_get_swap_path(i).get_base_dir());
+            da->remove(_get_swap_path(i));
+            memdelete(da);
+        }
+    }
 }
 
 void TerrainData::set_size(const int new_size)
@@ -28,200 +60,2209 @@ void TerrainData::set_size(const int new_size)
 
 Image TerrainData::get_blends() const
 {
-    return m_blends;
+    _page_in(LAYER_BLENDS);
+    return Image(m_size, m_size, false, Image::FORMAT_RGBA, m_blends);
 }
 
 Image TerrainData::get_heights() const
 {
-    return m_heights;
+    return Image(m_size + 1, m_size + 1, false, Image::FORMAT_GRAYSCALE_ALPHA, m_heights);
 }
 
-RID TerrainData::get_blends_texture() const
+DVector<uint8_t> TerrainData::get_blend_data() const
 {
-    return m_blends_tex;
+    _page_in(LAYER_BLENDS);
+    return m_blends;
 }
 
+// no shader samples it, only created for whoever asks
 RID TerrainData::get_heights_texture() const
 {
+    if (!m_heights_tex.is_valid()) {
+        m_heights_tex = VS::get_singleton()->texture_create();
+
+        if (m_size > 0) {
+            VS::get_singleton()->texture_allocate(m_heights_tex, m_size + 1, m_size + 1, Image::FORMAT_GRAYSCALE_ALPHA, 0);
+            VS::get_singleton()->texture_set_data(m_heights_tex, get_heights());
+        }
+    }
+
     return m_heights_tex;
 }
 
-void TerrainData::reload_heights()
+bool TerrainData::has_heights_texture() const
+{
+    return m_heights_tex.is_valid();
+}
+
+bool TerrainData::has_lighting_texture() const
+{
+    return m_lighting_tex.is_valid();
+}
+
+DVector<uint8_t>& TerrainData::get_height_buffer()
+{
+    return m_heights;
+}
+
+DVector<uint8_t>& TerrainData::get_blend_buffer()
+{
+    _page_in(LAYER_BLENDS);
+    m_modified[LAYER_BLENDS] = true;
+    return m_blends;
+}
+
+// uploads heights and lets terrains rebuild the chunks inside region
+void TerrainData::heights_changed(const Rect2& region)
+{
+    _mark_tiles(region, TILE_HEIGHTS);
+    reload_heights();
+    emit_signal("heights_changed", region);
+}
+
+void TerrainData::blends_changed(const Rect2& region)
+{
+    _mark_tiles(region, TILE_BLENDS);
+    emit_signal("blends_changed", region);
+}
+
+void TerrainData::heights_changed_regions(const Vector<Rect2>& regions)
+{
+    for (int i = 0; i < regions.size(); i++) {
+        _mark_tiles(regions[i], TILE_HEIGHTS);
+    }
+
+    reload_heights();
+
+    for (int i = 0; i < regions.size(); i++) {
+        emit_signal("heights_changed", regions[i]);
+    }
+}
+
+bool TerrainData::has_lighting() const
+{
+    return m_size > 0 && (!m_resident[LAYER_LIGHTING] || m_lighting.size() == (m_size + 1) * (m_size + 1) * 2);
+}
+
+// resized (and cleared to unshadowed) on first use
+DVector<uint8_t>& TerrainData::get_lighting_buffer()
+{
+    _page_in(LAYER_LIGHTING);
+    m_modified[LAYER_LIGHTING] = true;
+
+    // the journal only patches a layer the saved resource already has
+    if (!has_lighting()) {
+        m_save_full = true;
+        m_lighting.resize((m_size + 1) * (m_size + 1) * 2);
+
+        DVector<uint8_t>::Write w = m_lighting.write();
+
+        for (int i = 0; i < m_lighting.size(); i++) {
+            w[i] = 255;
+        }
+    }
+
+    return m_lighting;
+}
+
+// created and uploaded on first use, a headless server never asks
+RID TerrainData::get_lighting_texture() const
+{
+    if (!m_lighting_tex.is_valid()) {
+        m_lighting_tex = VS::get_singleton()->texture_create();
+        const_cast<TerrainData*>(this)->_reload_lighting();
+    }
+
+    return m_lighting_tex;
+}
+
+void TerrainData::lighting_changed(const Rect2& region)
 {
-    VS::get_singleton()->texture_set_data(m_heights_tex, m_heights);
+    _mark_tiles(region, TILE_LIGHTING);
+    _reload_lighting();
+    emit_signal("lighting_changed", region);
 }
 
-void TerrainData::reload_blends()
+void TerrainData::lighting_changed_regions(const Vector<Rect2>& regions)
 {
-    VS::get_singleton()->texture_set_data(m_blends_tex, m_blends);
+    for (int i = 0; i < regions.size(); i++) {
+        _mark_tiles(regions[i], TILE_LIGHTING);
+    }
+
+    _reload_lighting();
+
+    for (int i = 0; i < regions.size(); i++) {
+        emit_signal("lighting_changed", regions[i]);
+    }
 }
 
+void TerrainData::clear_lighting()
+{
+    if (!has_lighting()) {
+        return;
+    }
+
+    m_lighting.resize(0);
+    m_resident[LAYER_LIGHTING] = true;
+    m_modified[LAYER_LIGHTING] = true;
+    m_save_full = true;
+    emit_signal("lighting_changed", Rect2(0, 0, m_size + 1, m_size + 1));
+}
 
-void TerrainData::paint_blend(const Image& brush, int x, int y, int texture, float alpha)
+void TerrainData::_reload_lighting()
 {
-    if (brush.empty()) {
+    if (!has_lighting() || !m_lighting_tex.is_valid()) {
         return;
     }
 
-    int brush_size = brush.get_width();
+    _page_in(LAYER_LIGHTING);
 
-    Color modulate(0, 0, 0, 0);
+    Image image(m_size + 1, m_size + 1, false, Image::FORMAT_GRAYSCALE_ALPHA, m_lighting);
 
-    switch(texture) {
-    case 1:
-        modulate.r = alpha;
-        break;
-    case 2:
-        modulate.g = alpha;
-        break;
-    case 3:
-        modulate.b = alpha;
-        break;
-    case 4:
-        modulate.a = alpha;
-        break;
-    case 0:
-        modulate.r = -alpha;
-        modulate.g = -alpha;
-        modulate.b = -alpha;
-        modulate.a = -alpha;
-        break;
+    if (VS::get_singleton()->texture_get_width(m_lighting_tex) != image.get_width()) {
+        VS::get_singleton()->texture_allocate(m_lighting_tex, image.get_width(), image.get_height(), image.get_format(), VS::TEXTURE_FLAG_FILTER);
     }
 
-    for (int i = x; i < x + brush_size; i++) {
-        for (int j = y; j < y + brush_size; j ++) {
-            float mask = brush.get_pixel(i - x, j - y).gray();
-            Color curr = m_blends.get_pixel(i, j);
+    VS::get_singleton()->texture_set_data(m_lighting_tex, image);
+}
 
-            m_blends.put_pixel(i, j, curr.linear_interpolate(modulate, mask));
-        }
+void TerrainData::reload_heights()
+{
+    if (!m_heights_tex.is_valid()) {
+        return;
     }
 
-    VS::get_singleton()->texture_set_data(m_blends_tex, m_blends);
+    VS::get_singleton()->texture_set_data(m_heights_tex, get_heights());
+}
+
+// a blend texel holds two layer indices and their weights, whatever
+// weight is left belongs to the base layer 0
+void TerrainData::decode_blend(const uint8_t* texel, int* layers, float* weights)
+{
+    layers[0] = 0;
+    layers[1] = texel[0];
+    layers[2] = texel[1];
+
+    weights[1] = texel[2] / 255.0f;
+    weights[2] = texel[3] / 255.0f;
+    weights[0] = MAX(1.0f - weights[1] - weights[2], 0.0f);
 }
 
-void TerrainData::paint_height(const Image &brush, int x, int y, float alpha)
+// keeps the two strongest layers besides the base one and renormalizes
+void TerrainData::encode_blend(uint8_t* texel, const int* layers, const float* weights, int count)
 {
-    if (brush.empty()) {
+    float base = 0;
+    int best[2] = { 0, 0 };
+    float best_w[2] = { 0, 0 };
+
+    for (int i = 0; i < count; i++) {
+        if (layers[i] == 0) {
+            base += weights[i];
+            continue;
+        }
+
+        if (weights[i] > best_w[0]) {
+            best[1] = best[0];
+            best_w[1] = best_w[0];
+            best[0] = layers[i];
+            best_w[0] = weights[i];
+        }
+        else if (weights[i] > best_w[1]) {
+            best[1] = layers[i];
+            best_w[1] = weights[i];
+        }
+    }
+
+    float kept = base + best_w[0] + best_w[1];
+
+    if (kept <= 0) {
+        texel[0] = texel[1] = texel[2] = texel[3] = 0;
         return;
     }
 
-    int brush_size = brush.get_width();
+    int w0 = Math::fast_ftoi(best_w[0] / kept * 255.0f);
+    int w1 = Math::fast_ftoi(best_w[1] / kept * 255.0f);
+
+    w0 = CLAMP(w0, 0, 255);
+    w1 = CLAMP(w1, 0, 255 - w0);
+
+    texel[0] = best[0];
+    texel[1] = best[1];
+    texel[2] = w0;
+    texel[3] = w1;
+}
+
+/* brushes */
+
+// dabs are cut into bands of rows, big brushes paint on all cores
+#define BRUSH_BAND_ROWS 64
+
+void TerrainData::_paint_blend_rows(void* userdata, int from, int to)
+{
+    PaintJob& job = *(PaintJob*)userdata;
+
+    for (int j = job.y1 + from; j < job.y1 + to; j++) {
+        const float* row = &job.mask[(j - job.y) * job.size];
+        uint8_t* texels = &job.buffer[j * job.stride * 4];
+
+        for (int i = job.x1; i < job.x2; i++) {
+            float mask = row[i - job.x] * job.alpha;
+
+            if (mask <= 0) {
+                continue;
+            }
+
+            uint8_t* texel = texels + i * 4;
+
+            // fade the current layers towards the painted one
+            int layers[4];
+            float weights[4];
+
+            decode_blend(texel, layers, weights);
 
-    for (int i = x; i < x + brush_size; i++) {
-        for (int j = y; j < y + brush_size; j ++) {
-            float mask = brush.get_pixel(i - x, j - y).gray();
-            float height = get_height_at(i, j);
-            float result = (height + mask * alpha);
+            int count = 3;
+            int target = count;
 
-            if (result > 65535 / HEIGHT_SCALE) {
-                result = 65535 / HEIGHT_SCALE;
+            for (int k = 0; k < count; k++) {
+                weights[k] *= 1.0f - mask;
+
+                if (layers[k] == job.layer && weights[k] > 0) {
+                    target = k;
+                }
             }
 
-            if (result < 0) {
-                result = 0;
+            if (target == count) {
+                layers[count] = job.layer;
+                weights[count] = 0;
+                count++;
             }
 
-            set_height_at(i, j, result);
+            weights[target] += mask;
+
+            encode_blend(texel, layers, weights, count);
         }
     }
+}
+
+void TerrainData::_paint_height_rows(void* userdata, int from, int to)
+{
+    PaintJob& job = *(PaintJob*)userdata;
+
+    for (int j = job.y1 + from; j < job.y1 + to; j++) {
+        const float* row = &job.mask[(j - job.y) * job.size];
+        uint8_t* texels = &job.buffer[j * job.stride * 2];
 
-    VS::get_singleton()->texture_set_data(m_heights_tex, m_heights);
+        for (int i = job.x1; i < job.x2; i++) {
+            uint8_t* texel = texels + i * 2;
+
+            encode_height(texel, decode_height(texel) + row[i - job.x] * job.alpha);
+        }
+    }
 }
 
-float TerrainData::get_height_at(int x, int y)
+// texels under a full mask get the encoded target copied in
+void TerrainData::_set_height_rows(void* userdata, int from, int to)
 {
-    if (x < 0) x = 0;
-    if (y < 0) y = 0;
+    PaintJob& job = *(PaintJob*)userdata;
 
-    if (x > m_size) x = m_size;
-    if (y > m_size) y = m_size;
+    uint8_t target[2];
+    encode_height(target, job.height);
 
-    int offset = y * (m_size + 1) + x;
+    for (int j = job.y1 + from; j < job.y1 + to; j++) {
+        const float* row = &job.mask[(j - job.y) * job.size];
+        uint8_t* texels = &job.buffer[j * job.stride * 2];
+
+        for (int i = job.x1; i < job.x2; i++) {
+            float t = row[i - job.x] * job.alpha;
+            uint8_t* texel = texels + i * 2;
 
-    uint8_t a = m_heights.get_data().get(offset * 2);
-    uint8_t b = m_heights.get_data().get(offset * 2 + 1);
-    uint16_t c = (a << 8) + b;
+            if (t >= 1.0f) {
+                texel[0] = target[0];
+                texel[1] = target[1];
+            }
+            else if (t > 0) {
+                float h = decode_height(texel);
+                encode_height(texel, h + (job.height - h) * t);
+            }
+        }
+    }
+}
 
-    //65535
-    //6553.5
-    //655.35
-    //65.535
+// clips the dab to a map of 'stride' texels per side, false when nothing is left
+static bool _clip_dab(int x, int y, int size, int stride, int& x1, int& y1, int& x2, int& y2)
+{
+    x1 = MAX(x, 0);
+    y1 = MAX(y, 0);
+    x2 = MIN(x + size, stride);
+    y2 = MIN(y + size, stride);
 
-    return (float)c / HEIGHT_SCALE;
+    return x1 < x2 && y1 < y2;
 }
 
-void TerrainData::set_height_at(int x, int y, float h)
+void TerrainData::paint_blend(const float* brush, int brush_size, int x, int y, int layer, float alpha)
 {
-    if (x < 0) x = 0;
-    if (y < 0) y = 0;
+    if (!brush || layer < 0 || layer >= MAX_LAYERS) {
+        return;
+    }
+
+    PaintJob job;
 
-    if (x > m_size + 1) x = m_size + 1;
-    if (y > m_size + 1) y = m_size + 1;
+    if (!_clip_dab(x, y, brush_size, m_size, job.x1, job.y1, job.x2, job.y2)) {
+        return;
+    }
+
+    _page_in(LAYER_BLENDS);
+    m_modified[LAYER_BLENDS] = true;
+
+    DVector<uint8_t>::Write w = m_blends.write();
 
-    uint16_t h16 = h * HEIGHT_SCALE;
+    job.mask = brush;
+    job.size = brush_size;
+    job.x = x;
+    job.y = y;
+    job.stride = m_size;
+    job.buffer = w.ptr();
+    job.alpha = alpha;
+    job.layer = layer;
 
-    int r = (uint8_t)(h16 >> 8);
-    int a = (uint8_t)h16;
+    TerrainThreads::run(_paint_blend_rows, &job, job.y2 - job.y1, BRUSH_BAND_ROWS);
 
-    m_heights.put_pixel(x, y, Color(r / 255.0f, r / 255.0f, r / 255.0f, a / 255.0f));
+    _mark_tiles(Rect2(job.x1, job.y1, job.x2 - job.x1, job.y2 - job.y1), TILE_BLENDS);
 }
 
-void TerrainData::_size_changed()
+void TerrainData::paint_height(const float* brush, int brush_size, int x, int y, float alpha)
 {
-    m_heights.create(m_size + 1, m_size + 1, false, Image::FORMAT_GRAYSCALE_ALPHA);
-    m_blends.create(m_size, m_size, false, Image::FORMAT_RGBA);
+    if (!brush) {
+        return;
+    }
 
-    VS::get_singleton()->texture_allocate(m_heights_tex, m_size + 1, m_size + 1, m_heights.get_format(), 0);
-    VS::get_singleton()->texture_allocate(m_blends_tex, m_size, m_size, m_blends.get_format(), VS::TEXTURE_FLAG_FILTER);
-    VS::get_singleton()->texture_set_data(m_blends_tex, m_blends);
-    VS::get_singleton()->texture_set_data(m_heights_tex, m_heights);
+    PaintJob job;
 
-    emit_signal(String("size_changed"));
+    if (!_clip_dab(x, y, brush_size, m_size + 1, job.x1, job.y1, job.x2, job.y2)) {
+        return;
+    }
+
+    DVector<uint8_t>::Write w = m_heights.write();
+
+    job.mask = brush;
+    job.size = brush_size;
+    job.x = x;
+    job.y = y;
+    job.stride = m_size + 1;
+    job.buffer = w.ptr();
+    job.alpha = alpha;
+
+    TerrainThreads::run(_paint_height_rows, &job, job.y2 - job.y1, BRUSH_BAND_ROWS);
+
+    _mark_tiles(Rect2(job.x1, job.y1, job.x2 - job.x1, job.y2 - job.y1), TILE_HEIGHTS);
 }
 
-int TerrainData::get_size() const
+// moves heights towards 'height' by mask * strength
+void TerrainData::set_height(const float* brush, int brush_size, int x, int y, float height, float strength)
 {
-    return m_size;
+    if (!brush || strength <= 0) {
+        return;
+    }
+
+    PaintJob job;
+
+    if (!_clip_dab(x, y, brush_size, m_size + 1, job.x1, job.y1, job.x2, job.y2)) {
+        return;
+    }
+
+    DVector<uint8_t>::Write w = m_heights.write();
+
+    job.mask = brush;
+    job.size = brush_size;
+    job.x = x;
+    job.y = y;
+    job.stride = m_size + 1;
+    job.buffer = w.ptr();
+    job.alpha = strength;
+    job.height = height;
+
+    TerrainThreads::run(_set_height_rows, &job, job.y2 - job.y1, BRUSH_BAND_ROWS);
+
+    _mark_tiles(Rect2(job.x1, job.y1, job.x2 - job.x1, job.y2 - job.y1), TILE_HEIGHTS);
 }
 
-void TerrainData::_set_data(Dictionary data)
+void TerrainData::blit_heights(const Rect2& region, const Image& source, int mode)
 {
-    m_size = data["size"];
-    m_heights.create(m_size + 1, m_size + 1, false, Image::FORMAT_GRAYSCALE_ALPHA, data["heights"]);
-    m_blends.create(m_size, m_size, false, Image::FORMAT_RGBA, data["blends"]);
+    ERR_FAIL_INDEX(mode, BLIT_MIN + 1);
+    ERR_EXPLAIN("Height patches are 16 bit FORMAT_GRAYSCALE_ALPHA images the size of the region");
+    ERR_FAIL_COND(source.get_format() != Image::FORMAT_GRAYSCALE_ALPHA || source.get_width() != region.size.x || source.get_height() != region.size.y);
+
+    int stride = m_size + 1;
+    int sw = source.get_width();
+
+    int x1 = MAX(region.pos.x, 0);
+    int y1 = MAX(region.pos.y, 0);
+    int x2 = MIN(region.pos.x + region.size.x, stride);
+    int y2 = MIN(region.pos.y + region.size.y, stride);
+
+    if (x1 >= x2 || y1 >= y2) {
+        return;
+    }
+
+    int count = x2 - x1;
+
+    DVector<uint8_t> src_data = source.get_data();
+    DVector<uint8_t>::Read r = src_data.read();
+    DVector<uint8_t>::Write w = m_heights.write();
+
+    for (int y = y1; y < y2; y++) {
+        const uint8_t* src = &r[((y - (int)region.pos.y) * sw + (x1 - (int)region.pos.x)) * 2];
+        uint8_t* dst = &w[(y * stride + x1) * 2];
+
+        if (mode == BLIT_REPLACE) {
+            copymem(dst, src, count * 2);
+            continue;
+        }
+
+        // same encoding on both sides, so work on the raw 16 bit values
+        for (int i = 0; i < count; i++) {
+            int a = (dst[i * 2] << 8) | dst[i * 2 + 1];
+            int b = (src[i * 2] << 8) | src[i * 2 + 1];
+            int v;
+
+            switch (mode) {
+            case BLIT_ADD: v = MIN(a + b, 65535); break;
+            case BLIT_SUBTRACT: v = MAX(a - b, 0); break;
+            case BLIT_MAX: v = MAX(a, b); break;
+            default: v = MIN(a, b); break;
+            }
+
+            dst[i * 2] = v >> 8;
+            dst[i * 2 + 1] = v & 0xFF;
+        }
+    }
 
-    VS::get_singleton()->texture_allocate(m_heights_tex, m_size + 1, m_size + 1, m_heights.get_format(), 0);
-    VS::get_singleton()->texture_allocate(m_blends_tex, m_size, m_size, m_blends.get_format(), VS::TEXTURE_FLAG_FILTER);
-    VS::get_singleton()->texture_set_data(m_blends_tex, m_blends);
-    VS::get_singleton()->texture_set_data(m_heights_tex, m_heights);
+    w = DVector<uint8_t>::Write();
+    r = DVector<uint8_t>::Read();
+
+    heights_changed(Rect2(x1, y1, count, y2 - y1));
 }
 
-Dictionary TerrainData::_get_data() const
+/* regions */
+
+DVector<real_t> TerrainData::get_height_region(const Rect2& region) const
 {
-    Dictionary d;
+    DVector<real_t> heights;
 
-    d["size"] = m_size;
-    d["heights"] = m_heights.get_data();
-    d["blends"] = m_blends.get_data();
+    int w = region.size.x;
+    int h = region.size.y;
 
-    return d;
+    ERR_FAIL_COND_V(w <= 0 || h <= 0 || m_size == 0, heights);
+
+    heights.resize(w * h);
+
+    int x1 = region.pos.x;
+    int y1 = region.pos.y;
+    int stride = m_size + 1;
+
+    DVector<uint8_t>::Read r = m_heights.read();
+    DVector<real_t>::Write dst = heights.write();
+
+    for (int j = 0; j < h; j++) {
+        const uint8_t* row = &r[CLAMP(y1 + j, 0, m_size) * stride * 2];
+
+        for (int i = 0; i < w; i++) {
+            dst[j * w + i] = decode_height(&row[CLAMP(x1 + i, 0, m_size) * 2]);
+        }
+    }
+
+    return heights;
 }
 
-void TerrainData::_bind_methods()
+void TerrainData::set_height_region(const Rect2& region, const DVector<real_t>& heights)
 {
-    ObjectTypeDB::bind_method(_MD("get_heights"), &TerrainData::get_heights);
-    ObjectTypeDB::bind_method(_MD("get_blends"), &TerrainData::get_blends);
+    int w = region.size.x;
+    int h = region.size.y;
 
-    ObjectTypeDB::bind_method(_MD("get_size"), &TerrainData::get_size);
-    ObjectTypeDB::bind_method(_MD("set_size", "size"), &TerrainData::set_size);
+    ERR_EXPLAIN("Expected region.size.x * region.size.y heights");
+    ERR_FAIL_COND(w <= 0 || h <= 0 || heights.size() != w * h);
+    ERR_FAIL_COND(m_size == 0);
 
-    ADD_PROPERTY(PropertyInfo(Variant::INT, "size"), _SCS("set_size"), _SCS("get_size"));
+    int stride = m_size + 1;
 
-    ObjectTypeDB::bind_method(_MD("_set_data", "data"), &TerrainData::_set_data);
-    ObjectTypeDB::bind_method(_MD("_get_data"), &TerrainData::_get_data);
+    int x1 = MAX(region.pos.x, 0);
+    int y1 = MAX(region.pos.y, 0);
+    int x2 = MIN(region.pos.x + w, stride);
+    int y2 = MIN(region.pos.y + h, stride);
 
-    ADD_PROPERTY(PropertyInfo(Variant::DICTIONARY, "_data", PROPERTY_HINT_NONE, "", PROPERTY_USAGE_NOEDITOR), _SCS("_set_data"), _SCS("_get_data"));
+    if (x1 >= x2 || y1 >= y2) {
+        return;
+    }
 
-    ADD_SIGNAL(MethodInfo("size_changed"));
+    DVector<real_t>::Read src = heights.read();
+    DVector<uint8_t>::Write dst = m_heights.write();
+
+    for (int y = y1; y < y2; y++) {
+        int row = (y - (int)region.pos.y) * w - (int)region.pos.x;
+
+        for (int x = x1; x < x2; x++) {
+            encode_height(&dst[(y * stride + x) * 2], src[row + x]);
+        }
+    }
+
+    dst = DVector<uint8_t>::Write();
+    src = DVector<real_t>::Read();
+
+    heights_changed(Rect2(x1, y1, x2 - x1, y2 - y1));
+}
+
+DVector<uint8_t> TerrainData::get_blend_region(const Rect2& region) const
+{
+    DVector<uint8_t> blends;
+
+    int w = region.size.x;
+    int h = region.size.y;
+
+    ERR_FAIL_COND_V(w <= 0 || h <= 0 || m_size == 0, blends);
+
+    _page_in(LAYER_BLENDS);
+
+    blends.resize(w * h * 4);
+
+    int x1 = region.pos.x;
+    int y1 = region.pos.y;
+
+    DVector<uint8_t>::Read r = m_blends.read();
+    DVector<uint8_t>::Write dst = blends.write();
+
+    for (int j = 0; j < h; j++) {
+        const uint8_t* row = &r[CLAMP(y1 + j, 0, m_size - 1) * m_size * 4];
+
+        for (int i = 0; i < w; i++) {
+            copymem(&dst[(j * w + i) * 4], &row[CLAMP(x1 + i, 0, m_size - 1) * 4], 4);
+        }
+    }
+
+    return blends;
+}
+
+void TerrainData::set_blend_region(const Rect2& region, const DVector<uint8_t>& blends)
+{
+    int w = region.size.x;
+    int h = region.size.y;
+
+    ERR_EXPLAIN("Expected region.size.x * region.size.y * 4 bytes");
+    ERR_FAIL_COND(w <= 0 || h <= 0 || blends.size() != w * h * 4);
+
+    int x1 = MAX(region.pos.x, 0);
+    int y1 = MAX(region.pos.y, 0);
+    int x2 = MIN(region.pos.x + w, m_size);
+    int y2 = MIN(region.pos.y + h, m_size);
+
+    if (x1 >= x2 || y1 >= y2) {
+        return;
+    }
+
+    DVector<uint8_t>& buffer = get_blend_buffer();
+
+    DVector<uint8_t>::Read src = blends.read();
+    DVector<uint8_t>::Write dst = buffer.write();
+
+    // whole rows at once
+    for (int y = y1; y < y2; y++) {
+        int sx = x1 - (int)region.pos.x;
+        int sy = y - (int)region.pos.y;
+
+        copymem(&dst[(y * m_size + x1) * 4], &src[(sy * w + sx) * 4], (x2 - x1) * 4);
+    }
+
+    dst = DVector<uint8_t>::Write();
+    src = DVector<uint8_t>::Read();
+
+    blends_changed(Rect2(x1, y1, x2 - x1, y2 - y1));
+}
+
+/* replication */
+
+// residuals are written as separate high and low byte planes of zigzag
+// coded values, mostly zeros either way, which deflate packs well
+static inline uint16_t _zigzag(int16_t v)
+{
+    return (uint16_t)((v << 1) ^ (v >> 15));
+}
+
+static inline int16_t _unzigzag(uint16_t v)
+{
+    return (int16_t)((v >> 1) ^ -(int)(v & 1));
+}
+
+// a step of 1 is lossless, the 16 bit sum wraps
+static inline int _dequantize(int base, int residual, int step)
+{
+    if (step == 1) {
+        return (base + residual) & 0xFFFF;
+    }
+
+    return CLAMP(base + residual * step, 0, 65535);
+}
+
+int TerrainData::_get_tile_count() const
+{
+    return (m_size + TILE_SIZE) / TILE_SIZE; // covers the (size + 1)^2 heights
+}
+
+// heights and lighting cover (size + 1)^2 texels, blends size^2
+void TerrainData::_get_tile_rect(int tile, int flag, int& x1, int& y1, int& x2, int& y2) const
+{
+    int tiles = _get_tile_count();
+    int extent = flag == TILE_BLENDS ? m_size : m_size + 1;
+
+    int ty = tile / tiles;
+    int tx = tile - ty * tiles;
+
+    x1 = tx * TILE_SIZE;
+    y1 = ty * TILE_SIZE;
+    x2 = MAX(MIN(x1 + TILE_SIZE, extent), x1);
+    y2 = MAX(MIN(y1 + TILE_SIZE, extent), y1);
+}
+
+void TerrainData::_mark_tiles(const Rect2& region, int flag)
+{
+    int tiles = _get_tile_count();
+
+    if (m_save_tiles.size() != tiles * tiles || region.has_no_area()) {
+        return;
+    }
+
+    int tx1 = CLAMP((int)region.pos.x / TILE_SIZE, 0, tiles - 1);
+    int ty1 = CLAMP((int)region.pos.y / TILE_SIZE, 0, tiles - 1);
+    int tx2 = CLAMP((int)(region.pos.x + region.size.x - 1) / TILE_SIZE, 0, tiles - 1);
+    int ty2 = CLAMP((int)(region.pos.y + region.size.y - 1) / TILE_SIZE, 0, tiles - 1);
+
+    bool replicate = !m_delta_tiles.empty();
+
+    for (int ty = ty1; ty <= ty2; ty++) {
+        for (int tx = tx1; tx <= tx2; tx++) {
+            m_save_tiles[ty * tiles + tx] |= flag;
+
+            if (replicate) {
+                m_delta_tiles[ty * tiles + tx] |= flag & (TILE_HEIGHTS | TILE_BLENDS);
+            }
+        }
+    }
+}
+
+void TerrainData::_reset_delta()
+{
+    m_delta_heights.resize(0);
+    m_delta_blends.resize(0);
+    m_delta_tiles.clear();
+}
+
+int TerrainData::get_delta_version() const
+{
+    return m_delta_version;
+}
+
+void TerrainData::set_delta_version(int version)
+{
+    m_delta_version = version;
+}
+
+void TerrainData::set_delta_height_step(float step)
+{
+    m_delta_step = CLAMP(Math::fast_ftoi(step * TERRAIN_HEIGHT_SCALE), 1, 1024);
+}
+
+float TerrainData::get_delta_height_step() const
+{
+    return m_delta_step / TERRAIN_HEIGHT_SCALE;
+}
+
+DVector<uint8_t> TerrainData::make_delta()
+{
+    DVector<uint8_t> delta;
+
+    ERR_FAIL_COND_V(m_size == 0, delta);
+
+    _page_in(LAYER_BLENDS);
+
+    int tiles = _get_tile_count();
+
+    // the copies are shared until the next edit
+    if (m_delta_tiles.empty()) {
+        m_delta_heights = m_heights;
+        m_delta_blends = m_blends;
+        m_delta_tiles.resize(tiles * tiles);
+
+        for (int i = 0; i < m_delta_tiles.size(); i++) {
+            m_delta_tiles[i] = 0;
+        }
+
+        return delta;
+    }
+
+    int stride = m_size + 1;
+    int step = m_delta_step;
+    int count = 0;
+
+    // step, tile count, then per tile its index, flags and residual planes
+    Vector<uint8_t> body;
+    body.resize(8);
+
+    DVector<uint8_t>::Read hr = m_heights.read();
+    DVector<uint8_t>::Read br = m_blends.read();
+    DVector<uint8_t>::Write bhw = m_delta_heights.write();
+    DVector<uint8_t>::Write bbw = m_delta_blends.write();
+
+    for (int t = 0; t < tiles * tiles; t++) {
+        int flags = m_delta_tiles[t];
+
+        if (!flags) {
+            continue;
+        }
+
+        m_delta_tiles[t] = 0;
+
+        int ty = t / tiles;
+        int tx = t - ty * tiles;
+        int x1 = tx * TILE_SIZE;
+        int y1 = ty * TILE_SIZE;
+
+        int pos = body.size();
+        body.resize(pos + 5);
+        encode_uint32(t, &body[pos]);
+        body[pos + 4] = flags;
+
+        if (flags & TILE_HEIGHTS) {
+            int x2 = MIN(x1 + TILE_SIZE, stride);
+            int y2 = MIN(y1 + TILE_SIZE, stride);
+            int n = (x2 - x1) * (y2 - y1);
+
+            pos = body.size();
+            body.resize(pos + n * 2);
+
+            uint8_t* hi = &body[pos];
+            uint8_t* lo = hi + n;
+            int k = 0;
+
+            for (int y = y1; y < y2; y++) {
+                for (int x = x1; x < x2; x++) {
+                    int o = (y * stride + x) * 2;
+                    int cur = (hr[o] << 8) | hr[o + 1];
+                    int base = (bhw[o] << 8) | bhw[o + 1];
+                    int r = cur - base;
+                    int q = r >= 0 ? (r + step / 2) / step : -((-r + step / 2) / step);
+
+                    if (step > 1) {
+                        q = CLAMP(q, -32767, 32767);
+                    }
+
+                    uint16_t zz = _zigzag((int16_t)q);
+
+                    hi[k] = zz >> 8;
+                    lo[k] = zz & 0xFF;
+                    k++;
+
+                    // the baseline follows what receivers end up with
+                    int v = _dequantize(base, (int16_t)q, step);
+
+                    bhw[o] = v >> 8;
+                    bhw[o + 1] = v & 0xFF;
+                }
+            }
+        }
+
+        if (flags & TILE_BLENDS) {
+            int x2 = MIN(x1 + TILE_SIZE, m_size);
+            int y2 = MIN(y1 + TILE_SIZE, m_size);
+            int n = MAX(x2 - x1, 0) * MAX(y2 - y1, 0);
+
+            pos = body.size();
+            body.resize(pos + n * 4);
+
+            uint8_t* planes = &body[pos];
+            int k = 0;
+
+            for (int y = y1; y < y2; y++) {
+                for (int x = x1; x < x2; x++) {
+                    int o = (y * m_size + x) * 4;
+
+                    for (int c = 0; c < 4; c++) {
+                        planes[c * n + k] = br[o + c] - bbw[o + c];
+                        bbw[o + c] = br[o + c];
+                    }
+
+                    k++;
+                }
+            }
+        }
+
+        count++;
+    }
+
+    hr = DVector<uint8_t>::Read();
+    br = DVector<uint8_t>::Read();
+    bhw = DVector<uint8_t>::Write();
+    bbw = DVector<uint8_t>::Write();
+
+    if (count == 0) {
+        return delta;
+    }
+
+    encode_uint32(step, &body[0]);
+    encode_uint32(count, &body[4]);
+
+    delta.resize(DELTA_HEADER_SIZE + Compression::get_max_compressed_buffer_size(body.size(), Compression::MODE_DEFLATE));
+
+    DVector<uint8_t>::Write w = delta.write();
+
+    w[0] = 'T';
+    w[1] = 'D';
+    w[2] = 'L';
+    w[3] = 'T';
+    encode_uint32(m_delta_version, &w[4]);
+    encode_uint32(m_delta_version + 1, &w[8]);
+    encode_uint32(m_size, &w[12]);
+    encode_uint32(body.size(), &w[16]);
+
+    int len = Compression::compress(&w[DELTA_HEADER_SIZE], &body[0], body.size(), Compression::MODE_DEFLATE);
+
+    w = DVector<uint8_t>::Write();
+
+    delta.resize(DELTA_HEADER_SIZE + len);
+    m_delta_version++;
+
+    return delta;
+}
+
+Error TerrainData::apply_delta(const DVector<uint8_t>& delta)
+{
+    ERR_FAIL_COND_V(delta.size() < DELTA_HEADER_SIZE, ERR_INVALID_DATA);
+
+    DVector<uint8_t>::Read r = delta.read();
+
+    ERR_FAIL_COND_V(r[0] != 'T' || r[1] != 'D' || r[2] != 'L' || r[3] != 'T', ERR_INVALID_DATA);
+
+    uint32_t from = decode_uint32(&r[4]);
+    uint32_t to = decode_uint32(&r[8]);
+    int size = decode_uint32(&r[12]);
+    uint32_t raw_size = decode_uint32(&r[16]);
+
+    ERR_EXPLAIN("Terrain delta is for version " + itos(from) + " of a " + itos(size) + " map");
+    ERR_FAIL_COND_V(from != m_delta_version || size != m_size, ERR_INVALID_PARAMETER);
+
+    // no more than every tile with full height and blend planes
+    int tiles = _get_tile_count();
+    uint64_t max_size = 8 + (uint64_t)tiles * tiles * (5 + TILE_SIZE * TILE_SIZE * 6);
+
+    ERR_FAIL_COND_V(raw_size < 8 || raw_size > max_size, ERR_FILE_CORRUPT);
+
+    Vector<uint8_t> body;
+    body.resize(raw_size);
+
+    int len = Compression::decompress(&body[0], raw_size, &r[DELTA_HEADER_SIZE], delta.size() - DELTA_HEADER_SIZE, Compression::MODE_DEFLATE);
+
+    r = DVector<uint8_t>::Read();
+
+    ERR_FAIL_COND_V(len != (int)raw_size, ERR_FILE_CORRUPT);
+
+    int step = decode_uint32(&body[0]);
+    int count = decode_uint32(&body[4]);
+    int stride = m_size + 1;
+
+    ERR_FAIL_COND_V(step < 1 || step > 1024 || count < 0, ERR_FILE_CORRUPT);
+
+    _page_in(LAYER_BLENDS);
+
+    Vector<Rect2> height_rects;
+    Vector<Rect2> blend_rects;
+
+    DVector<uint8_t>::Write hw;
+    DVector<uint8_t>::Write bw;
+
+    // the first pass only walks the records, so a broken delta fails before
+    // anything was written and the map stays at its version
+    for (int pass = 0; pass < 2; pass++) {
+        bool write = pass == 1;
+        int pos = 8;
+
+        if (write) {
+            hw = m_heights.write();
+            bw = m_blends.write();
+        }
+
+        for (int i = 0; i < count; i++) {
+            ERR_FAIL_COND_V(pos + 5 > (int)raw_size, ERR_FILE_CORRUPT);
+
+            int t = decode_uint32(&body[pos]);
+            int flags = body[pos + 4];
+            pos += 5;
+
+            ERR_FAIL_COND_V(t < 0 || t >= tiles * tiles, ERR_FILE_CORRUPT);
+
+            int ty = t / tiles;
+            int tx = t - ty * tiles;
+            int x1 = tx * TILE_SIZE;
+            int y1 = ty * TILE_SIZE;
+
+            if (flags & TILE_HEIGHTS) {
+                int x2 = MIN(x1 + TILE_SIZE, stride);
+                int y2 = MIN(y1 + TILE_SIZE, stride);
+                int n = (x2 - x1) * (y2 - y1);
+
+                ERR_FAIL_COND_V(pos + n * 2 > (int)raw_size, ERR_FILE_CORRUPT);
+
+                if (write) {
+                    const uint8_t* hi = &body[pos];
+                    const uint8_t* lo = hi + n;
+                    int k = 0;
+
+                    for (int y = y1; y < y2; y++) {
+                        for (int x = x1; x < x2; x++) {
+                            int o = (y * stride + x) * 2;
+                            int base = (hw[o] << 8) | hw[o + 1];
+                            int v = _dequantize(base, _unzigzag((hi[k] << 8) | lo[k]), step);
+
+                            hw[o] = v >> 8;
+                            hw[o + 1] = v & 0xFF;
+                            k++;
+                        }
+                    }
+
+                    height_rects.push_back(Rect2(x1, y1, x2 - x1, y2 - y1));
+                }
+
+                pos += n * 2;
+            }
+
+            if (flags & TILE_BLENDS) {
+                int x2 = MIN(x1 + TILE_SIZE, m_size);
+                int y2 = MIN(y1 + TILE_SIZE, m_size);
+                int n = MAX(x2 - x1, 0) * MAX(y2 - y1, 0);
+
+                ERR_FAIL_COND_V(pos + n * 4 > (int)raw_size, ERR_FILE_CORRUPT);
+
+                if (write && n > 0) {
+                    const uint8_t* planes = &body[pos];
+                    int k = 0;
+
+                    for (int y = y1; y < y2; y++) {
+                        for (int x = x1; x < x2; x++) {
+                            int o = (y * m_size + x) * 4;
+
+                            for (int c = 0; c < 4; c++) {
+                                bw[o + c] += planes[c * n + k];
+                            }
+
+                            k++;
+                        }
+                    }
+
+                    blend_rects.push_back(Rect2(x1, y1, x2 - x1, y2 - y1));
+                }
+
+                pos += n * 4;
+            }
+        }
+    }
+
+    hw = DVector<uint8_t>::Write();
+    bw = DVector<uint8_t>::Write();
+
+    m_delta_version = to;
+
+    // one upload, then terrains rebuild only the touched tiles
+    if (!height_rects.empty()) {
+        reload_heights();
+
+        for (int i = 0; i < height_rects.size(); i++) {
+            emit_signal("heights_changed", height_rects[i]);
+        }
+    }
+
+    if (!blend_rects.empty()) {
+        m_modified[LAYER_BLENDS] = true;
+
+        for (int i = 0; i < blend_rects.size(); i++) {
+            emit_signal("blends_changed", blend_rects[i]);
+        }
+    }
+
+    return OK;
+}
+
+/* journal */
+
+// a header with the modification time of the resource it belongs to and the
+// map size, then records of a tile index, flags, sizes and the compressed
+// height and blend rows of the tile. Later records win
+String TerrainData::_get_journal_path() const
+{
+    return get_path() + ".journal";
+}
+
+bool TerrainData::_read_journal_header(FileAccess* f, uint64_t stamp) const
+{
+    uint8_t magic[4];
+
+    if (f->get_buffer(magic, 4) != 4 || magic[0] != 'T' || magic[1] != 'J' || magic[2] != 'N' || magic[3] != 'L') {
+        return false;
+    }
+
+    uint64_t journal_stamp = f->get_64();
+    int size = f->get_32();
+
+    return !f->eof_reached() && journal_stamp == stamp && size == m_size;
+}
+
+void TerrainData::_reset_save_tiles()
+{
+    int tiles = _get_tile_count();
+
+    m_save_tiles.resize(m_size > 0 ? tiles * tiles : 0);
+
+    for (int i = 0; i < m_save_tiles.size(); i++) {
+        m_save_tiles[i] = 0;
+    }
+}
+
+void TerrainData::_resource_path_changed()
+{
+    if (!m_journal_pending) {
+        return;
+    }
+
+    m_journal_pending = false;
+    _load_journal(get_path());
+}
+
+void TerrainData::replay_journal(const String& path)
+{
+    m_journal_pending = false;
+    _load_journal(path);
+}
+
+void TerrainData::_load_journal(const String& path)
+{
+    if (!path.is_resource_file() || m_size == 0) {
+        return;
+    }
+
+    FileAccess* f = FileAccess::open(path + ".journal", FileAccess::READ);
+
+    if (!f) {
+        return;
+    }
+
+    // left over from before the last full save
+    if (!_read_journal_header(f, FileAccess::get_modified_time(path))) {
+        memdelete(f);
+        return;
+    }
+
+    int tiles = _get_tile_count();
+    int stride = m_size + 1;
+    int flags_seen = 0;
+
+    Vector<uint8_t> packed;
+    Vector<uint8_t> raw;
+
+    // lighting records are dropped when the resource has none
+    bool lighting = m_lighting.size() == stride * stride * 2;
+
+    DVector<uint8_t>::Write hw = m_heights.write();
+    DVector<uint8_t>::Write bw = m_blends.write();
+    DVector<uint8_t>::Write lw = m_lighting.write();
+
+    while (f->get_pos() + 13 <= f->get_len()) {
+        int t = f->get_32();
+        int flags = f->get_8();
+        int len = f->get_32();
+        int raw_size = f->get_32();
+
+        // cut short while writing
+        if (t < 0 || t >= tiles * tiles || len <= 0 || raw_size <= 0 || f->get_pos() + len > f->get_len()) {
+            break;
+        }
+
+        packed.resize(len);
+        raw.resize(raw_size);
+        f->get_buffer(&packed[0], len);
+
+        if (Compression::decompress(&raw[0], raw_size, &packed[0], len, Compression::MODE_FASTLZ) != raw_size) {
+            break;
+        }
+
+        const uint8_t* src = &raw[0];
+        const uint8_t* end = src + raw_size;
+        int x1, y1, x2, y2;
+
+        if (flags & TILE_HEIGHTS) {
+            _get_tile_rect(t, TILE_HEIGHTS, x1, y1, x2, y2);
+
+            for (int y = y1; y < y2 && src + (x2 - x1) * 2 <= end; y++) {
+                copymem(&hw[(y * stride + x1) * 2], src, (x2 - x1) * 2);
+                src += (x2 - x1) * 2;
+            }
+        }
+
+        if (flags & TILE_BLENDS) {
+            _get_tile_rect(t, TILE_BLENDS, x1, y1, x2, y2);
+
+            for (int y = y1; y < y2 && src + (x2 - x1) * 4 <= end; y++) {
+                copymem(&bw[(y * m_size + x1) * 4], src, (x2 - x1) * 4);
+                src += (x2 - x1) * 4;
+            }
+        }
+
+        if ((flags & TILE_LIGHTING) && lighting) {
+            _get_tile_rect(t, TILE_LIGHTING, x1, y1, x2, y2);
+
+            for (int y = y1; y < y2 && src + (x2 - x1) * 2 <= end; y++) {
+                copymem(&lw[(y * stride + x1) * 2], src, (x2 - x1) * 2);
+                src += (x2 - x1) * 2;
+            }
+        }
+
+        // still not in the resource file, keeps appending and marks it modified
+        m_save_tiles[t] |= flags;
+        flags_seen |= flags;
+    }
+
+    hw = DVector<uint8_t>::Write();
+    bw = DVector<uint8_t>::Write();
+    lw = DVector<uint8_t>::Write();
+
+    memdelete(f);
+
+    // the saved resource is older, paging it back in would lose the journal
+    if (flags_seen & TILE_BLENDS) {
+        m_modified[LAYER_BLENDS] = true;
+    }
+
+    if (flags_seen & TILE_LIGHTING) {
+        m_modified[LAYER_LIGHTING] = true;
+    }
+
+    reload_heights();
+    _reload_lighting();
+}
+
+Error TerrainData::save_journal()
+{
+    String path = get_path();
+
+    ERR_EXPLAIN("Only terrain data saved to a file of its own can be journaled");
+    ERR_FAIL_COND_V(!path.is_resource_file(), ERR_UNCONFIGURED);
+
+    if (m_save_full || !FileAccess::exists(path)) {
+        return _save_full();
+    }
+
+    uint32_t benchmark = OS::get_singleton()->get_ticks_msec();
+
+    uint64_t stamp = FileAccess::get_modified_time(path);
+    String journal_path = _get_journal_path();
+    FileAccess* f = NULL;
+
+    // appends to the journal of this version of the file, anything else is stale
+    if (FileAccess::exists(journal_path)) {
+        f = FileAccess::open(journal_path, FileAccess::READ_WRITE);
+
+        if (f && !_read_journal_header(f, stamp)) {
+            memdelete(f);
+            f = NULL;
+        }
+    }
+
+    if (!f) {
+        f = FileAccess::open(journal_path, FileAccess::WRITE);
+
+        ERR_FAIL_COND_V(!f, ERR_CANT_CREATE);
+
+        f->store_buffer((const uint8_t*)"TJNL", 4);
+        f->store_64(stamp);
+        f->store_32(m_size);
+    }
+
+    f->seek_end();
+
+    _page_in(LAYER_BLENDS);
+    _page_in(LAYER_LIGHTING);
+
+    int tiles = _get_tile_count();
+    int stride = m_size + 1;
+    int count = 0;
+
+    Vector<uint8_t> raw;
+    Vector<uint8_t> packed;
+
+    bool lighting = has_lighting();
+
+    DVector<uint8_t>::Read hr = m_heights.read();
+    DVector<uint8_t>::Read br = m_blends.read();
+    DVector<uint8_t>::Read lr = m_lighting.read();
+
+    for (int t = 0; t < m_save_tiles.size(); t++) {
+        int flags = m_save_tiles[t];
+
+        if (!lighting) {
+            flags &= ~TILE_LIGHTING;
+        }
+
+        if (!flags) {
+            continue;
+        }
+
+        int x1, y1, x2, y2;
+        raw.clear();
+
+        if (flags & TILE_HEIGHTS) {
+            _get_tile_rect(t, TILE_HEIGHTS, x1, y1, x2, y2);
+
+            for (int y = y1; y < y2; y++) {
+                int pos = raw.size();
+                raw.resize(pos + (x2 - x1) * 2);
+                copymem(&raw[pos], &hr[(y * stride + x1) * 2], (x2 - x1) * 2);
+            }
+        }
+
+        if (flags & TILE_BLENDS) {
+            _get_tile_rect(t, TILE_BLENDS, x1, y1, x2, y2);
+
+            for (int y = y1; y < y2 && x2 > x1; y++) {
+                int pos = raw.size();
+                raw.resize(pos + (x2 - x1) * 4);
+                copymem(&raw[pos], &br[(y * m_size + x1) * 4], (x2 - x1) * 4);
+            }
+        }
+
+        if (flags & TILE_LIGHTING) {
+            _get_tile_rect(t, TILE_LIGHTING, x1, y1, x2, y2);
+
+            for (int y = y1; y < y2; y++) {
+                int pos = raw.size();
+                raw.resize(pos + (x2 - x1) * 2);
+                copymem(&raw[pos], &lr[(y * stride + x1) * 2], (x2 - x1) * 2);
+            }
+        }
+
+        if (raw.empty()) {
+            continue;
+        }
+
+        packed.resize(Compression::get_max_compressed_buffer_size(raw.size(), Compression::MODE_FASTLZ));
+        int len = Compression::compress(&packed[0], &raw[0], raw.size(), Compression::MODE_FASTLZ);
+
+        f->store_32(t);
+        f->store_8(flags);
+        f->store_32(len);
+        f->store_32(raw.size());
+        f->store_buffer(&packed[0], len);
+
+        count++;
+    }
+
+    hr = DVector<uint8_t>::Read();
+    br = DVector<uint8_t>::Read();
+    lr = DVector<uint8_t>::Read();
+
+    size_t journal_size = f->get_len();
+
+    memdelete(f);
+
+    for (int i = 0; i < m_save_tiles.size(); i++) {
+        m_save_tiles[i] = 0;
+    }
+
+    benchmark = OS::get_singleton()->get_ticks_msec() - benchmark;
+
+    if (OS::get_singleton()->is_stdout_verbose()) {
+        print_line("TerrainData::save_journal() benchmark:" + itos(benchmark) + " tiles:" + itos(count));
+    }
+
+    // compaction, replaying would take longer than loading a fresh file
+    if (journal_size > (size_t)(m_heights.size() + m_blends.size() + m_lighting.size()) / 2) {
+        return _save_full();
+    }
+
+    return OK;
+}
+
+Error TerrainData::_save_full()
+{
+    Error err = ResourceSaver::save(get_path(), Ref<Resource>(this));
+
+    ERR_FAIL_COND_V(err != OK, err);
+
+    String journal_path = _get_journal_path();
+
+    if (FileAccess::exists(journal_path)) {
+        DirAccess* da = DirAccess::create(DirAccess::ACCESS_RESOURCES);
+        da->remove(journal_path);
+        memdelete(da);
+    }
+
+    _reset_save_tiles();
+    m_save_full = false;
+
+    for (int i = 0; i < LAYER_COUNT; i++) {
+        m_modified[i] = false;
+        m_swapped[i] = false;
+    }
+
+    return OK;
+}
+
+/* smoothing */
+
+// halo texels are clamped to the map edge
+void TerrainData::_smooth_decode_rows(void* userdata, int from, int to)
+{
+    SmoothJob& job = *(SmoothJob*)userdata;
+
+    for (int j = from; j < to; j++) {
+        int y = CLAMP(job.y - job.radius + j, 0, job.stride - 1);
+        const uint8_t* row = &job.src_heights[y * job.stride * 2];
+        float* dst = &job.src[j * job.src_w];
+
+        for (int i = 0; i < job.src_w; i++) {
+            int x = CLAMP(job.x - job.radius + i, 0, job.stride - 1);
+            dst[i] = decode_height(row + x * 2);
+        }
+    }
+}
+
+// tap by tap over whole rows so the inner loop vectorizes
+void TerrainData::_smooth_h_rows(void* userdata, int from, int to)
+{
+    SmoothJob& job = *(SmoothJob*)userdata;
+    int taps = job.radius * 2 + 1;
+
+    for (int j = from; j < to; j++) {
+        const float* src = &job.src[j * job.src_w];
+        float* dst = &job.tmp[j * job.size];
+
+        for (int i = 0; i < job.size; i++) {
+            dst[i] = 0;
+        }
+
+        for (int k = 0; k < taps; k++) {
+            const float* s = src + k;
+            float w = job.kernel[k];
+
+            for (int i = 0; i < job.size; i++) {
+                dst[i] += s[i] * w;
+            }
+        }
+    }
+}
+
+void TerrainData::_smooth_v_rows(void* userdata, int from, int to)
+{
+    SmoothJob& job = *(SmoothJob*)userdata;
+    int taps = job.radius * 2 + 1;
+
+    Vector<float> row;
+    row.resize(job.size);
+    float* out = &row[0];
+
+    for (int j = from; j < to; j++) {
+        int y = job.y + j;
+
+        if (y < 0 || y >= job.stride) {
+            continue;
+        }
+
+        for (int i = 0; i < job.size; i++) {
+            out[i] = 0;
+        }
+
+        for (int k = 0; k < taps; k++) {
+            const float* t = &job.tmp[(j + k) * job.size];
+            float w = job.kernel[k];
+
+            for (int i = 0; i < job.size; i++) {
+                out[i] += t[i] * w;
+            }
+        }
+
+        // blend towards the blurred heights by the mask
+        const float* mask = &job.mask[j * job.size];
+        const float* cur = &job.src[(j + job.radius) * job.src_w + job.radius];
+        uint8_t* texels = &job.heights[y * job.stride * 2];
+
+        for (int i = MAX(-job.x, 0); i < MIN(job.size, job.stride - job.x); i++) {
+            float t = mask[i] * job.strength;
+            encode_height(texels + (job.x + i) * 2, cur[i] + (out[i] - cur[i]) * t);
+        }
+    }
+}
+
+void TerrainData::smooth_height(const float* mask, int size, int x, int y, float strength)
+{
+    int stride = m_size + 1;
+
+    if (!mask || size <= 0 || strength <= 0 || x >= stride || y >= stride || x + size <= 0 || y + size <= 0) {
+        return;
+    }
+
+    // wider brushes blur wider
+    int radius = CLAMP(size / 8, 1, 16);
+    int taps = radius * 2 + 1;
+    float sigma = radius * 0.5f;
+
+    Vector<float> kernel;
+    kernel.resize(taps);
+
+    float sum = 0;
+
+    for (int k = 0; k < taps; k++) {
+        float d = k - radius;
+        kernel[k] = Math::exp(-d * d / (2.0f * sigma * sigma));
+        sum += kernel[k];
+    }
+
+    for (int k = 0; k < taps; k++) {
+        kernel[k] /= sum;
+    }
+
+    SmoothJob job;
+    job.stride = stride;
+    job.x = x;
+    job.y = y;
+    job.size = size;
+    job.radius = radius;
+    job.src_w = size + radius * 2;
+    job.kernel = &kernel[0];
+    job.mask = mask;
+    job.strength = CLAMP(strength, 0.0f, 1.0f);
+
+    Vector<float> src;
+    Vector<float> tmp;
+    src.resize(job.src_w * job.src_w);
+    tmp.resize(job.src_w * size);
+    job.src = &src[0];
+    job.tmp = &tmp[0];
+
+    // the blend reads the decoded copy, so writing in place is fine
+    DVector<uint8_t>::Write w = m_heights.write();
+    job.src_heights = w.ptr();
+    job.heights = w.ptr();
+
+    TerrainThreads::run(_smooth_decode_rows, &job, job.src_w, BRUSH_BAND_ROWS);
+    TerrainThreads::run(_smooth_h_rows, &job, job.src_w, BRUSH_BAND_ROWS);
+    TerrainThreads::run(_smooth_v_rows, &job, size, BRUSH_BAND_ROWS);
+
+    _mark_tiles(Rect2(x, y, size, size), TILE_HEIGHTS);
+}
+
+// applies a round stamp in texel space without uploading anything,
+// returns the texels it touched
+Rect2 TerrainData::stamp_height(int mode, const Vector2& center, float radius, float strength, float falloff, float height)
+{
+    int stride = m_size + 1;
+
+    int x1 = MAX(Math::floor(center.x - radius), 0);
+    int y1 = MAX(Math::floor(center.y - radius), 0);
+    int x2 = MIN(Math::ceil(center.x + radius), m_size);
+    int y2 = MIN(Math::ceil(center.y + radius), m_size);
+
+    if (radius <= 0 || x1 > x2 || y1 > y2) {
+        return Rect2();
+    }
+
+    // full strength inside, smooth fade over the outer 'falloff' part of the radius
+    float inner = radius * (1.0f - CLAMP(falloff, 0, 1));
+
+    DVector<uint8_t>::Write w = m_heights.write();
+
+    for (int y = y1; y <= y2; y++) {
+        for (int x = x1; x <= x2; x++) {
+            float d = center.distance_to(Vector2(x, y));
+
+            if (d >= radius) {
+                continue;
+            }
+
+            float mask = 1.0f;
+
+            if (d > inner) {
+                float t = (radius - d) / (radius - inner);
+                mask = t * t * (3.0f - 2.0f * t);
+            }
+
+            uint8_t* texel = &w[(y * stride + x) * 2];
+            float h = decode_height(texel);
+
+            switch (mode) {
+            case STAMP_RAISE:
+                h += strength * mask;
+                break;
+            case STAMP_LOWER:
+                h -= strength * mask;
+                break;
+            case STAMP_CRATER: {
+                float r = d / radius;
+                h -= strength * (1.0f - r * r) * mask;
+                break;
+            }
+            case STAMP_FLATTEN:
+                h += (height - h) * CLAMP(strength, 0, 1) * mask;
+                break;
+            }
+
+            encode_height(texel, h);
+        }
+    }
+
+    return Rect2(x1, y1, x2 - x1 + 1, y2 - y1 + 1);
+}
+
+float TerrainData::get_height_at(int x, int y)
+{
+    ERR_FAIL_COND_V(m_size == 0, 0);
+
+    if (x < 0) x = 0;
+    if (y < 0) y = 0;
+
+    if (x > m_size) x = m_size;
+    if (y > m_size) y = m_size;
+
+    int offset = y * (m_size + 1) + x;
+
+    DVector<uint8_t>::Read r = m_heights.read();
+
+    return decode_height(&r[offset * 2]);
+}
+
+void TerrainData::set_height_at(int x, int y, float h)
+{
+    ERR_FAIL_COND(m_size == 0);
+
+    if (x < 0) x = 0;
+    if (y < 0) y = 0;
+
+    if (x > m_size) x = m_size;
+    if (y > m_size) y = m_size;
+
+    int offset = y * (m_size + 1) + x;
+
+    DVector<uint8_t>::Write w = m_heights.write();
+
+    encode_height(&w[offset * 2], h);
+
+    _mark_tiles(Rect2(x, y, 1, 1), TILE_HEIGHTS);
+}
+
+void TerrainData::_size_changed()
+{
+    m_heights.resize((m_size + 1) * (m_size + 1) * 2);
+    m_blends.resize(m_size * m_size * 4);
+
+    DVector<uint8_t>::Write w = m_heights.write();
+
+    for (int i = 0; i < m_heights.size(); i++) {
+        w[i] = 0;
+    }
+
+    w = m_blends.write();
+
+    for (int i = 0; i < m_blends.size(); i++) {
+        w[i] = 0;
+    }
+
+    w = DVector<uint8_t>::Write();
+
+    _layers_resized();
+}
+
+// heights and blends already have the new size
+void TerrainData::_layers_resized()
+{
+    // stale bakes don't line up anymore
+    m_lighting.resize(0);
+
+    for (int i = 0; i < LAYER_COUNT; i++) {
+        m_resident[i] = true;
+        m_modified[i] = true;
+        m_swapped[i] = false;
+    }
+
+    // receivers have to start over from the whole map, and so does the file
+    _reset_delta();
+    _reset_save_tiles();
+    m_save_full = true;
+
+    if (m_heights_tex.is_valid()) {
+        VS::get_singleton()->texture_allocate(m_heights_tex, m_size + 1, m_size + 1, Image::FORMAT_GRAYSCALE_ALPHA, 0);
+        reload_heights();
+    }
+
+    emit_signal(String("size_changed"));
+}
+
+/* resize */
+
+// catmull-rom through b and c
+static inline float _cubic(float a, float b, float c, float d, float t)
+{
+    return b + 0.5f * t * (c - a + t * (2.0f * a - 5.0f * b + 4.0f * c - d + t * (3.0f * (b - c) + d - a)));
+}
+
+// corner vertices stay on the corners
+void TerrainData::_resize_height_rows(void* userdata, int from, int to)
+{
+    ResizeJob& job = *(ResizeJob*)userdata;
+
+    int src_n = job.src_size + 1;
+    int n = job.size + 1;
+    float scale = (float)job.src_size / job.size;
+
+    for (int y = from; y < to; y++) {
+        uint8_t* row = &job.heights[y * n * 2];
+
+        for (int x = 0; x < n; x++) {
+            float h;
+
+            if (job.mode == RESIZE_CROP) {
+                // padding repeats the edge
+                int sx = MIN(x, job.src_size);
+                int sy = MIN(y, job.src_size);
+
+                h = job.src_heights[sy * src_n + sx];
+            }
+            else {
+                float fx = x * scale;
+                float fy = y * scale;
+                int ix = (int)fx;
+                int iy = (int)fy;
+                float tx = fx - ix;
+                float ty = fy - iy;
+
+                int cols[4];
+
+                for (int i = 0; i < 4; i++) {
+                    cols[i] = CLAMP(ix + i - 1, 0, job.src_size);
+                }
+
+                float rows[4];
+
+                for (int j = 0; j < 4; j++) {
+                    const float* src = &job.src_heights[CLAMP(iy + j - 1, 0, job.src_size) * src_n];
+
+                    rows[j] = _cubic(src[cols[0]], src[cols[1]], src[cols[2]], src[cols[3]], tx);
+                }
+
+                h = _cubic(rows[0], rows[1], rows[2], rows[3], ty);
+            }
+
+            encode_height(&row[x * 2], h);
+        }
+    }
+}
+
+// texel centers are mapped, the layer weights of the four neighbours are
+// summed per layer and encode_blend() keeps and renormalizes the largest
+void TerrainData::_resize_blend_rows(void* userdata, int from, int to)
+{
+    ResizeJob& job = *(ResizeJob*)userdata;
+
+    int src_size = job.src_size;
+    float scale = (float)src_size / job.size;
+
+    for (int y = from; y < to; y++) {
+        for (int x = 0; x < job.size; x++) {
+            uint8_t* texel = &job.blends[(y * job.size + x) * 4];
+
+            if (job.mode == RESIZE_CROP) {
+                if (x < src_size && y < src_size) {
+                    copymem(texel, &job.src_blends[(y * src_size + x) * 4], 4);
+                }
+                else {
+                    texel[0] = texel[1] = texel[2] = texel[3] = 0; // base layer
+                }
+
+                continue;
+            }
+
+            float fx = CLAMP((x + 0.5f) * scale - 0.5f, 0.0f, src_size - 1.0f);
+            float fy = CLAMP((y + 0.5f) * scale - 0.5f, 0.0f, src_size - 1.0f);
+            int x0 = fx;
+            int y0 = fy;
+            int x1 = MIN(x0 + 1, src_size - 1);
+            int y1 = MIN(y0 + 1, src_size - 1);
+            float tx = fx - x0;
+            float ty = fy - y0;
+
+            int sx[4] = { x0, x1, x0, x1 };
+            int sy[4] = { y0, y0, y1, y1 };
+            float sw[4] = { (1 - tx) * (1 - ty), tx * (1 - ty), (1 - tx) * ty, tx * ty };
+
+            int layers[12];
+            float weights[12];
+            int count = 0;
+
+            for (int s = 0; s < 4; s++) {
+                int l[3];
+                float w[3];
+                decode_blend(&job.src_blends[(sy[s] * src_size + sx[s]) * 4], l, w);
+
+                for (int k = 0; k < 3; k++) {
+                    float wk = w[k] * sw[s];
+
+                    if (wk <= 0) {
+                        continue;
+                    }
+
+                    int m = 0;
+
+                    while (m < count && layers[m] != l[k]) {
+                        m++;
+                    }
+
+                    if (m == count) {
+                        layers[count] = l[k];
+                        weights[count] = 0;
+                        count++;
+                    }
+
+                    weights[m] += wk;
+                }
+            }
+
+            encode_blend(texel, layers, weights, count);
+        }
+    }
+}
+
+void TerrainData::resize(int new_size, int mode)
+{
+    ERR_FAIL_COND(new_size <= 0);
+    ERR_FAIL_INDEX(mode, RESIZE_CROP + 1);
+
+    if (new_size == m_size) {
+        return;
+    }
+
+    if (m_size == 0) {
+        set_size(new_size);
+        return;
+    }
+
+    uint32_t benchmark = OS::get_singleton()->get_ticks_msec();
+
+    _page_in(LAYER_BLENDS);
+
+    int src_n = m_size + 1;
+    Vector<float> src_heights;
+    src_heights.resize(src_n * src_n);
+
+    DVector<uint8_t>::Read hr = m_heights.read();
+
+    for (int i = 0; i < src_n * src_n; i++) {
+        src_heights[i] = decode_height(&hr[i * 2]);
+    }
+
+    hr = DVector<uint8_t>::Read();
+
+    DVector<uint8_t> heights;
+    DVector<uint8_t> blends;
+    heights.resize((new_size + 1) * (new_size + 1) * 2);
+    blends.resize(new_size * new_size * 4);
+
+    DVector<uint8_t>::Read br = m_blends.read();
+    DVector<uint8_t>::Write hw = heights.write();
+    DVector<uint8_t>::Write bw = blends.write();
+
+    ResizeJob job;
+    job.src_heights = &src_heights[0];
+    job.src_blends = br.ptr();
+    job.src_size = m_size;
+    job.heights = hw.ptr();
+    job.blends = bw.ptr();
+    job.size = new_size;
+    job.mode = mode;
+
+    TerrainThreads::run(_resize_height_rows, &job, new_size + 1, RESIZE_BAND_ROWS);
+    TerrainThreads::run(_resize_blend_rows, &job, new_size, RESIZE_BAND_ROWS);
+
+    br = DVector<uint8_t>::Read();
+    hw = DVector<uint8_t>::Write();
+    bw = DVector<uint8_t>::Write();
+
+    m_size = new_size;
+    m_heights = heights;
+    m_blends = blends;
+
+    _layers_resized();
+
+    benchmark = OS::get_singleton()->get_ticks_msec() - benchmark;
+
+    if (OS::get_singleton()->is_stdout_verbose()) {
+        print_line("TerrainData::resize() benchmark:" + itos(benchmark));
+    }
+}
+
+int TerrainData::get_size() const
+{
+    return m_size;
+}
+
+void TerrainData::_set_data(Dictionary data)
+{
+    m_size = data["size"];
+    m_heights = data["heights"];
+    m_blends = data["blends"];
+
+    if (!data.has("blend_format")) {
+        // older maps store four sequentially mixed weights for layers 1-4
+        DVector<uint8_t>::Write w = m_blends.write();
+
+        for (int i = 0; i < m_size * m_size; i++) {
+            uint8_t* texel = &w[i * 4];
+            int layers[5] = { 0, 1, 2, 3, 4 };
+            float weights[5] = { 1, 0, 0, 0, 0 };
+
+            for (int k = 1; k < 5; k++) {
+                float t = texel[k - 1] / 255.0f;
+
+                for (int l = 0; l < k; l++) {
+                    weights[l] *= 1.0f - t;
+                }
+
+                weights[k] = t;
+            }
+
+            encode_blend(texel, layers, weights, 5);
+        }
+    }
+
+    if (data.has("lighting")) {
+        m_lighting = data["lighting"];
+    }
+    else {
+        m_lighting.resize(0);
+    }
+
+    for (int i = 0; i < LAYER_COUNT; i++) {
+        m_resident[i] = true;
+        m_modified[i] = false;
+        m_swapped[i] = false;
+        m_access_time[i] = OS::get_singleton()->get_ticks_msec();
+    }
+
+    _reset_delta();
+    m_delta_version = 0;
+
+    _reset_save_tiles();
+    m_save_full = false;
+    m_journal_pending = true;
+
+    // reloaded in place, the path is already known
+    if (get_path() != "") {
+        _resource_path_changed();
+    }
+
+    if (m_heights_tex.is_valid()) {
+        VS::get_singleton()->texture_allocate(m_heights_tex, m_size + 1, m_size + 1, Image::FORMAT_GRAYSCALE_ALPHA, 0);
+        reload_heights();
+    }
+
+    _reload_lighting();
+
+    emit_signal(String("size_changed"));
+}
+
+Dictionary TerrainData::_get_data() const
+{
+    for (int i = 0; i < LAYER_COUNT; i++) {
+        _page_in(i);
+    }
+
+    Dictionary d;
+
+    d["size"] = m_size;
+    d["heights"] = m_heights;
+    d["blends"] = m_blends;
+    d["blend_format"] = BLEND_FORMAT_SPLAT;
+
+    if (has_lighting()) {
+        d["lighting"] = m_lighting;
+    }
+
+    return d;
+}
+
+void TerrainData::set_residency(int layer, int residency)
+{
+    ERR_FAIL_INDEX(layer, LAYER_COUNT);
+    ERR_FAIL_INDEX(residency, RESIDENCY_DISK + 1);
+
+    m_residency[layer] = residency;
+}
+
+int TerrainData::get_residency(int layer) const
+{
+    ERR_FAIL_INDEX_V(layer, LAYER_COUNT, RESIDENCY_CPU);
+
+    return m_residency[layer];
+}
+
+bool TerrainData::is_resident(int layer) const
+{
+    ERR_FAIL_INDEX_V(layer, LAYER_COUNT, false);
+
+    return m_resident[layer];
+}
+
+int64_t TerrainData::get_layer_bytes(int layer) const
+{
+    ERR_FAIL_INDEX_V(layer, LAYER_COUNT, 0);
+
+    return layer == LAYER_BLENDS ? m_blends.size() : m_lighting.size();
+}
+
+void TerrainData::pin_layer(int layer)
+{
+    ERR_FAIL_INDEX(layer, LAYER_COUNT);
+
+    // read back now rather than on the first frame that needs it
+    if (m_pins[layer]++ == 0) {
+        _page_in(layer);
+    }
+}
+
+void TerrainData::unpin_layer(int layer)
+{
+    ERR_FAIL_INDEX(layer, LAYER_COUNT);
+    ERR_FAIL_COND(m_pins[layer] == 0);
+
+    m_pins[layer]--;
+}
+
+void TerrainData::trim_residency()
+{
+    uint64_t now = OS::get_singleton()->get_ticks_msec();
+
+    for (int i = 0; i < LAYER_COUNT; i++) {
+        if (!m_resident[i] || m_modified[i] || m_pins[i] > 0 || m_residency[i] == RESIDENCY_CPU) {
+            continue;
+        }
+
+        if (m_residency[i] == RESIDENCY_GPU) {
+            // terrains pin blends while they build from them, lighting has its texture
+            if (i == LAYER_LIGHTING && !has_lighting_texture()) {
+                continue;
+            }
+        }
+        else if (now - m_access_time[i] < RESIDENCY_IDLE_MSEC) {
+            continue;
+        }
+
+        if (i == LAYER_LIGHTING && !has_lighting()) {
+            continue; // nothing to drop
+        }
+
+        if (!_page_out(i)) {
+            continue;
+        }
+
+        if (i == LAYER_BLENDS) {
+            m_blends.resize(0);
+        }
+        else {
+            m_lighting.resize(0);
+        }
+
+        m_resident[i] = false;
+    }
+}
+
+/* swap */
+
+// one file per layer, the raw size then the fastlz packed bytes
+String TerrainData::_get_swap_path(int layer) const
+{
+    return "user://terrain_swap/" + itos(get_instance_ID()) + (layer == LAYER_BLENDS ? ".blends" : ".lighting");
+}
+
+// unmodified layers are written once, later page outs find them there
+bool TerrainData::_page_out(int layer)
+{
+    if (m_swapped[layer]) {
+        return true;
+    }
+
+    if (get_layer_bytes(layer) == 0) {
+        return false;
+    }
+
+    const DVector<uint8_t>& data = layer == LAYER_BLENDS ? m_blends : m_lighting;
+    String path = _get_swap_path(layer);
+    FileAccess* f = FileAccess::open(path, FileAccess::WRITE);
+
+    if (!f) {
+        // first write, the folder may not exist yet
+        DirAccess* da = DirAccess::create_for_path(path.get_base_dir());
+        da->make_dir_recursive(path.get_base_dir());
+        memdelete(da);
+
+        f = FileAccess::open(path, FileAccess::WRITE);
+        ERR_FAIL_COND_V(!f, false);
+    }
+
+    Vector<uint8_t> packed;
+    packed.resize(Compression::get_max_compressed_buffer_size(data.size(), Compression::MODE_FASTLZ));
+
+    DVector<uint8_t>::Read r = data.read();
+    int len = Compression::compress(&packed[0], &r[0], data.size(), Compression::MODE_FASTLZ);
+    r = DVector<uint8_t>::Read();
+
+    f->store_32(data.size());
+    f->store_buffer(&packed[0], len);
+
+    bool ok = f->get_error() == OK;
+    memdelete(f);
+
+    m_swapped[layer] = ok;
+    return ok;
+}
+
+// reads the layer back from its swap file, nothing else is touched. Only
+// data readers call this, it counts as a use for the idle timeout
+void TerrainData::_page_in(int layer) const
+{
+    m_access_time[layer] = OS::get_singleton()->get_ticks_msec();
+
+    if (m_resident[layer]) {
+        return;
+    }
+
+    m_resident[layer] = true;
+
+    TerrainData* self = const_cast<TerrainData*>(this);
+    DVector<uint8_t>& data = layer == LAYER_BLENDS ? self->m_blends : self->m_lighting;
+    int expected = layer == LAYER_BLENDS ? m_size * m_size * 4 : (m_size + 1) * (m_size + 1) * 2;
+
+    FileAccess* f = FileAccess::open(_get_swap_path(layer), FileAccess::READ);
+
+    if (f) {
+        int raw_size = f->get_32();
+        int len = f->get_len() - f->get_pos();
+
+        Vector<uint8_t> packed;
+        bool ok = raw_size == expected && len > 0;
+
+        if (ok) {
+            packed.resize(len);
+            ok = f->get_buffer(&packed[0], len) == len;
+        }
+
+        memdelete(f);
+
+        if (ok) {
+            data.resize(raw_size);
+
+            DVector<uint8_t>::Write w = data.write();
+
+            if (Compression::decompress(&w[0], raw_size, &packed[0], len, Compression::MODE_FASTLZ) == raw_size) {
+                return;
+            }
+        }
+    }
+
+    // keep the layer sized so readers stay in bounds
+    if (layer == LAYER_BLENDS) {
+        data.resize(expected);
+
+        DVector<uint8_t>::Write w = data.write();
+
+        for (int i = 0; i < expected; i++) {
+            w[i] = 0;
+        }
+    }
+    else {
+        data.resize(0);
+    }
+
+    ERR_EXPLAIN("Can't page terrain data back in from: " + _get_swap_path(layer));
+    ERR_FAIL();
+}
+
+void TerrainData::_bind_methods()
+{
+    ObjectTypeDB::bind_method(_MD("get_heights"), &TerrainData::get_heights);
+    ObjectTypeDB::bind_method(_MD("get_blends"), &TerrainData::get_blends);
+
+    ObjectTypeDB::bind_method(_MD("get_size"), &TerrainData::get_size);
+    ObjectTypeDB::bind_method(_MD("set_size", "size"), &TerrainData::set_size);
+    ObjectTypeDB::bind_method(_MD("resize", "size", "mode"), &TerrainData::resize, DEFVAL(RESIZE_RESAMPLE));
+
+    ADD_PROPERTY(PropertyInfo(Variant::INT, "size"), _SCS("set_size"), _SCS("get_size"));
+
+    ObjectTypeDB::bind_method(_MD("_set_data", "data"), &TerrainData::_set_data);
+    ObjectTypeDB::bind_method(_MD("_get_data"), &TerrainData::_get_data);
+
+    ADD_PROPERTY(PropertyInfo(Variant::DICTIONARY, "_data", PROPERTY_HINT_NONE, "", PROPERTY_USAGE_NOEDITOR), _SCS("_set_data"), _SCS("_get_data"));
+
+    ObjectTypeDB::bind_method(_MD("has_lighting"), &TerrainData::has_lighting);
+    ObjectTypeDB::bind_method(_MD("clear_lighting"), &TerrainData::clear_lighting);
+
+    ObjectTypeDB::bind_method(_MD("get_height_at", "x", "y"), &TerrainData::get_height_at);
+    ObjectTypeDB::bind_method(_MD("set_height_at", "x", "y", "height"), &TerrainData::set_height_at);
+    ObjectTypeDB::bind_method(_MD("heights_changed", "region"), &TerrainData::heights_changed);
+    ObjectTypeDB::bind_method(_MD("blends_changed", "region"), &TerrainData::blends_changed);
+
+    ObjectTypeDB::bind_method(_MD("get_height_region", "region"), &TerrainData::get_height_region);
+    ObjectTypeDB::bind_method(_MD("set_height_region", "region", "heights"), &TerrainData::set_height_region);
+    ObjectTypeDB::bind_method(_MD("get_blend_region", "region"), &TerrainData::get_blend_region);
+    ObjectTypeDB::bind_method(_MD("set_blend_region", "region", "blends"), &TerrainData::set_blend_region);
+
+    ObjectTypeDB::bind_method(_MD("make_delta"), &TerrainData::make_delta);
+    ObjectTypeDB::bind_method(_MD("apply_delta", "delta"), &TerrainData::apply_delta);
+    ObjectTypeDB::bind_method(_MD("get_delta_version"), &TerrainData::get_delta_version);
+    ObjectTypeDB::bind_method(_MD("set_delta_version", "version"), &TerrainData::set_delta_version);
+    ObjectTypeDB::bind_method(_MD("set_delta_height_step", "step"), &TerrainData::set_delta_height_step);
+    ObjectTypeDB::bind_method(_MD("get_delta_height_step"), &TerrainData::get_delta_height_step);
+
+    ADD_PROPERTY(PropertyInfo(Variant::REAL, "delta_height_step", PROPERTY_HINT_RANGE, "0.001,1,0.001"), _SCS("set_delta_height_step"), _SCS("get_delta_height_step"));
+
+    ObjectTypeDB::bind_method(_MD("save_journal"), &TerrainData::save_journal);
+
+    ObjectTypeDB::bind_method(_MD("stamp_height", "mode", "center", "radius", "strength", "falloff", "height"), &TerrainData::stamp_height);
+    ObjectTypeDB::bind_method(_MD("blit_heights", "region", "source", "mode"), &TerrainData::blit_heights, DEFVAL(BLIT_REPLACE));
+
+    ObjectTypeDB::bind_method(_MD("set_residency", "layer", "residency"), &TerrainData::set_residency);
+    ObjectTypeDB::bind_method(_MD("get_residency", "layer"), &TerrainData::get_residency);
+    ObjectTypeDB::bind_method(_MD("is_resident", "layer"), &TerrainData::is_resident);
+    ObjectTypeDB::bind_method(_MD("get_layer_bytes", "layer"), &TerrainData::get_layer_bytes);
+    ObjectTypeDB::bind_method(_MD("pin_layer", "layer"), &TerrainData::pin_layer);
+    ObjectTypeDB::bind_method(_MD("unpin_layer", "layer"), &TerrainData::unpin_layer);
+    ObjectTypeDB::bind_method(_MD("trim_residency"), &TerrainData::trim_residency);
+
+    ADD_PROPERTYI(PropertyInfo(Variant::INT, "residency/blends", PROPERTY_HINT_ENUM, "CPU,GPU,Disk"), _SCS("set_residency"), _SCS("get_residency"), LAYER_BLENDS);
+    ADD_PROPERTYI(PropertyInfo(Variant::INT, "residency/lighting", PROPERTY_HINT_ENUM, "CPU,GPU,Disk"), _SCS("set_residency"), _SCS("get_residency"), LAYER_LIGHTING);
+
+    ADD_SIGNAL(MethodInfo("size_changed"));
+    ADD_SIGNAL(MethodInfo("heights_changed", PropertyInfo(Variant::RECT2, "region")));
+    ADD_SIGNAL(MethodInfo("blends_changed", PropertyInfo(Variant::RECT2, "region")));
+    ADD_SIGNAL(MethodInfo("lighting_changed", PropertyInfo(Variant::RECT2, "region")));
+
+    BIND_CONSTANT(STAMP_RAISE);
+    BIND_CONSTANT(STAMP_LOWER);
+    BIND_CONSTANT(STAMP_CRATER);
+    BIND_CONSTANT(STAMP_FLATTEN);
+
+    BIND_CONSTANT(RESIZE_RESAMPLE);
+    BIND_CONSTANT(RESIZE_CROP);
+
+    BIND_CONSTANT(LAYER_BLENDS);
+    BIND_CONSTANT(LAYER_LIGHTING);
+
+    BIND_CONSTANT(RESIDENCY_CPU);
+    BIND_CONSTANT(RESIDENCY_GPU);
+    BIND_CONSTANT(RESIDENCY_DISK);
+
+    BIND_CONSTANT(BLIT_REPLACE);
+    BIND_CONSTANT(BLIT_ADD);
+    BIND_CONSTANT(BLIT_SUBTRACT);
+    BIND_CONSTANT(BLIT_MAX);
+    BIND_CONSTANT(BLIT_MIN);
 }
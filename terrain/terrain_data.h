@@ -4,42 +4,299 @@
 #include "resource.h"
 #include "dictionary.h"
 #include "servers/visual_server.h"
+#include "os/file_access.h"
+
+#define TERRAIN_HEIGHT_SCALE 1000.0f // heights are stored in 16 bits with three decimals
+#define TERRAIN_MAX_HEIGHT (65535 / TERRAIN_HEIGHT_SCALE)
 
 class TerrainData : public Resource {
     OBJ_TYPE(TerrainData, Resource)
     RES_BASE_EXTENSION("hmap");
 
 public:
+    enum {
+        MAX_LAYERS = 256,
+    };
+
+    enum StampMode {
+        STAMP_RAISE,
+        STAMP_LOWER,
+        STAMP_CRATER,
+        STAMP_FLATTEN,
+    };
+
+    // layers that can leave memory, heights feed meshes and collisions and
+    // always stay
+    enum Layer {
+        LAYER_BLENDS,
+        LAYER_LIGHTING,
+        LAYER_COUNT,
+    };
+
+    // where the cpu copy of a layer lives. GPU drops it once uploaded, DISK
+    // once it went unread for a while. Both write it to a swap file under
+    // user:// and read just that back when something reads it, edited and
+    // pinned layers stay
+    enum Residency {
+        RESIDENCY_CPU,
+        RESIDENCY_GPU,
+        RESIDENCY_DISK,
+    };
+
+    enum BlitMode {
+        BLIT_REPLACE,
+        BLIT_ADD,
+        BLIT_SUBTRACT,
+        BLIT_MAX,
+        BLIT_MIN,
+    };
+
+    enum ResizeMode {
+        RESIZE_RESAMPLE, // bicubic heights, bilinear blends
+        RESIZE_CROP, // texels stay put, the far edges are cut or padded
+    };
+
     TerrainData();
     ~TerrainData();
 
-    void set_size(const int new_size);
+    void set_size(const int new_size); // clears the map
     int get_size() const;
 
+    // keeps the sculpting and painting, baked lighting is dropped
+    void resize(int new_size, int mode);
+
     Image get_blends() const;
     Image get_heights() const;
 
-    RID get_blends_texture() const;
+    DVector<uint8_t> get_blend_data() const;
+
+    // created and uploaded on first use, nothing draws with it
     RID get_heights_texture() const;
+    bool has_heights_texture() const;
 
     void reload_heights();
-    void reload_blends();
 
-    void paint_blend(const Image& brush, int x, int y, int texture, float alpha);
-    void paint_height(const Image& brush, int x, int y, float alpha);
+    // mask is size x size floats with its corner at x, y
+    void paint_blend(const float* mask, int size, int x, int y, int layer, float alpha);
+    void paint_height(const float* mask, int size, int x, int y, float alpha); // no upload, see reload_heights()
+    void smooth_height(const float* mask, int size, int x, int y, float strength); // no upload either
+    void set_height(const float* mask, int size, int x, int y, float height, float strength); // no upload either
+
+    // copies a patch laid out like get_heights() into region, uploads once
+    void blit_heights(const Rect2& region, const Image& source, int mode);
+
+    Rect2 stamp_height(int mode, const Vector2& center, float radius, float strength, float falloff, float height);
 
     float get_height_at(int x, int y);
-    void set_height_at(int x, int y, float h);
+    void set_height_at(int x, int y, float h); // no upload, see heights_changed()
+
+    // row major copies of a region for scripts. Reads clamp to the map edge,
+    // writes skip what falls outside and update the region once
+    DVector<real_t> get_height_region(const Rect2& region) const;
+    void set_height_region(const Rect2& region, const DVector<real_t>& heights);
+
+    // raw blend texels, four bytes each, see decode_blend()
+    DVector<uint8_t> get_blend_region(const Rect2& region) const;
+    void set_blend_region(const Rect2& region, const DVector<uint8_t>& blends);
+
+    // raw storage for bulk tools: (size + 1)^2 big endian 16 bit heights and
+    // size^2 splat texels, call heights_changed()/blends_changed() after writing
+    DVector<uint8_t>& get_height_buffer();
+    DVector<uint8_t>& get_blend_buffer();
+
+    void heights_changed(const Rect2& region);
+    void blends_changed(const Rect2& region);
+
+    // scattered edits, e.g. many deformations in one frame: one upload and
+    // a signal per region instead of one covering all of them
+    void heights_changed_regions(const Vector<Rect2>& regions);
+
+    // replication of runtime edits. make_delta() encodes the tiles edited
+    // since the last call as compressed residuals, the first call only takes
+    // the baseline and returns nothing. apply_delta() replays one on an
+    // unedited copy at the same version, e.g. a client that loaded the map
+    // and got every delta
+    DVector<uint8_t> make_delta();
+    Error apply_delta(const DVector<uint8_t>& delta);
+
+    int get_delta_version() const;
+    void set_delta_version(int version);
+
+    // heights are quantized to this in deltas, errors carry over to later ones
+    void set_delta_height_step(float step);
+    float get_delta_height_step() const;
+
+    // appends the tiles edited or rebaked since the last save to
+    // <path>.journal, which is replayed on load. Once the journal outgrows
+    // half the map, after a resize, or when lighting is added or cleared,
+    // the whole resource is saved instead and the journal removed
+    Error save_journal();
+
+    // replays the journal of the file at path on a copy loaded without the
+    // cache, which doesn't know its path
+    void replay_journal(const String& path);
+
+    // baked (size + 1)^2 ambient occlusion and sun visibility, laid out like
+    // FORMAT_GRAYSCALE_ALPHA, empty until something is baked
+    bool has_lighting() const;
+    DVector<uint8_t>& get_lighting_buffer();
+    RID get_lighting_texture() const; // created on first use
+    bool has_lighting_texture() const;
+    void lighting_changed(const Rect2& region);
+    void lighting_changed_regions(const Vector<Rect2>& regions);
+    void clear_lighting();
+
+    void set_residency(int layer, int residency);
+    int get_residency(int layer) const;
+    bool is_resident(int layer) const;
+    int64_t get_layer_bytes(int layer) const; // doesn't count as a read
+
+    // readers that may come back any frame, like terrains building pieces
+    // as the camera moves, pin a layer so it is never paged out under them
+    void pin_layer(int layer);
+    void unpin_layer(int layer);
+
+    // drops layers their policy allows to, call once in a while
+    void trim_residency();
+
+    static inline float decode_height(const uint8_t* texel)
+    {
+        return ((texel[0] << 8) | texel[1]) / TERRAIN_HEIGHT_SCALE;
+    }
+
+    static inline void encode_height(uint8_t* texel, float height)
+    {
+        uint16_t h16 = CLAMP(height, 0, TERRAIN_MAX_HEIGHT) * TERRAIN_HEIGHT_SCALE;
+
+        texel[0] = h16 >> 8;
+        texel[1] = h16 & 0xFF;
+    }
+
+    static void decode_blend(const uint8_t* texel, int* layers, float* weights);
+    static void encode_blend(uint8_t* texel, const int* layers, const float* weights, int count);
+
 private:
     int m_size;
-    Image m_blends;
-    Image m_heights;
-    RID m_blends_tex;
-    RID m_heights_tex;
+    DVector<uint8_t> m_blends; // splat map, see decode_blend()
+    DVector<uint8_t> m_heights; // 16 bit big endian, laid out like FORMAT_GRAYSCALE_ALPHA
+    DVector<uint8_t> m_lighting;
+    mutable RID m_heights_tex;
+    mutable RID m_lighting_tex;
+
+    int m_residency[LAYER_COUNT];
+    bool m_modified[LAYER_COUNT]; // differs from the saved resource
+    mutable bool m_resident[LAYER_COUNT];
+    mutable uint64_t m_access_time[LAYER_COUNT];
+    int m_pins[LAYER_COUNT];
+    bool m_swapped[LAYER_COUNT]; // the swap file holds the layer as it is
+
+    String _get_swap_path(int layer) const;
+    bool _page_out(int layer);
+    void _page_in(int layer) const;
+
+    /* tiles */
+
+    enum {
+        TILE_SIZE = 32,
+        TILE_HEIGHTS = 1,
+        TILE_BLENDS = 2,
+        TILE_LIGHTING = 4, // journaled only, deltas don't carry lighting
+    };
+
+    int _get_tile_count() const;
+    void _get_tile_rect(int tile, int flag, int& x1, int& y1, int& x2, int& y2) const;
+    void _mark_tiles(const Rect2& region, int flag);
+
+    /* replication */
+
+    enum {
+        DELTA_HEADER_SIZE = 20,
+    };
+
+    uint32_t m_delta_version;
+    int m_delta_step; // 16 bit height units
+    DVector<uint8_t> m_delta_heights; // what receivers have, empty until the first make_delta()
+    DVector<uint8_t> m_delta_blends;
+    Vector<uint8_t> m_delta_tiles; // TILE_HEIGHTS | TILE_BLENDS of every tile changed since
+
+    void _reset_delta();
+
+    /* journal */
+
+    Vector<uint8_t> m_save_tiles; // changed since the last save, like m_delta_tiles
+    bool m_save_full; // the journal can't describe the change, e.g. a resize
+    bool m_journal_pending; // loaded, replayed once the path is known
+
+    String _get_journal_path() const;
+    bool _read_journal_header(FileAccess* f, uint64_t stamp) const;
+    void _load_journal(const String& path);
+    Error _save_full();
+    void _reset_save_tiles();
+
+    void _reload_lighting();
 
     void _size_changed();
+    void _layers_resized();
+
+    // source heights decoded to floats, rows of the new map are filled in parallel
+    struct ResizeJob {
+        const float* src_heights; // (src_size + 1)^2
+        const uint8_t* src_blends;
+        int src_size;
+        uint8_t* heights;
+        uint8_t* blends;
+        int size;
+        int mode;
+    };
+
+    static void _resize_height_rows(void* userdata, int from, int to);
+    static void _resize_blend_rows(void* userdata, int from, int to);
+
+    // one dab, rows [y1, y2) and columns [x1, x2) are inside the map
+    struct PaintJob {
+        const float* mask;
+        int size;
+        int x; // brush corner
+        int y;
+        int x1;
+        int y1;
+        int x2;
+        int y2;
+        int stride;
+        uint8_t* buffer;
+        float alpha;
+        float height;
+        int layer;
+    };
+
+    static void _paint_blend_rows(void* userdata, int from, int to);
+    static void _paint_height_rows(void* userdata, int from, int to);
+    static void _set_height_rows(void* userdata, int from, int to);
+
+    // separable gaussian over the brush area plus a halo of 'radius'
+    struct SmoothJob {
+        const uint8_t* src_heights;
+        uint8_t* heights;
+        int stride;
+        int x; // brush corner
+        int y;
+        int size;
+        int radius;
+        int src_w; // size + 2 * radius
+        const float* kernel; // 2 * radius + 1 taps
+        const float* mask;
+        float strength;
+        float* src; // halo included
+        float* tmp; // horizontally blurred, src rows x size
+    };
+
+    static void _smooth_decode_rows(void* userdata, int from, int to);
+    static void _smooth_h_rows(void* userdata, int from, int to);
+    static void _smooth_v_rows(void* userdata, int from, int to);
 
 protected:
+    virtual void _resource_path_changed();
+
     void _set_data(Dictionary data);
     Dictionary _get_data() const;
     static void _bind_methods();
@@ -3,17 +3,24 @@
 #include "tools/editor/plugins/spatial_editor_plugin.h"
 #include "scene/3d/camera.h"
 #include "tools/editor/editor_settings.h"
+#include "io/resource_loader.h"
+#include "io/resource_saver.h"
 
 #include "os/keyboard.h"
+#include "os/os.h"
 #include "geometry.h"
 #include "servers/visual_server.h"
 
+#define MAX_BRUSH_SIZE 1024
+#define STROKE_FRAME_TEXELS (4 * 1024 * 1024) // dab texels painted per frame, the rest waits
+#define MEMORY_LABEL_MSEC 1000
+
 TerrainEditor::TerrainEditor(EditorNode* editor)
 {
     m_editor_node = editor;
+    m_terrain = NULL;
 
     m_current_mode = MODE_MODIFY_HEIGHT;
-    m_current_brush = BRUSH_SQUARE;
     m_size = 3;
     m_mouse_down = false;
     m_last_pixel_edited = Point2(-1000, -1000);
@@ -21,10 +28,14 @@ TerrainEditor::TerrainEditor(EditorNode* editor)
     m_cursor_mesh = VS::get_singleton()->immediate_create();
     m_cursor = VS::get_singleton()->instance_create();
     m_current_color = Color();
+    m_erosion.instance();
+    m_stroke_travel = 0;
+    m_stroke_height = 0;
+    m_memory_time = 0;
 
-    _make_ui();
+    m_brush.set_size(m_size);
 
-    _brush_changed();
+    _make_ui();
 }
 
 TerrainEditor::~TerrainEditor()
@@ -41,13 +52,28 @@ bool TerrainEditor::forward_spatial_input_event(Camera* c, const InputEvent& e)
     }
     case InputEvent::MOUSE_BUTTON: {
 
+        if (e.mouse_button.button_index != BUTTON_LEFT || !m_terrain || m_terrain->get_data().is_null()) {
+            break;
+        }
+
         if (e.mouse_button.pressed) {
-            if (e.mouse_button.button_index == BUTTON_LEFT) {
-                _handle_input_event(c, e);
+            Vector3 intersection;
+
+            if (_get_intersection(c, Point2(e.mouse_button.x, e.mouse_button.y), intersection)) {
+                m_mouse_down = true;
+
+                if (m_current_mode == MODE_SELECT_REGION) {
+                    _update_selection(intersection, true);
+                }
+                else {
+                    _stroke_begin(intersection);
+                }
             }
-            m_mouse_down = true;
         }
-        else {
+        else if (m_mouse_down) {
+            // whatever is left of the stroke lands right away, with the
+            // settings it was painted with
+            _apply_stroke(true);
             m_mouse_down = false;
         }
 
@@ -55,9 +81,30 @@ bool TerrainEditor::forward_spatial_input_event(Camera* c, const InputEvent& e)
     }
     case InputEvent::MOUSE_MOTION: {
 
-        if (m_mouse_down && (e.mouse_button.button_index == BUTTON_LEFT)) {
-            _handle_input_event(c, e);
+        if (!m_terrain || m_terrain->get_data().is_null()) {
+            break;
+        }
+
+        Vector3 intersection;
+
+        if (!_get_intersection(c, Point2(e.mouse_motion.x, e.mouse_motion.y), intersection)) {
+            break;
         }
+
+        _update_cursor(intersection);
+
+        if (!m_mouse_down || !(e.mouse_motion.button_mask & BUTTON_MASK_LEFT)) {
+            break;
+        }
+
+        // only recorded here, dabs are applied once per frame
+        if (m_current_mode == MODE_SELECT_REGION) {
+            _update_selection(intersection, false);
+        }
+        else {
+            m_stroke_samples.push_back(intersection);
+        }
+
         break;
     }
     }
@@ -65,6 +112,20 @@ bool TerrainEditor::forward_spatial_input_event(Camera* c, const InputEvent& e)
     return false;
 }
 
+void TerrainEditor::save_journal()
+{
+    if (!m_terrain || m_terrain->get_data().is_null()) {
+        return;
+    }
+
+    Ref<TerrainData> data = m_terrain->get_data();
+
+    // data embedded in the scene is saved with it
+    if (data->get_path().is_resource_file()) {
+        data->save_journal();
+    }
+}
+
 void TerrainEditor::edit(TerrainNode* terrain)
 {
     m_terrain = terrain;
@@ -80,30 +141,13 @@ void TerrainEditor::edit(TerrainNode* terrain)
         TreeItem* textures_item = m_texture_chooser->create_item(root_item);
         textures_item->set_text(0, "Textures");
 
-        tex0 = m_texture_chooser->create_item(textures_item);
-        tex0->set_text(0, "0");
-        tex0->set_icon_max_width(0, 32);
-        tex0->set_icon(0, terrain->get_texture0());
-
-        tex1 = m_texture_chooser->create_item(textures_item);
-        tex1->set_text(0, "1");
-        tex1->set_icon_max_width(0, 32);
-        tex1->set_icon(0, terrain->get_texture1());
-
-        tex2 = m_texture_chooser->create_item(textures_item);
-        tex2->set_text(0, "2");
-        tex2->set_icon_max_width(0, 32);
-        tex2->set_icon(0, terrain->get_texture2());
-
-        tex3 = m_texture_chooser->create_item(textures_item);
-        tex3->set_text(0, "3");
-        tex3->set_icon_max_width(0, 32);
-        tex3->set_icon(0, terrain->get_texture3());
-
-         tex4 = m_texture_chooser->create_item(textures_item);
-        tex4->set_text(0, "4");
-        tex4->set_icon_max_width(0, 32);
-        tex4->set_icon(0, terrain->get_texture4());
+        for (int i = 0; i < terrain->get_layer_count(); i++) {
+            TreeItem* layer_item = m_texture_chooser->create_item(textures_item);
+            layer_item->set_text(0, itos(i));
+            layer_item->set_icon_max_width(0, 32);
+            layer_item->set_icon(0, terrain->get_layer_texture(i));
+            layer_item->set_metadata(0, i);
+        }
 
         /* brush */
 
@@ -140,6 +184,13 @@ void TerrainEditor::show_menubar(bool visible)
 
 void TerrainEditor::_menu_option(int option)
 {
+    // a pending stroke must not land with another mode's settings
+    if (option <= MENU_OPTION_SELECT) {
+        m_stroke_samples.clear();
+        m_stroke_dabs.clear();
+        m_mouse_down = false;
+    }
+
     switch (option) {
     case MENU_OPTION_MODIFY: {
         m_current_mode = MODE_MODIFY_HEIGHT;
@@ -161,29 +212,57 @@ void TerrainEditor::_menu_option(int option)
         m_alpha->set_min(0);
         break;
     }
+    case MENU_OPTION_SELECT: {
+        m_current_mode = MODE_SELECT_REGION;
+        m_selection = Rect2();
+        break;
+    }
+    case MENU_OPTION_ERODE: {
+        if (!m_terrain || m_terrain->get_data().is_null()) {
+            break;
+        }
+
+        if (m_selection.has_no_area()) {
+            m_erosion->erode(m_terrain->get_data());
+        }
+        else {
+            m_erosion->erode_region(m_terrain->get_data(), m_selection);
+        }
+
+        break;
+    }
+    case MENU_OPTION_BAKE_LIGHTING: {
+        if (m_terrain && m_terrain->get_data().is_valid()) {
+            m_terrain->get_light_baker()->bake(m_terrain->get_data());
+        }
+
+        break;
+    }
+    case MENU_OPTION_IMPORT: {
+        if (m_terrain && m_terrain->get_data().is_valid()) {
+            m_import_dialog->popup_centered_ratio();
+        }
+
+        break;
+    }
     case MENU_OPTION_SQUARE: {
-        m_current_brush = BRUSH_SQUARE;
-        _brush_changed();
+        m_brush.set_shape(TerrainBrush::SHAPE_SQUARE);
         break;
     }
     case MENU_OPTION_CIRCLE: {
-        m_current_brush = BRUSH_CIRCLE;
-        _brush_changed();
+        m_brush.set_shape(TerrainBrush::SHAPE_CIRCLE);
         break;
     }
     case MENU_OPTION_SMOOTH_CIRCLE: {
-        m_current_brush = BRUSH_CIRCLE;
-        _brush_changed();
+        m_brush.set_shape(TerrainBrush::SHAPE_SMOOTH_CIRCLE);
         break;
     }
     case MENU_OPTION_NOISE: {
-        m_current_brush = BRUSH_NOISE;
-        _brush_changed();
+        m_brush.set_shape(TerrainBrush::SHAPE_NOISE);
         break;
     }
     case MENU_OPTION_CUSTOM: {
-        m_current_brush = BRUSH_CUSTOM;
-        _brush_changed();
+        m_brush_dialog->popup_centered_ratio();
         break;
     }
     case MENU_OPTION_DBG_SAVE: {
@@ -194,11 +273,11 @@ void TerrainEditor::_menu_option(int option)
     }
 }
 
-void TerrainEditor::_notifiacation(int what)
+void TerrainEditor::_notification(int what)
 {
     switch (what) {
     case NOTIFICATION_ENTER_TREE: {
-        VS::get_singleton()->instance_set_scenario(m_cursor, get_viewport()->get_world()->get_rid());
+        VS::get_singleton()->instance_set_scenario(m_cursor, get_viewport()->get_world()->get_scenario());
         VS::get_singleton()->instance_set_base(m_cursor, m_cursor_mesh);
 
         VS::get_singleton()->immediate_begin(m_cursor_mesh, VS::PRIMITIVE_LINES);
@@ -210,19 +289,67 @@ void TerrainEditor::_notifiacation(int what)
         break;
     }
     case NOTIFICATION_EXIT_TREE: {
+        VS::get_singleton()->instance_set_scenario(m_cursor, RID());
         break;
     }
     case NOTIFICATION_PROCESS: {
+        _apply_stroke();
+        _update_memory_label();
         break;
     }
     }
 }
 
+static String _format_mb(int64_t bytes)
+{
+    return String::num(bytes / (1024.0 * 1024.0), 1) + " MB";
+}
+
+void TerrainEditor::_update_memory_label()
+{
+    if (!m_terrain) {
+        m_memory_label->set_text("");
+        return;
+    }
+
+    uint64_t now = OS::get_singleton()->get_ticks_msec();
+
+    if (now - m_memory_time < MEMORY_LABEL_MSEC) {
+        return;
+    }
+
+    m_memory_time = now;
+
+    static const char* categories[] = { "heights", "blends", "lighting", "meshes", "collision", "details", "caches", NULL };
+
+    Dictionary usage = m_terrain->get_memory_usage();
+    String text = "memory (cpu / gpu)\n";
+
+    for (int i = 0; categories[i]; i++) {
+        Dictionary d = usage[categories[i]];
+        int64_t cpu = d["cpu"];
+        int64_t gpu = d["gpu"];
+
+        text += String(categories[i]) + ": " + _format_mb(cpu) + " / " + _format_mb(gpu) + "\n";
+    }
+
+    text += "total: " + _format_mb((int64_t)usage["total_cpu"]) + " / " + _format_mb((int64_t)usage["total_gpu"]);
+
+    if (m_terrain->get_memory_budget() > 0) {
+        text += "\nbudget: " + _format_mb(m_terrain->get_memory_budget());
+    }
+
+    m_memory_label->set_text(text);
+}
+
 void TerrainEditor::_bind_methods()
 {
     ObjectTypeDB::bind_method("_on_brush_size_changed", &TerrainEditor::_on_brush_size_changed);
     ObjectTypeDB::bind_method("_on_active_texture_changed", &TerrainEditor::_on_active_texture_changed);
     ObjectTypeDB::bind_method("_menu_option", &TerrainEditor::_menu_option);
+    ObjectTypeDB::bind_method("_on_import_file_selected", &TerrainEditor::_on_import_file_selected);
+    ObjectTypeDB::bind_method("_on_brush_settings_changed", &TerrainEditor::_on_brush_settings_changed);
+    ObjectTypeDB::bind_method("_on_brush_file_selected", &TerrainEditor::_on_brush_file_selected);
 }
 
 void TerrainEditor::_make_ui()
@@ -246,6 +373,9 @@ void TerrainEditor::_make_ui()
     m_texture_chooser->connect("cell_selected", this, "_on_active_texture_changed");
     m_sidebar->add_child(m_texture_chooser);
 
+    m_memory_label = memnew(Label);
+    m_sidebar->add_child(m_memory_label);
+
     /* menubar */
 
     m_menubar = memnew(HBoxContainer);
@@ -261,15 +391,36 @@ void TerrainEditor::_make_ui()
     m_menu->get_popup()->add_separator();
     m_menu->get_popup()->add_item("Paint", MENU_OPTION_PAINT);
     m_menu->get_popup()->add_separator();
+    m_menu->get_popup()->add_item("Select region", MENU_OPTION_SELECT);
+    m_menu->get_popup()->add_item("Erode", MENU_OPTION_ERODE);
+    m_menu->get_popup()->add_item("Import heightmap..", MENU_OPTION_IMPORT);
+    m_menu->get_popup()->add_item("Bake lighting", MENU_OPTION_BAKE_LIGHTING);
+    m_menu->get_popup()->add_separator();
     m_menu->get_popup()->add_item("Square", MENU_OPTION_SQUARE);
     m_menu->get_popup()->add_item("Circle", MENU_OPTION_CIRCLE);
     m_menu->get_popup()->add_item("Smooth circle", MENU_OPTION_SMOOTH_CIRCLE);
     m_menu->get_popup()->add_item("Noise", MENU_OPTION_NOISE);
+    m_menu->get_popup()->add_item("Custom brush..", MENU_OPTION_CUSTOM);
     m_menu->get_popup()->add_separator();
     m_menu->get_popup()->add_item("Debug save", MENU_OPTION_DBG_SAVE);
 
     m_menu->get_popup()->connect("item_pressed", this, "_menu_option");
 
+    m_import_dialog = memnew(EditorFileDialog);
+    m_import_dialog->set_mode(EditorFileDialog::MODE_OPEN_FILE);
+    m_import_dialog->set_access(EditorFileDialog::ACCESS_FILESYSTEM);
+    m_import_dialog->add_filter("*.png ; 16 bit PNG");
+    m_import_dialog->add_filter("*.raw,*.r16 ; 16 bit RAW");
+    m_import_dialog->connect("file_selected", this, "_on_import_file_selected");
+    add_child(m_import_dialog);
+
+    m_brush_dialog = memnew(EditorFileDialog);
+    m_brush_dialog->set_mode(EditorFileDialog::MODE_OPEN_FILE);
+    m_brush_dialog->set_access(EditorFileDialog::ACCESS_FILESYSTEM);
+    m_brush_dialog->add_filter("*.png ; PNG");
+    m_brush_dialog->connect("file_selected", this, "_on_brush_file_selected");
+    add_child(m_brush_dialog);
+
     m_brush_strength = memnew(SpinBox);
     m_brush_strength->set_min(-100);
     m_brush_strength->set_max(100);
@@ -278,7 +429,7 @@ void TerrainEditor::_make_ui()
     m_menubar->add_child(m_brush_strength);
 
     m_brush_size = memnew(SpinBox);
-    m_brush_size->set_max(10);
+    m_brush_size->set_max(MAX_BRUSH_SIZE);
     m_brush_size->set_min(1);
     m_brush_size->set_step(1);
     m_brush_size->set_val(3);
@@ -294,6 +445,33 @@ void TerrainEditor::_make_ui()
     m_brush_opacity->set_min(0);
     m_brush_opacity->set_val(255);
     m_menubar->add_child(m_brush_opacity);
+
+    m_brush_hardness = memnew(SpinBox);
+    m_brush_hardness->set_min(0);
+    m_brush_hardness->set_max(100);
+    m_brush_hardness->set_step(1);
+    m_brush_hardness->set_val(m_brush.get_hardness() * 100);
+    m_brush_hardness->set_suffix("%");
+    m_brush_hardness->connect("value_changed", this, "_on_brush_settings_changed");
+    m_menubar->add_child(m_brush_hardness);
+
+    m_brush_rotation = memnew(SpinBox);
+    m_brush_rotation->set_min(0);
+    m_brush_rotation->set_max(360);
+    m_brush_rotation->set_step(1);
+    m_brush_rotation->set_val(m_brush.get_rotation());
+    m_brush_rotation->set_suffix("deg");
+    m_brush_rotation->connect("value_changed", this, "_on_brush_settings_changed");
+    m_menubar->add_child(m_brush_rotation);
+
+    m_brush_spacing = memnew(SpinBox);
+    m_brush_spacing->set_min(1);
+    m_brush_spacing->set_max(200);
+    m_brush_spacing->set_step(1);
+    m_brush_spacing->set_val(m_brush.get_spacing() * 100);
+    m_brush_spacing->set_suffix("%");
+    m_brush_spacing->connect("value_changed", this, "_on_brush_settings_changed");
+    m_menubar->add_child(m_brush_spacing);
 }
 
 bool TerrainEditor::_do_input_action(Camera* cam, int x, int y)
@@ -301,9 +479,9 @@ bool TerrainEditor::_do_input_action(Camera* cam, int x, int y)
     return true;
 }
 
-void TerrainEditor::_handle_input_event(Camera* c, const InputEvent& e)
+// pointer ray against the terrain's base plane, in terrain space
+bool TerrainEditor::_get_intersection(Camera* c, const Point2& point, Vector3& intersection) const
 {
-    Point2 point = Point2(e.mouse_button.x, e.mouse_button.y);
     Vector3 from = c->project_ray_origin(point);
     Vector3 normal = c->project_ray_normal(point);
     // get model space coords
@@ -314,14 +492,119 @@ void TerrainEditor::_handle_input_event(Camera* c, const InputEvent& e)
     // check intersection
 
     Plane plane = Plane(Vector3(0, 1, 0), 0);
-    Vector3 intersection;
 
-    if (plane.intersects_ray(from, normal, &intersection)) {
-        _modify_terrain(intersection, e);
+    return plane.intersects_ray(from, normal, &intersection);
+}
+
+void TerrainEditor::_update_cursor(const Vector3& intersection)
+{
+    float size = m_size * m_terrain->get_chunk_scale() * 0.5f;
+
+    Transform xform;
+    xform.basis.scale(Vector3(size, 1, size));
+    xform.origin = intersection;
+
+    VS::get_singleton()->instance_set_transform(m_cursor, m_terrain->get_global_transform() * xform);
+}
+
+void TerrainEditor::_update_selection(const Vector3& intersection, bool start)
+{
+    Point2 p(m_terrain->get_pixel_x_at(intersection, 0.5f), m_terrain->get_pixel_y_at(intersection, 0.5f));
+
+    if (start) {
+        m_selection_start = p;
     }
+
+    m_selection = Rect2(m_selection_start, Size2()).expand(p);
+    m_selection.size += Size2(1, 1);
+}
+
+void TerrainEditor::_stroke_begin(const Vector3& intersection)
+{
+    m_stroke_samples.clear();
+    m_stroke_dabs.clear();
+    m_stroke_dabs.push_back(intersection);
+    m_stroke_last = intersection;
+    m_stroke_travel = 0;
+
+    int x = m_terrain->get_pixel_x_at(intersection, 0.5f);
+    int y = m_terrain->get_pixel_y_at(intersection, 0.5f);
+    m_stroke_height = m_terrain->get_data()->get_height_at(x, y);
+}
+
+// places dabs at a fixed spacing along the pointer path recorded since the
+// last frame and applies them as one edit: a single upload and one chunk
+// update however many events came in. flush ignores the frame budget
+void TerrainEditor::_apply_stroke(bool flush)
+{
+    if (!m_terrain || m_terrain->get_data().is_null()) {
+        m_stroke_samples.clear();
+        m_stroke_dabs.clear();
+        return;
+    }
+
+    float spacing = MAX(m_size * m_brush.get_spacing(), 1.0f) * m_terrain->get_chunk_scale();
+
+    for (int i = 0; i < m_stroke_samples.size(); i++) {
+        Vector3 from = m_stroke_last;
+        Vector3 to = m_stroke_samples[i];
+        float len = from.distance_to(to);
+        float pos = spacing - m_stroke_travel;
+
+        while (pos <= len) {
+            m_stroke_dabs.push_back(from.linear_interpolate(to, pos / len));
+            pos += spacing;
+        }
+
+        m_stroke_travel = len - (pos - spacing);
+        m_stroke_last = to;
+    }
+
+    m_stroke_samples.clear();
+
+    if (m_stroke_dabs.empty()) {
+        return;
+    }
+
+    // huge brushes at tight spacing would stall the frame, so only a
+    // budget of texels is painted and the rest follows next frame
+    Rect2 region;
+    int budget = MAX(STROKE_FRAME_TEXELS / (m_size * m_size), 1);
+    int count = flush ? m_stroke_dabs.size() : MIN(budget, m_stroke_dabs.size());
+
+    for (int i = 0; i < count; i++) {
+        _modify_terrain(m_stroke_dabs[i], region);
+    }
+
+    if (count == m_stroke_dabs.size()) {
+        m_stroke_dabs.clear();
+    }
+    else {
+        for (int i = count; i < m_stroke_dabs.size(); i++) {
+            m_stroke_dabs[i - count] = m_stroke_dabs[i];
+        }
+
+        m_stroke_dabs.resize(m_stroke_dabs.size() - count);
+    }
+
+    if (region.has_no_area()) {
+        return;
+    }
+
+    if (m_current_mode == MODE_EDIT_BLENDMAP) {
+        m_terrain->mark_blend_dirty_rect(region);
+    }
+    else {
+        m_terrain->get_data()->reload_heights();
+        m_terrain->mark_height_dirty_rect(region);
+    }
+
+    m_terrain->update_dirty_chunks();
 }
 
-void TerrainEditor::_modify_terrain(Vector3 intersection, const InputEvent& e)
+// paints a single dab without uploading anything, region grows by the
+// texels it touched
+void TerrainEditor::_modify_terrain(const Vector3& intersection, Rect2& region)
 {
     int hx = m_terrain->get_pixel_x_at(intersection, 0.5f);
     int hy = m_terrain->get_pixel_y_at(intersection, 0.5f);
@@ -335,148 +618,123 @@ void TerrainEditor::_modify_terrain(Vector3 intersection, const InputEvent& e)
     by -= m_size / 2.0f;
 
     float alpha = (float)m_alpha->get_val() / 255.0f;
+    Rect2 dab;
 
     switch (m_current_mode) {
 
     case MODE_MODIFY_HEIGHT: {
 
-        if (e.type == InputEvent::MOUSE_BUTTON) {
-
-            m_terrain->get_data()->paint_height(m_brush_image, hx, hy, alpha);
-            m_terrain->mark_height_dirty(hx, hy);
-            m_terrain->mark_height_dirty(hx, hy + m_size);
-            m_terrain->mark_height_dirty(hx + m_size, hy);
-            m_terrain->mark_height_dirty(hx + m_size, hy + m_size);
-            m_terrain->update_dirty_chunks();
-        }
-
+        m_terrain->get_data()->paint_height(m_brush.get_mask(), m_size, hx, hy, alpha);
+        dab = Rect2(hx, hy, m_size, m_size);
         break;
     }
 
     case MODE_SET_HEIGHT: {
 
-        //m_terrain->blit(m_brush_pixels, hx, hy, hx + m_size, hy + m_size);
-
+        m_terrain->get_data()->set_height(m_brush.get_mask(), m_size, hx, hy, m_stroke_height, alpha);
+        dab = Rect2(hx, hy, m_size, m_size);
         break;
     }
 
     case MODE_SMOOTH_TERRAIN: {
+
+        m_terrain->get_data()->smooth_height(m_brush.get_mask(), m_size, hx, hy, alpha);
+        dab = Rect2(hx, hy, m_size, m_size);
         break;
     }
     case MODE_EDIT_BLENDMAP: {
 
-        m_terrain->get_data()->paint_blend(m_brush_image, bx, by, m_active_texture, alpha);
+        m_terrain->get_data()->paint_blend(m_brush.get_mask(), m_size, bx, by, m_active_texture, alpha);
+        dab = Rect2(bx, by, m_size, m_size);
+        break;
+    }
+    case MODE_SELECT_REGION: {
         break;
     }
     }
-}
-
-void TerrainEditor::_create_square_brush()
-{
-    m_brush_image.create(m_size, m_size, false, Image::FORMAT_GRAYSCALE);
-
-    for (int i = 0; i < m_size * m_size; i++) {
-        int y = i / m_size;
-        int x = i - (y * m_size);
 
-        m_brush_image.put_pixel(x, y, Color(1.0, 1.0, 1.0, 1.0));
+    if (dab.has_no_area()) {
+        return;
     }
+
+    region = region.has_no_area() ? dab : region.merge(dab);
 }
 
-void TerrainEditor::_create_circle_brush()
+void TerrainEditor::_on_brush_size_changed(int value)
 {
-    m_brush_image.create(m_size, m_size, false, Image::FORMAT_GRAYSCALE);
-
-    for (int i = 0; i < m_size * m_size; i++) {
-        int y = i / m_size;
-        int x = i - (y * m_size);
-
-        m_brush_image.put_pixel(x, y, Color(1.0, 1.0, 1.0, 1.0));
-    }
+    m_size = value;
+    m_brush.set_size(m_size);
 }
 
-void TerrainEditor::_create_smooth_circle_brush()
+// the spin boxes only pick a cached mask, nothing is rebuilt while painting
+void TerrainEditor::_on_brush_settings_changed(float value)
 {
-    m_brush_image.create(m_size, m_size, false, Image::FORMAT_GRAYSCALE);
+    m_brush.set_hardness(m_brush_hardness->get_val() / 100.0f);
+    m_brush.set_rotation(m_brush_rotation->get_val());
+    m_brush.set_spacing(m_brush_spacing->get_val() / 100.0f);
+}
 
-    for (int i = 0; i < m_size * m_size; i++) {
-        int y = i / m_size;
-        int x = i - (y * m_size);
+void TerrainEditor::_on_active_texture_changed()
+{
+    TreeItem* sel = m_texture_chooser->get_selected();
 
-        m_brush_image.put_pixel(x, y, Color(1.0, 1.0, 1.0, 1.0));
+    // only layer items carry their index
+    if (sel && sel->get_metadata(0).get_type() == Variant::INT) {
+        m_active_texture = sel->get_metadata(0);
     }
 }
 
-void TerrainEditor::_create_noise_brush()
+// resamples into the current map size, the file is never loaded as a whole
+void TerrainEditor::_on_import_file_selected(const String& path)
 {
-    m_brush_image.create(m_size, m_size, false, Image::FORMAT_GRAYSCALE);
-
-    for (int i = 0; i < m_size * m_size; i++) {
-        int y = i / m_size;
-        int x = i - (y * m_size);
+    if (!m_terrain || m_terrain->get_data().is_null()) {
+        return;
+    }
 
-        int noize = Math::random(0, 1);
+    Ref<TerrainImporter> importer;
+    importer.instance();
 
-        m_brush_image.put_pixel(x, y, Color(noize, noize, noize, noize));
+    if (importer->import_file(path, m_terrain->get_data()) != OK) {
+        m_editor_node->show_warning("Can't import heightmap: " + path);
     }
 }
 
-void TerrainEditor::_on_brush_size_changed(int value)
+void TerrainEditor::_on_brush_file_selected(const String& path)
 {
-    m_size = value;
+    Image image;
 
-    _brush_changed();
+    if (image.load(path) != OK || image.empty()) {
+        m_editor_node->show_warning("Can't load brush: " + path);
+        return;
+    }
+
+    m_brush.set_custom_image(image);
+    m_brush.set_shape(TerrainBrush::SHAPE_CUSTOM);
 }
 
-void TerrainEditor::_on_active_texture_changed()
-{
-    TreeItem* sel = m_texture_chooser->get_selected();
+/* export */
 
-    if (sel == tex0) {
-        m_active_texture = 0;
-    }
-    else if (sel == tex1) {
-        m_active_texture = 1;
-    }
-    else if (sel == tex2) {
-        m_active_texture = 2;
-    }
-    else if (sel == tex3) {
-        m_active_texture = 3;
-    }
-    else if (sel == tex4) {
-        m_active_texture = 4;
+Vector<uint8_t> TerrainExportPlugin::custom_export(String& path, const Ref<EditorExportPlatform>& platform)
+{
+    if (!FileAccess::exists(path + ".journal")) {
+        return Vector<uint8_t>();
     }
-}
 
-void TerrainEditor::_brush_changed()
-{
-    switch (m_current_brush) {
+    // a copy of its own, the one being edited may hold unsaved changes
+    Ref<TerrainData> data = ResourceLoader::load(path, "TerrainData", true);
 
-    case BRUSH_NONE: {
-        break;
+    if (data.is_null()) {
+        return Vector<uint8_t>();
     }
 
-    case BRUSH_SQUARE: {
-        _create_square_brush();
-        break;
-    }
+    data->replay_journal(path);
 
-    case BRUSH_CIRCLE: {
-        _create_circle_brush();
-        break;
-    }
+    String tmp_path = EditorSettings::get_singleton()->get_settings_path().plus_file("tmp/terrain_export." + path.extension());
+    Error err = ResourceSaver::save(tmp_path, data);
 
-    case BRUSH_SMOOTH_CIRCLE: {
-        _create_smooth_circle_brush();
-        break;
-    }
+    ERR_FAIL_COND_V(err != OK, Vector<uint8_t>());
 
-    case BRUSH_NOISE: {
-        _create_noise_brush();
-        break;
-    }
-    }
+    return FileAccess::get_file_as_array(tmp_path);
 }
 
 /* Terain Editor Plugin implementation */
@@ -489,6 +747,8 @@ TerrainEditorPlugin::TerrainEditorPlugin(EditorNode* editor_node)
     SpatialEditor::get_singleton()->get_palette_split()->add_child(m_terrain_editor);
     SpatialEditor::get_singleton()->get_palette_split()->move_child(m_terrain_editor, 0);
     m_terrain_editor->hide();
+
+    EditorImportExport::get_singleton()->add_export_plugin(Ref<EditorExportPlugin>(memnew(TerrainExportPlugin)));
 }
 
 TerrainEditorPlugin::~TerrainEditorPlugin()
@@ -507,6 +767,12 @@ bool TerrainEditorPlugin::handles(Object* object) const
     return object->is_type("TerrainNode");
 }
 
+// scene saves write only the tiles painted since, see TerrainData::save_journal()
+void TerrainEditorPlugin::save_external_data()
+{
+    m_terrain_editor->save_journal();
+}
+
 void TerrainEditorPlugin::make_visible(bool visible)
 {
     m_terrain_editor->set_process(visible);
@@ -4,7 +4,12 @@
 #include "tools/editor/editor_plugin.h"
 #include "tools/editor/editor_node.h"
 #include "terrain_node.h"
+#include "terrain_erosion.h"
+#include "terrain_importer.h"
+#include "terrain_brush.h"
 #include "tools/editor/pane_drag.h"
+#include "tools/editor/editor_file_dialog.h"
+#include "tools/editor/editor_import_export.h"
 
 class SpatialEditorPlugin;
 
@@ -16,6 +21,7 @@ class TerrainEditor : public VBoxContainer {
         MODE_SMOOTH_TERRAIN,
         MODE_SET_HEIGHT,
         MODE_EDIT_BLENDMAP,
+        MODE_SELECT_REGION,
     };
 
     enum Menu {
@@ -25,6 +31,11 @@ class TerrainEditor : public VBoxContainer {
         // ---------------
         MENU_OPTION_PAINT,
         // ---------------
+        MENU_OPTION_SELECT,
+        MENU_OPTION_ERODE,
+        MENU_OPTION_IMPORT,
+        MENU_OPTION_BAKE_LIGHTING,
+        // ---------------
         MENU_OPTION_SQUARE,
         MENU_OPTION_CIRCLE,
         MENU_OPTION_SMOOTH_CIRCLE,
@@ -34,15 +45,6 @@ class TerrainEditor : public VBoxContainer {
         MENU_OPTION_DBG_SAVE,
     };
 
-    enum Brush {
-        BRUSH_NONE,
-        BRUSH_SQUARE,
-        BRUSH_CIRCLE,
-        BRUSH_SMOOTH_CIRCLE,
-        BRUSH_NOISE,
-        BRUSH_CUSTOM,
-    };
-
 public:
     TerrainEditor(){};
     TerrainEditor(EditorNode* editor);
@@ -52,9 +54,10 @@ public:
     void edit(TerrainNode* terrain);
 
     void show_menubar(bool visible);
+    void save_journal();
 
 protected:
-    void _notifiacation(int what);
+    void _notification(int what);
     static void _bind_methods();
     void _menu_option(int option);
 
@@ -69,24 +72,22 @@ private:
     SpinBox* m_brush_strength;
     SpinBox* m_brush_size;
     SpinBox* m_brush_opacity;
+    SpinBox* m_brush_hardness;
+    SpinBox* m_brush_rotation;
+    SpinBox* m_brush_spacing;
     ColorPickerButton* m_color_picker;
     Tree* m_texture_chooser;
     VBoxContainer* m_sidebar;
     HSlider* m_alpha;
-
-    /* sidebar */
-
-    TreeItem* tex0;
-    TreeItem* tex1;
-    TreeItem* tex2;
-    TreeItem* tex3;
-    TreeItem* tex4;
+    EditorFileDialog* m_import_dialog;
+    EditorFileDialog* m_brush_dialog;
+    Label* m_memory_label;
+    uint64_t m_memory_time;
 
     /* editing */
 
     EditMode m_current_mode;
-    Image m_brush_image;
-    Brush m_current_brush;
+    TerrainBrush m_brush;
     bool m_mouse_down;
     Point2 m_last_pixel_edited;
     int m_active_texture;
@@ -94,20 +95,44 @@ private:
     RID m_cursor_mesh;
     RID m_cursor;
     Color m_current_color;
+    Point2 m_selection_start;
+    Rect2 m_selection; // height texels, empty means the whole map
+    Ref<TerrainErosion> m_erosion;
+
+    /* stroke */
+
+    Vector<Vector3> m_stroke_samples; // pointer positions since the last frame
+    Vector<Vector3> m_stroke_dabs;
+    Vector3 m_stroke_last;
+    float m_stroke_travel; // distance since the last dab
+    float m_stroke_height; // set height flattens to where the stroke started
 
     void _make_ui();
     bool _do_input_action(Camera* cam, int x, int y);
-    void _handle_input_event(Camera* c, const InputEvent& e);
-    void _modify_terrain(Vector3 intersection, const InputEvent &e);
-
-    void _create_square_brush();
-    void _create_circle_brush();
-    void _create_smooth_circle_brush();
-    void _create_noise_brush();
+    bool _get_intersection(Camera* c, const Point2& point, Vector3& intersection) const;
+    void _update_cursor(const Vector3& intersection);
+    void _update_selection(const Vector3& intersection, bool start);
+    void _stroke_begin(const Vector3& intersection);
+    void _apply_stroke(bool flush = false);
+    void _modify_terrain(const Vector3& intersection, Rect2& region);
+    void _update_memory_label();
 
     void _on_brush_size_changed(int value);
+    void _on_brush_settings_changed(float value);
     void _on_active_texture_changed();
-    void _brush_changed();
+    void _on_import_file_selected(const String& path);
+    void _on_brush_file_selected(const String& path);
+};
+
+/* export */
+
+// packed files have no modification time, so exported games would ignore
+// the journal. Terrain data is exported with its journal merged in instead
+class TerrainExportPlugin : public EditorExportPlugin {
+    OBJ_TYPE(TerrainExportPlugin, EditorExportPlugin)
+
+public:
+    virtual Vector<uint8_t> custom_export(String& path, const Ref<EditorExportPlatform>& platform);
 };
 
 /* plugin */
@@ -125,6 +150,7 @@ public:
     virtual void edit(Object* object);
     virtual bool handles(Object* object) const;
     virtual void make_visible(bool visible);
+    virtual void save_external_data();
 
     virtual bool forward_spatial_input_event(Camera* c, const InputEvent& e)
     {
@@ -0,0 +1,586 @@
+#include "terrain_erosion.h"
+#include "terrain_threads.h"
+#include "os/os.h"
+
+TerrainErosion::TerrainErosion()
+{
+    m_seed = 0;
+    m_hydraulic_iterations = 50;
+    m_rain = 0.01;
+    m_evaporation = 0.05;
+    m_capacity = 1.0;
+    m_erosion = 0.3;
+    m_deposition = 0.3;
+    m_thermal_iterations = 20;
+    m_talus = 0.5;
+    m_thermal_strength = 0.5;
+    m_tile_size = 128;
+}
+
+void TerrainErosion::set_seed(int seed)
+{
+    m_seed = seed;
+}
+
+int TerrainErosion::get_seed() const
+{
+    return m_seed;
+}
+
+void TerrainErosion::set_hydraulic_iterations(int iterations)
+{
+    m_hydraulic_iterations = MAX(iterations, 0);
+}
+
+int TerrainErosion::get_hydraulic_iterations() const
+{
+    return m_hydraulic_iterations;
+}
+
+void TerrainErosion::set_rain(float rain)
+{
+    m_rain = MAX(rain, 0.0f);
+}
+
+float TerrainErosion::get_rain() const
+{
+    return m_rain;
+}
+
+void TerrainErosion::set_evaporation(float evaporation)
+{
+    m_evaporation = CLAMP(evaporation, 0.0f, 1.0f);
+}
+
+float TerrainErosion::get_evaporation() const
+{
+    return m_evaporation;
+}
+
+void TerrainErosion::set_capacity(float capacity)
+{
+    m_capacity = MAX(capacity, 0.0f);
+}
+
+float TerrainErosion::get_capacity() const
+{
+    return m_capacity;
+}
+
+void TerrainErosion::set_erosion(float erosion)
+{
+    m_erosion = CLAMP(erosion, 0.0f, 1.0f);
+}
+
+float TerrainErosion::get_erosion() const
+{
+    return m_erosion;
+}
+
+void TerrainErosion::set_deposition(float deposition)
+{
+    m_deposition = CLAMP(deposition, 0.0f, 1.0f);
+}
+
+float TerrainErosion::get_deposition() const
+{
+    return m_deposition;
+}
+
+void TerrainErosion::set_thermal_iterations(int iterations)
+{
+    m_thermal_iterations = MAX(iterations, 0);
+}
+
+int TerrainErosion::get_thermal_iterations() const
+{
+    return m_thermal_iterations;
+}
+
+void TerrainErosion::set_talus(float talus)
+{
+    m_talus = MAX(talus, 0.0f);
+}
+
+float TerrainErosion::get_talus() const
+{
+    return m_talus;
+}
+
+void TerrainErosion::set_thermal_strength(float strength)
+{
+    m_thermal_strength = CLAMP(strength, 0.0f, 1.0f);
+}
+
+float TerrainErosion::get_thermal_strength() const
+{
+    return m_thermal_strength;
+}
+
+void TerrainErosion::set_tile_size(int size)
+{
+    m_tile_size = CLAMP(size, 16, 1024);
+}
+
+int TerrainErosion::get_tile_size() const
+{
+    return m_tile_size;
+}
+
+/* tile jobs */
+
+// fills tiles from the map, halo cells outside the region included
+void TerrainErosion::_load_tiles(void* userdata, int from, int to)
+{
+    Job* job = (Job*)userdata;
+
+    for (int t = from; t < to; t++) {
+        Tile& tile = job->tiles[t];
+
+        int lw = tile.w + HALO * 2;
+        int lh = tile.h + HALO * 2;
+
+        tile.height.resize(lw * lh);
+        tile.water.resize(lw * lh);
+        tile.sediment.resize(lw * lh);
+
+        float* h = &tile.height[0];
+        float* w = &tile.water[0];
+        float* s = &tile.sediment[0];
+
+        for (int j = 0; j < lh; j++) {
+            int my = CLAMP(job->region_y + tile.y - HALO + j, 0, job->map_stride - 1);
+
+            for (int i = 0; i < lw; i++) {
+                int mx = CLAMP(job->region_x + tile.x - HALO + i, 0, job->map_stride - 1);
+                int o = j * lw + i;
+
+                h[o] = TerrainData::decode_height(job->heights + (my * job->map_stride + mx) * 2);
+                w[o] = 0;
+                s[o] = 0;
+            }
+        }
+    }
+}
+
+void TerrainErosion::_run_tiles(void* userdata, int from, int to)
+{
+    Job* job = (Job*)userdata;
+
+    int size = (job->tile_size + HALO * 2) * (job->tile_size + HALO * 2);
+
+    Vector<float> scratch;
+    scratch.resize(size * 6);
+
+    for (int t = from; t < to; t++) {
+        Tile& tile = job->tiles[t];
+        int margin = 0;
+
+        for (int k = 0; k < job->steps; k++) {
+            if (job->hydraulic) {
+                job->erosion->_hydraulic_step(tile, margin, job->step + k, &scratch[0]);
+                margin += HYDRAULIC_RADIUS;
+            }
+            else {
+                job->erosion->_thermal_step(tile, margin, &scratch[0]);
+                margin += THERMAL_RADIUS;
+            }
+
+            _clamp_halo(job, tile);
+        }
+    }
+}
+
+// resets the halo cells outside the region to the map, with no water or
+// sediment, so the terrain around the region acts as a fixed border
+void TerrainErosion::_clamp_halo(const Job* job, Tile& tile)
+{
+    int lw = tile.w + HALO * 2;
+    int lh = tile.h + HALO * 2;
+
+    int x0 = tile.x - HALO;
+    int y0 = tile.y - HALO;
+
+    // tiles away from the region edges have nothing to reset
+    if (x0 >= 0 && y0 >= 0 && x0 + lw <= job->region_w && y0 + lh <= job->region_h) {
+        return;
+    }
+
+    float* h = &tile.height[0];
+    float* w = &tile.water[0];
+    float* s = &tile.sediment[0];
+
+    // columns [i1, i2) of a row lie inside the region
+    int i1 = CLAMP(-x0, 0, lw);
+    int i2 = CLAMP(job->region_w - x0, i1, lw);
+
+    for (int j = 0; j < lh; j++) {
+        int ry = y0 + j;
+        bool inside = ry >= 0 && ry < job->region_h;
+        int my = CLAMP(job->region_y + ry, 0, job->map_stride - 1);
+
+        for (int i = 0; i < lw; i++) {
+            if (inside && i == i1 && i2 > i1) {
+                i = i2 - 1;
+                continue;
+            }
+
+            int mx = CLAMP(job->region_x + x0 + i, 0, job->map_stride - 1);
+            int o = j * lw + i;
+
+            h[o] = TerrainData::decode_height(job->heights + (my * job->map_stride + mx) * 2);
+            w[o] = 0;
+            s[o] = 0;
+        }
+    }
+}
+
+// refreshes each tile's halo from the cores of its neighbours, cores are only
+// read here so tiles can do this in parallel
+void TerrainErosion::_exchange_halos(void* userdata, int from, int to)
+{
+    Job* job = (Job*)userdata;
+
+    for (int t = from; t < to; t++) {
+        Tile& tile = job->tiles[t];
+
+        int lw = tile.w + HALO * 2;
+        int lh = tile.h + HALO * 2;
+
+        float* h = &tile.height[0];
+        float* w = &tile.water[0];
+        float* s = &tile.sediment[0];
+
+        for (int j = 0; j < lh; j++) {
+            int ry = tile.y - HALO + j;
+            bool core_row = j >= HALO && j < HALO + tile.h;
+
+            for (int i = 0; i < lw; i++) {
+                if (core_row && i == HALO) {
+                    i += tile.w - 1;
+                    continue;
+                }
+
+                int rx = tile.x - HALO + i;
+                int o = j * lw + i;
+
+                if (rx < 0 || ry < 0 || rx >= job->region_w || ry >= job->region_h) {
+                    // outside the region, reset after every step already
+                    continue;
+                }
+
+                const Tile& owner = job->tiles[(ry / job->tile_size) * job->tiles_x + rx / job->tile_size];
+                int oo = (ry - owner.y + HALO) * (owner.w + HALO * 2) + (rx - owner.x + HALO);
+
+                h[o] = owner.height[oo];
+                w[o] = owner.water[oo];
+                s[o] = owner.sediment[oo];
+            }
+        }
+    }
+}
+
+// drops what the water still carries and writes the cores back to the map
+void TerrainErosion::_store_tiles(void* userdata, int from, int to)
+{
+    Job* job = (Job*)userdata;
+
+    for (int t = from; t < to; t++) {
+        Tile& tile = job->tiles[t];
+
+        int lw = tile.w + HALO * 2;
+
+        const float* h = &tile.height[0];
+        const float* s = &tile.sediment[0];
+
+        for (int j = 0; j < tile.h; j++) {
+            int my = job->region_y + tile.y + j;
+            uint8_t* row = job->heights + (my * job->map_stride + job->region_x + tile.x) * 2;
+            int o = (j + HALO) * lw + HALO;
+
+            for (int i = 0; i < tile.w; i++) {
+                TerrainData::encode_height(row + i * 2, h[o + i] + s[o + i]);
+            }
+        }
+    }
+}
+
+/* simulation */
+
+// water flows to lower neighbours and carries sediment, valid cells shrink by
+// HYDRAULIC_RADIUS from margin
+void TerrainErosion::_hydraulic_step(Tile& tile, int margin, int step, float* scratch) const
+{
+    int lw = tile.w + HALO * 2;
+    int lh = tile.h + HALO * 2;
+    int n = lw * lh;
+
+    float* h = &tile.height[0];
+    float* w = &tile.water[0];
+    float* s = &tile.sediment[0];
+
+    float* nh = scratch;
+    float* nw = nh + n;
+    float* ns = nw + n;
+    float* flow = ns + n; // outflow per unit of height difference
+    float* carry = flow + n; // same for sediment
+    float* out = carry + n; // water leaving the cell
+
+    /* rain, seeded by region position and step so tiling doesn't matter */
+
+    for (int j = margin; j < lh - margin; j++) {
+        for (int i = margin; i < lw - margin; i++) {
+            uint32_t r = ((uint32_t)(tile.x - HALO + i) * 73856093u) ^ ((uint32_t)(tile.y - HALO + j) * 19349663u) ^ ((uint32_t)step * 83492791u) ^ (uint32_t)m_seed;
+
+            w[j * lw + i] += m_rain * (0.5f + (Math::rand_from_seed(&r) & 0xFFFF) / 65535.0f);
+        }
+    }
+
+    /* outflow */
+
+    for (int j = margin + 1; j < lh - margin - 1; j++) {
+        for (int i = margin + 1; i < lw - margin - 1; i++) {
+            int o = j * lw + i;
+            float level = h[o] + w[o];
+
+            float d = MAX(level - h[o - 1] - w[o - 1], 0.0f);
+            d += MAX(level - h[o + 1] - w[o + 1], 0.0f);
+            d += MAX(level - h[o - lw] - w[o - lw], 0.0f);
+            d += MAX(level - h[o + lw] - w[o + lw], 0.0f);
+
+            // never more than levels the cell with its neighbours
+            float f = MIN(w[o], d * 0.5f);
+
+            out[o] = f;
+            flow[o] = d > 0 ? f / d : 0;
+            carry[o] = w[o] > 0 ? flow[o] * s[o] / w[o] : 0;
+        }
+    }
+
+    /* inflow, erosion and deposition */
+
+    int nb[4] = { -1, 1, -lw, lw };
+
+    for (int j = margin + 2; j < lh - margin - 2; j++) {
+        for (int i = margin + 2; i < lw - margin - 2; i++) {
+            int o = j * lw + i;
+            float level = h[o] + w[o];
+            float water_in = 0;
+            float sediment_in = 0;
+
+            for (int k = 0; k < 4; k++) {
+                int q = o + nb[k];
+                float d = MAX(h[q] + w[q] - level, 0.0f);
+
+                water_in += flow[q] * d;
+                sediment_in += carry[q] * d;
+            }
+
+            float sediment = s[o] - (w[o] > 0 ? s[o] * out[o] / w[o] : 0) + sediment_in;
+            float height = h[o];
+            float capacity = m_capacity * out[o];
+
+            if (sediment > capacity) {
+                float amount = m_deposition * (sediment - capacity);
+                height += amount;
+                sediment -= amount;
+            }
+            else {
+                float amount = m_erosion * (capacity - sediment);
+                height -= amount;
+                sediment += amount;
+            }
+
+            nh[o] = height;
+            nw[o] = (w[o] - out[o] + water_in) * (1.0f - m_evaporation);
+            ns[o] = sediment;
+        }
+    }
+
+    int x1 = margin + 2;
+    int count = lw - (margin + 2) * 2;
+
+    for (int j = margin + 2; j < lh - margin - 2; j++) {
+        copymem(h + j * lw + x1, nh + j * lw + x1, count * sizeof(float));
+        copymem(w + j * lw + x1, nw + j * lw + x1, count * sizeof(float));
+        copymem(s + j * lw + x1, ns + j * lw + x1, count * sizeof(float));
+    }
+}
+
+// material slides down where the slope is steeper than talus, valid cells
+// shrink by THERMAL_RADIUS from margin
+void TerrainErosion::_thermal_step(Tile& tile, int margin, float* scratch) const
+{
+    int lw = tile.w + HALO * 2;
+    int lh = tile.h + HALO * 2;
+
+    float* h = &tile.height[0];
+    float* nh = scratch;
+
+    // symmetric exchange, stays stable below a quarter per neighbour
+    float k = m_thermal_strength * 0.2f;
+
+    for (int j = margin + 1; j < lh - margin - 1; j++) {
+        for (int i = margin + 1; i < lw - margin - 1; i++) {
+            int o = j * lw + i;
+            float c = h[o];
+            float delta = 0;
+
+            float d = h[o - 1] - c;
+            delta += d > m_talus ? d - m_talus : (d < -m_talus ? d + m_talus : 0);
+            d = h[o + 1] - c;
+            delta += d > m_talus ? d - m_talus : (d < -m_talus ? d + m_talus : 0);
+            d = h[o - lw] - c;
+            delta += d > m_talus ? d - m_talus : (d < -m_talus ? d + m_talus : 0);
+            d = h[o + lw] - c;
+            delta += d > m_talus ? d - m_talus : (d < -m_talus ? d + m_talus : 0);
+
+            nh[o] = c + k * delta;
+        }
+    }
+
+    int x1 = margin + 1;
+    int count = lw - (margin + 1) * 2;
+
+    for (int j = margin + 1; j < lh - margin - 1; j++) {
+        copymem(h + j * lw + x1, nh + j * lw + x1, count * sizeof(float));
+    }
+}
+
+// each round runs as many steps as the halo covers, then exchanges halos
+void TerrainErosion::_run_rounds(Job& job, int iterations, int radius) const
+{
+    int per_round = HALO / radius;
+    int count = job.tiles_x * job.tiles_y;
+
+    for (int done = 0; done < iterations; done += per_round) {
+        job.step = done;
+        job.steps = MIN(per_round, iterations - done);
+
+        TerrainThreads::run(_run_tiles, &job, count);
+        TerrainThreads::run(_exchange_halos, &job, count);
+    }
+}
+
+void TerrainErosion::erode(const Ref<TerrainData>& data)
+{
+    ERR_FAIL_COND(data.is_null());
+
+    erode_region(data, Rect2(0, 0, data->get_size() + 1, data->get_size() + 1));
+}
+
+// region is in height texels, (size + 1)^2 for the whole map
+void TerrainErosion::erode_region(const Ref<TerrainData>& data, const Rect2& region)
+{
+    ERR_FAIL_COND(data.is_null());
+
+    int stride = data->get_size() + 1;
+    Rect2 r = region.clip(Rect2(0, 0, stride, stride));
+
+    if (r.size.x < 1 || r.size.y < 1) {
+        return;
+    }
+
+    uint32_t benchmark = OS::get_singleton()->get_ticks_msec();
+
+    Job job;
+    job.erosion = this;
+    job.tile_size = m_tile_size;
+    job.region_x = r.pos.x;
+    job.region_y = r.pos.y;
+    job.region_w = r.size.x;
+    job.region_h = r.size.y;
+    job.map_stride = stride;
+    job.tiles_x = (job.region_w + m_tile_size - 1) / m_tile_size;
+    job.tiles_y = (job.region_h + m_tile_size - 1) / m_tile_size;
+
+    Vector<Tile> tiles;
+    tiles.resize(job.tiles_x * job.tiles_y);
+
+    for (int ty = 0; ty < job.tiles_y; ty++) {
+        for (int tx = 0; tx < job.tiles_x; tx++) {
+            Tile& tile = tiles[ty * job.tiles_x + tx];
+
+            tile.x = tx * m_tile_size;
+            tile.y = ty * m_tile_size;
+            tile.w = MIN(m_tile_size, job.region_w - tile.x);
+            tile.h = MIN(m_tile_size, job.region_h - tile.y);
+        }
+    }
+
+    int count = tiles.size();
+    job.tiles = &tiles[0];
+
+    DVector<uint8_t>::Write w = data->get_height_buffer().write();
+    job.heights = w.ptr();
+
+    TerrainThreads::run(_load_tiles, &job, count);
+
+    job.hydraulic = true;
+    _run_rounds(job, m_hydraulic_iterations, HYDRAULIC_RADIUS);
+
+    job.hydraulic = false;
+    _run_rounds(job, m_thermal_iterations, THERMAL_RADIUS);
+
+    TerrainThreads::run(_store_tiles, &job, count);
+
+    w = DVector<uint8_t>::Write();
+
+    data->heights_changed(r);
+
+    benchmark = OS::get_singleton()->get_ticks_msec() - benchmark;
+
+    if (OS::get_singleton()->is_stdout_verbose()) {
+        print_line("TerrainErosion::erode_region() benchmark:" + itos(benchmark));
+    }
+}
+
+void TerrainErosion::_bind_methods()
+{
+    ObjectTypeDB::bind_method(_MD("set_seed", "seed"), &TerrainErosion::set_seed);
+    ObjectTypeDB::bind_method(_MD("get_seed"), &TerrainErosion::get_seed);
+    ADD_PROPERTY(PropertyInfo(Variant::INT, "seed"), _SCS("set_seed"), _SCS("get_seed"));
+
+    ObjectTypeDB::bind_method(_MD("set_hydraulic_iterations", "iterations"), &TerrainErosion::set_hydraulic_iterations);
+    ObjectTypeDB::bind_method(_MD("get_hydraulic_iterations"), &TerrainErosion::get_hydraulic_iterations);
+    ADD_PROPERTY(PropertyInfo(Variant::INT, "hydraulic/iterations"), _SCS("set_hydraulic_iterations"), _SCS("get_hydraulic_iterations"));
+
+    ObjectTypeDB::bind_method(_MD("set_rain", "rain"), &TerrainErosion::set_rain);
+    ObjectTypeDB::bind_method(_MD("get_rain"), &TerrainErosion::get_rain);
+    ADD_PROPERTY(PropertyInfo(Variant::REAL, "hydraulic/rain"), _SCS("set_rain"), _SCS("get_rain"));
+
+    ObjectTypeDB::bind_method(_MD("set_evaporation", "evaporation"), &TerrainErosion::set_evaporation);
+    ObjectTypeDB::bind_method(_MD("get_evaporation"), &TerrainErosion::get_evaporation);
+    ADD_PROPERTY(PropertyInfo(Variant::REAL, "hydraulic/evaporation", PROPERTY_HINT_RANGE, "0,1,0.01"), _SCS("set_evaporation"), _SCS("get_evaporation"));
+
+    ObjectTypeDB::bind_method(_MD("set_capacity", "capacity"), &TerrainErosion::set_capacity);
+    ObjectTypeDB::bind_method(_MD("get_capacity"), &TerrainErosion::get_capacity);
+    ADD_PROPERTY(PropertyInfo(Variant::REAL, "hydraulic/capacity"), _SCS("set_capacity"), _SCS("get_capacity"));
+
+    ObjectTypeDB::bind_method(_MD("set_erosion", "erosion"), &TerrainErosion::set_erosion);
+    ObjectTypeDB::bind_method(_MD("get_erosion"), &TerrainErosion::get_erosion);
+    ADD_PROPERTY(PropertyInfo(Variant::REAL, "hydraulic/erosion", PROPERTY_HINT_RANGE, "0,1,0.01"), _SCS("set_erosion"), _SCS("get_erosion"));
+
+    ObjectTypeDB::bind_method(_MD("set_deposition", "deposition"), &TerrainErosion::set_deposition);
+    ObjectTypeDB::bind_method(_MD("get_deposition"), &TerrainErosion::get_deposition);
+    ADD_PROPERTY(PropertyInfo(Variant::REAL, "hydraulic/deposition", PROPERTY_HINT_RANGE, "0,1,0.01"), _SCS("set_deposition"), _SCS("get_deposition"));
+
+    ObjectTypeDB::bind_method(_MD("set_thermal_iterations", "iterations"), &TerrainErosion::set_thermal_iterations);
+    ObjectTypeDB::bind_method(_MD("get_thermal_iterations"), &TerrainErosion::get_thermal_iterations);
+    ADD_PROPERTY(PropertyInfo(Variant::INT, "thermal/iterations"), _SCS("set_thermal_iterations"), _SCS("get_thermal_iterations"));
+
+    ObjectTypeDB::bind_method(_MD("set_talus", "talus"), &TerrainErosion::set_talus);
+    ObjectTypeDB::bind_method(_MD("get_talus"), &TerrainErosion::get_talus);
+    ADD_PROPERTY(PropertyInfo(Variant::REAL, "thermal/talus"), _SCS("set_talus"), _SCS("get_talus"));
+
+    ObjectTypeDB::bind_method(_MD("set_thermal_strength", "strength"), &TerrainErosion::set_thermal_strength);
+    ObjectTypeDB::bind_method(_MD("get_thermal_strength"), &TerrainErosion::get_thermal_strength);
+    ADD_PROPERTY(PropertyInfo(Variant::REAL, "thermal/strength", PROPERTY_HINT_RANGE, "0,1,0.01"), _SCS("set_thermal_strength"), _SCS("get_thermal_strength"));
+
+    ObjectTypeDB::bind_method(_MD("set_tile_size", "size"), &TerrainErosion::set_tile_size);
+    ObjectTypeDB::bind_method(_MD("get_tile_size"), &TerrainErosion::get_tile_size);
+    ADD_PROPERTY(PropertyInfo(Variant::INT, "tile_size", PROPERTY_HINT_RANGE, "16,1024,16"), _SCS("set_tile_size"), _SCS("get_tile_size"));
+
+    ObjectTypeDB::bind_method(_MD("erode", "data:TerrainData"), &TerrainErosion::erode);
+    ObjectTypeDB::bind_method(_MD("erode_region", "data:TerrainData", "region"), &TerrainErosion::erode_region);
+}
@@ -0,0 +1,114 @@
+#ifndef _TERRAIN_EROSION_H
+#define _TERRAIN_EROSION_H
+
+#include "reference.h"
+#include "terrain_data.h"
+
+// grid based hydraulic and thermal erosion on TerrainData heights. The region
+// is cut into tiles with a halo, tiles run several steps on their own and then
+// refresh the halo from their neighbours, so results depend on the seed only
+class TerrainErosion : public Reference {
+    OBJ_TYPE(TerrainErosion, Reference)
+
+public:
+    TerrainErosion();
+
+    void set_seed(int seed);
+    int get_seed() const;
+
+    void set_hydraulic_iterations(int iterations);
+    int get_hydraulic_iterations() const;
+
+    void set_rain(float rain);
+    float get_rain() const;
+
+    void set_evaporation(float evaporation);
+    float get_evaporation() const;
+
+    void set_capacity(float capacity);
+    float get_capacity() const;
+
+    void set_erosion(float erosion);
+    float get_erosion() const;
+
+    void set_deposition(float deposition);
+    float get_deposition() const;
+
+    void set_thermal_iterations(int iterations);
+    int get_thermal_iterations() const;
+
+    void set_talus(float talus);
+    float get_talus() const;
+
+    void set_thermal_strength(float strength);
+    float get_thermal_strength() const;
+
+    void set_tile_size(int size);
+    int get_tile_size() const;
+
+    void erode(const Ref<TerrainData>& data);
+    void erode_region(const Ref<TerrainData>& data, const Rect2& region);
+
+private:
+    enum {
+        HALO = 8,
+        HYDRAULIC_RADIUS = 2, // outflow depends on the neighbours' outflow
+        THERMAL_RADIUS = 1,
+    };
+
+    // core cells plus HALO on each side, (w + 2 * HALO) x (h + 2 * HALO)
+    struct Tile {
+        int x; // core position inside the region
+        int y;
+        int w;
+        int h;
+        Vector<float> height;
+        Vector<float> water;
+        Vector<float> sediment;
+    };
+
+    struct Job {
+        const TerrainErosion* erosion;
+        Tile* tiles;
+        int tiles_x;
+        int tiles_y;
+        int tile_size;
+        int region_x;
+        int region_y;
+        int region_w;
+        int region_h;
+        int map_stride;
+        uint8_t* heights;
+        bool hydraulic;
+        int step; // first global step of the round
+        int steps; // steps this round
+    };
+
+    static void _load_tiles(void* userdata, int from, int to);
+    static void _run_tiles(void* userdata, int from, int to);
+    static void _clamp_halo(const Job* job, Tile& tile);
+    static void _exchange_halos(void* userdata, int from, int to);
+    static void _store_tiles(void* userdata, int from, int to);
+
+    void _hydraulic_step(Tile& tile, int margin, int step, float* scratch) const;
+    void _thermal_step(Tile& tile, int margin, float* scratch) const;
+
+    void _run_rounds(Job& job, int iterations, int radius) const;
+
+    int m_seed;
+    int m_hydraulic_iterations;
+    float m_rain;
+    float m_evaporation;
+    float m_capacity;
+    float m_erosion;
+    float m_deposition;
+    int m_thermal_iterations;
+    float m_talus; // height difference per texel that stays put
+    float m_thermal_strength;
+    int m_tile_size;
+
+protected:
+    static void _bind_methods();
+};
+
+#endif
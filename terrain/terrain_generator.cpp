@@ -0,0 +1,577 @@
+#include "terrain_generator.h"
+#include "terrain_threads.h"
+#include "os/os.h"
+
+/* noise */
+
+// integer hash lattice instead of permutation tables, so rows of
+// samples compile to straight vector code without gathers
+static inline uint32_t _hash(int x, int y, uint32_t seed)
+{
+    uint32_t h = seed + (uint32_t)x * 0x27d4eb2du + (uint32_t)y * 0x165667b1u;
+    h = (h ^ (h >> 15)) * 0x85ebca6bu;
+    return h ^ (h >> 13);
+}
+
+static inline float _grad(uint32_t h, float x, float y)
+{
+    return ((h & 1) ? x : -x) + ((h & 2) ? y : -y);
+}
+
+// 2d gradient noise, about -1 .. 1
+static inline float _gradient_noise(float x, float y, uint32_t seed)
+{
+    int xi = (int)x;
+    int yi = (int)y;
+
+    xi -= x < xi;
+    yi -= y < yi;
+
+    float fx = x - xi;
+    float fy = y - yi;
+
+    float u = fx * fx * fx * (fx * (fx * 6.0f - 15.0f) + 10.0f);
+    float v = fy * fy * fy * (fy * (fy * 6.0f - 15.0f) + 10.0f);
+
+    float n00 = _grad(_hash(xi, yi, seed), fx, fy);
+    float n10 = _grad(_hash(xi + 1, yi, seed), fx - 1.0f, fy);
+    float n01 = _grad(_hash(xi, yi + 1, seed), fx, fy - 1.0f);
+    float n11 = _grad(_hash(xi + 1, yi + 1, seed), fx - 1.0f, fy - 1.0f);
+
+    float nx0 = n00 + u * (n10 - n00);
+    float nx1 = n01 + u * (n11 - n01);
+
+    return (nx0 + v * (nx1 - nx0)) * 0.5f;
+}
+
+static inline float _soft_range(float value, float min, float max, float blend)
+{
+    if (blend <= 0) {
+        return value >= min && value <= max ? 1.0f : 0.0f;
+    }
+
+    return CLAMP(MIN(value - min, max - value) / blend + 0.5f, 0.0f, 1.0f);
+}
+
+TerrainGenerator::TerrainGenerator()
+{
+    m_seed = 0;
+    m_noise_type = NOISE_FBM;
+    m_octaves = 6;
+    m_frequency = 4.0;
+    m_lacunarity = 2.0;
+    m_gain = 0.5;
+    m_height = 20.0;
+    m_base_height = 0.0;
+    m_warp_strength = 0.0;
+    m_warp_frequency = 2.0;
+    m_terrace_steps = 0;
+    m_terrace_sharpness = 0.5;
+    m_edge_falloff = 0.0;
+    m_mask_w = 0;
+    m_mask_h = 0;
+}
+
+void TerrainGenerator::set_seed(int seed)
+{
+    m_seed = seed;
+}
+
+int TerrainGenerator::get_seed() const
+{
+    return m_seed;
+}
+
+void TerrainGenerator::set_noise_type(int type)
+{
+    ERR_FAIL_INDEX(type, NOISE_RIDGED + 1);
+    m_noise_type = (NoiseType)type;
+}
+
+int TerrainGenerator::get_noise_type() const
+{
+    return m_noise_type;
+}
+
+void TerrainGenerator::set_octaves(int octaves)
+{
+    m_octaves = CLAMP(octaves, 1, 16);
+}
+
+int TerrainGenerator::get_octaves() const
+{
+    return m_octaves;
+}
+
+void TerrainGenerator::set_frequency(float frequency)
+{
+    m_frequency = MAX(frequency, 0.0f);
+}
+
+float TerrainGenerator::get_frequency() const
+{
+    return m_frequency;
+}
+
+void TerrainGenerator::set_lacunarity(float lacunarity)
+{
+    m_lacunarity = lacunarity;
+}
+
+float TerrainGenerator::get_lacunarity() const
+{
+    return m_lacunarity;
+}
+
+void TerrainGenerator::set_gain(float gain)
+{
+    m_gain = gain;
+}
+
+float TerrainGenerator::get_gain() const
+{
+    return m_gain;
+}
+
+void TerrainGenerator::set_height(float height)
+{
+    m_height = height;
+}
+
+float TerrainGenerator::get_height() const
+{
+    return m_height;
+}
+
+void TerrainGenerator::set_base_height(float height)
+{
+    m_base_height = height;
+}
+
+float TerrainGenerator::get_base_height() const
+{
+    return m_base_height;
+}
+
+void TerrainGenerator::set_warp_strength(float strength)
+{
+    m_warp_strength = strength;
+}
+
+float TerrainGenerator::get_warp_strength() const
+{
+    return m_warp_strength;
+}
+
+void TerrainGenerator::set_warp_frequency(float frequency)
+{
+    m_warp_frequency = MAX(frequency, 0.0f);
+}
+
+float TerrainGenerator::get_warp_frequency() const
+{
+    return m_warp_frequency;
+}
+
+void TerrainGenerator::set_terrace_steps(int steps)
+{
+    m_terrace_steps = MAX(steps, 0);
+}
+
+int TerrainGenerator::get_terrace_steps() const
+{
+    return m_terrace_steps;
+}
+
+void TerrainGenerator::set_terrace_sharpness(float sharpness)
+{
+    m_terrace_sharpness = CLAMP(sharpness, 0.0f, 1.0f);
+}
+
+float TerrainGenerator::get_terrace_sharpness() const
+{
+    return m_terrace_sharpness;
+}
+
+void TerrainGenerator::set_mask(const Image& mask)
+{
+    m_mask = mask;
+}
+
+Image TerrainGenerator::get_mask() const
+{
+    return m_mask;
+}
+
+void TerrainGenerator::set_edge_falloff(float falloff)
+{
+    m_edge_falloff = CLAMP(falloff, 0.0f, 0.5f);
+}
+
+float TerrainGenerator::get_edge_falloff() const
+{
+    return m_edge_falloff;
+}
+
+// blend is the width of the soft rule edges, in height and slope units
+void TerrainGenerator::add_layer_rule(int layer, float min_height, float max_height, float min_slope, float max_slope, float blend)
+{
+    ERR_FAIL_INDEX(layer, TerrainData::MAX_LAYERS);
+
+    LayerRule rule;
+    rule.layer = layer;
+    rule.min_height = min_height;
+    rule.max_height = max_height;
+    rule.min_slope = min_slope;
+    rule.max_slope = max_slope;
+    rule.blend = blend;
+
+    m_rules.push_back(rule);
+}
+
+void TerrainGenerator::clear_layer_rules()
+{
+    m_rules.clear();
+}
+
+// octaves of noise for a row of sample points, result in 0 .. 1
+void TerrainGenerator::_noise_row(const float* xs, const float* ys, float* out, int count, uint32_t seed, int octaves, bool ridged) const
+{
+    Vector<float> weights;
+
+    if (ridged) {
+        weights.resize(count);
+
+        for (int i = 0; i < count; i++) {
+            weights[i] = 1.0f;
+        }
+    }
+
+    for (int i = 0; i < count; i++) {
+        out[i] = 0;
+    }
+
+    float amp = 1.0f;
+    float freq = 1.0f;
+    float total = 0;
+
+    for (int o = 0; o < octaves; o++) {
+        uint32_t s = seed + o * 1013;
+
+        if (ridged) {
+            float* w = &weights[0];
+
+            for (int i = 0; i < count; i++) {
+                float n = 1.0f - ABS(_gradient_noise(xs[i] * freq, ys[i] * freq, s));
+                n *= n;
+                out[i] += n * amp * w[i];
+                w[i] = CLAMP(n * 2.0f, 0.0f, 1.0f);
+            }
+        }
+        else {
+            for (int i = 0; i < count; i++) {
+                out[i] += _gradient_noise(xs[i] * freq, ys[i] * freq, s) * amp;
+            }
+        }
+
+        total += amp;
+        amp *= m_gain;
+        freq *= m_lacunarity;
+    }
+
+    float inv = total > 0 ? 1.0f / total : 0;
+
+    if (ridged) {
+        for (int i = 0; i < count; i++) {
+            out[i] = CLAMP(out[i] * inv, 0.0f, 1.0f);
+        }
+    }
+    else {
+        for (int i = 0; i < count; i++) {
+            out[i] = CLAMP(out[i] * inv * 0.5f + 0.5f, 0.0f, 1.0f);
+        }
+    }
+}
+
+float TerrainGenerator::_sample_mask(float u, float v) const
+{
+    float x = CLAMP(u * (m_mask_w - 1), 0, m_mask_w - 1);
+    float y = CLAMP(v * (m_mask_h - 1), 0, m_mask_h - 1);
+
+    int x1 = (int)x;
+    int y1 = (int)y;
+    int x2 = MIN(x1 + 1, m_mask_w - 1);
+    int y2 = MIN(y1 + 1, m_mask_h - 1);
+
+    float fx = x - x1;
+    float fy = y - y1;
+
+    const float* m = &m_mask_values[0];
+
+    float top = m[y1 * m_mask_w + x1] + (m[y1 * m_mask_w + x2] - m[y1 * m_mask_w + x1]) * fx;
+    float bottom = m[y2 * m_mask_w + x1] + (m[y2 * m_mask_w + x2] - m[y2 * m_mask_w + x1]) * fx;
+
+    return top + (bottom - top) * fy;
+}
+
+void TerrainGenerator::_heights_rows(void* userdata, int from, int to)
+{
+    Job* job = (Job*)userdata;
+    const TerrainGenerator* gen = job->gen;
+
+    int size = job->size;
+    int n = size + 1;
+    float inv = gen->m_frequency / size;
+    bool warp = gen->m_warp_strength != 0 && gen->m_warp_frequency > 0;
+    bool mask = gen->m_mask_w > 0;
+
+    // scratch rows: sample x, sample y, values and the warp offsets
+    Vector<float> scratch;
+    scratch.resize(n * (warp ? 5 : 3));
+
+    float* xs = &scratch[0];
+    float* ys = xs + n;
+    float* v = ys + n;
+    float* wx = v + n;
+    float* wy = wx + n;
+
+    for (int y = from; y < to; y++) {
+
+        /* sample points, optionally pushed around by low frequency noise */
+
+        if (warp) {
+            float winv = gen->m_warp_frequency / size;
+
+            for (int x = 0; x < n; x++) {
+                xs[x] = x * winv;
+                ys[x] = y * winv;
+            }
+
+            gen->_noise_row(xs, ys, wx, n, gen->m_seed + 101, 3, false);
+            gen->_noise_row(xs, ys, wy, n, gen->m_seed + 202, 3, false);
+
+            // warp strength is a fraction of the map, the noise spans m_frequency periods
+            float amount = gen->m_warp_strength * gen->m_frequency * 2.0f;
+
+            for (int x = 0; x < n; x++) {
+                xs[x] = x * inv + (wx[x] - 0.5f) * amount;
+                ys[x] = y * inv + (wy[x] - 0.5f) * amount;
+            }
+        }
+        else {
+            for (int x = 0; x < n; x++) {
+                xs[x] = x * inv;
+                ys[x] = y * inv;
+            }
+        }
+
+        gen->_noise_row(xs, ys, v, n, gen->m_seed, gen->m_octaves, gen->m_noise_type == NOISE_RIDGED);
+
+        /* shaping */
+
+        if (gen->m_terrace_steps > 0) {
+            float steps = gen->m_terrace_steps;
+            float width = 1.0f - gen->m_terrace_sharpness * 0.95f; // part of each step that ramps
+
+            for (int x = 0; x < n; x++) {
+                float t = v[x] * steps;
+                float k = Math::floor(t);
+                float r = CLAMP((t - k - 1.0f + width) / width, 0.0f, 1.0f);
+
+                v[x] = (k + r * r * (3.0f - 2.0f * r)) / steps;
+            }
+        }
+
+        if (mask) {
+            for (int x = 0; x < n; x++) {
+                v[x] *= gen->_sample_mask(x / (float)size, y / (float)size);
+            }
+        }
+
+        if (gen->m_edge_falloff > 0) {
+            float fade = gen->m_edge_falloff * size;
+            float ey = MIN(y, size - y) / fade;
+
+            for (int x = 0; x < n; x++) {
+                float e = CLAMP(MIN((float)MIN(x, size - x) / fade, ey), 0.0f, 1.0f);
+                v[x] *= e * e * (3.0f - 2.0f * e);
+            }
+        }
+
+        uint8_t* row = job->heights + y * n * 2;
+
+        for (int x = 0; x < n; x++) {
+            TerrainData::encode_height(row + x * 2, gen->m_base_height + v[x] * gen->m_height);
+        }
+    }
+}
+
+void TerrainGenerator::_blend_rows(void* userdata, int from, int to)
+{
+    Job* job = (Job*)userdata;
+    const TerrainGenerator* gen = job->gen;
+
+    int size = job->size;
+    int n = size + 1;
+    int count = gen->m_rules.size();
+
+    Vector<int> layers;
+    Vector<float> weights;
+    layers.resize(count + 1);
+    weights.resize(count + 1);
+
+    for (int y = from; y < to; y++) {
+        const uint8_t* row = job->heights + y * n * 2;
+        uint8_t* texel = job->blends + y * size * 4;
+
+        for (int x = 0; x < size; x++, texel += 4) {
+            float h = TerrainData::decode_height(row + x * 2);
+            float dx = TerrainData::decode_height(row + x * 2 + 2) - h;
+            float dy = TerrainData::decode_height(row + n * 2 + x * 2) - h;
+            float slope = Math::sqrt(dx * dx + dy * dy);
+
+            float total = 0;
+
+            for (int i = 0; i < count; i++) {
+                const LayerRule& rule = gen->m_rules[i];
+                float w = _soft_range(h, rule.min_height, rule.max_height, rule.blend);
+
+                w *= _soft_range(slope, rule.min_slope, rule.max_slope, rule.blend);
+
+                layers[i] = rule.layer;
+                weights[i] = w;
+                total += w;
+            }
+
+            // whatever no rule claims stays on the base layer
+            layers[count] = 0;
+            weights[count] = MAX(1.0f - total, 0.0f);
+
+            TerrainData::encode_blend(texel, &layers[0], &weights[0], count + 1);
+        }
+    }
+}
+
+void TerrainGenerator::generate(const Ref<TerrainData>& data)
+{
+    ERR_FAIL_COND(data.is_null());
+
+    int size = data->get_size();
+    ERR_FAIL_COND(size <= 0);
+
+    uint32_t benchmark = OS::get_singleton()->get_ticks_msec();
+
+    if (!m_mask.empty()) {
+        m_mask_w = m_mask.get_width();
+        m_mask_h = m_mask.get_height();
+        m_mask_values.resize(m_mask_w * m_mask_h);
+
+        for (int y = 0; y < m_mask_h; y++) {
+            for (int x = 0; x < m_mask_w; x++) {
+                m_mask_values[y * m_mask_w + x] = m_mask.get_pixel(x, y).gray();
+            }
+        }
+    }
+
+    Job job;
+    job.gen = this;
+    job.size = size;
+    job.blends = NULL;
+
+    DVector<uint8_t>::Write hw = data->get_height_buffer().write();
+    job.heights = hw.ptr();
+
+    TerrainThreads::run(_heights_rows, &job, size + 1, 16);
+
+    if (m_rules.size()) {
+        DVector<uint8_t>::Write bw = data->get_blend_buffer().write();
+        job.blends = bw.ptr();
+
+        TerrainThreads::run(_blend_rows, &job, size, 16);
+    }
+
+    hw = DVector<uint8_t>::Write();
+
+    m_mask_values.clear();
+    m_mask_w = 0;
+    m_mask_h = 0;
+
+    data->heights_changed(Rect2(0, 0, size + 1, size + 1));
+
+    if (m_rules.size()) {
+        data->blends_changed(Rect2(0, 0, size, size));
+    }
+
+    benchmark = OS::get_singleton()->get_ticks_msec() - benchmark;
+
+    if (OS::get_singleton()->is_stdout_verbose()) {
+        print_line("TerrainGenerator::generate() benchmark:" + itos(benchmark));
+    }
+}
+
+void TerrainGenerator::_bind_methods()
+{
+    ObjectTypeDB::bind_method(_MD("set_seed", "seed"), &TerrainGenerator::set_seed);
+    ObjectTypeDB::bind_method(_MD("get_seed"), &TerrainGenerator::get_seed);
+    ADD_PROPERTY(PropertyInfo(Variant::INT, "seed"), _SCS("set_seed"), _SCS("get_seed"));
+
+    ObjectTypeDB::bind_method(_MD("set_noise_type", "type"), &TerrainGenerator::set_noise_type);
+    ObjectTypeDB::bind_method(_MD("get_noise_type"), &TerrainGenerator::get_noise_type);
+    ADD_PROPERTY(PropertyInfo(Variant::INT, "noise/type", PROPERTY_HINT_ENUM, "fBm,Ridged"), _SCS("set_noise_type"), _SCS("get_noise_type"));
+
+    ObjectTypeDB::bind_method(_MD("set_octaves", "octaves"), &TerrainGenerator::set_octaves);
+    ObjectTypeDB::bind_method(_MD("get_octaves"), &TerrainGenerator::get_octaves);
+    ADD_PROPERTY(PropertyInfo(Variant::INT, "noise/octaves", PROPERTY_HINT_RANGE, "1,16,1"), _SCS("set_octaves"), _SCS("get_octaves"));
+
+    ObjectTypeDB::bind_method(_MD("set_frequency", "frequency"), &TerrainGenerator::set_frequency);
+    ObjectTypeDB::bind_method(_MD("get_frequency"), &TerrainGenerator::get_frequency);
+    ADD_PROPERTY(PropertyInfo(Variant::REAL, "noise/frequency"), _SCS("set_frequency"), _SCS("get_frequency"));
+
+    ObjectTypeDB::bind_method(_MD("set_lacunarity", "lacunarity"), &TerrainGenerator::set_lacunarity);
+    ObjectTypeDB::bind_method(_MD("get_lacunarity"), &TerrainGenerator::get_lacunarity);
+    ADD_PROPERTY(PropertyInfo(Variant::REAL, "noise/lacunarity"), _SCS("set_lacunarity"), _SCS("get_lacunarity"));
+
+    ObjectTypeDB::bind_method(_MD("set_gain", "gain"), &TerrainGenerator::set_gain);
+    ObjectTypeDB::bind_method(_MD("get_gain"), &TerrainGenerator::get_gain);
+    ADD_PROPERTY(PropertyInfo(Variant::REAL, "noise/gain"), _SCS("set_gain"), _SCS("get_gain"));
+
+    ObjectTypeDB::bind_method(_MD("set_height", "height"), &TerrainGenerator::set_height);
+    ObjectTypeDB::bind_method(_MD("get_height"), &TerrainGenerator::get_height);
+    ADD_PROPERTY(PropertyInfo(Variant::REAL, "height"), _SCS("set_height"), _SCS("get_height"));
+
+    ObjectTypeDB::bind_method(_MD("set_base_height", "height"), &TerrainGenerator::set_base_height);
+    ObjectTypeDB::bind_method(_MD("get_base_height"), &TerrainGenerator::get_base_height);
+    ADD_PROPERTY(PropertyInfo(Variant::REAL, "base_height"), _SCS("set_base_height"), _SCS("get_base_height"));
+
+    ObjectTypeDB::bind_method(_MD("set_warp_strength", "strength"), &TerrainGenerator::set_warp_strength);
+    ObjectTypeDB::bind_method(_MD("get_warp_strength"), &TerrainGenerator::get_warp_strength);
+    ADD_PROPERTY(PropertyInfo(Variant::REAL, "warp/strength"), _SCS("set_warp_strength"), _SCS("get_warp_strength"));
+
+    ObjectTypeDB::bind_method(_MD("set_warp_frequency", "frequency"), &TerrainGenerator::set_warp_frequency);
+    ObjectTypeDB::bind_method(_MD("get_warp_frequency"), &TerrainGenerator::get_warp_frequency);
+    ADD_PROPERTY(PropertyInfo(Variant::REAL, "warp/frequency"), _SCS("set_warp_frequency"), _SCS("get_warp_frequency"));
+
+    ObjectTypeDB::bind_method(_MD("set_terrace_steps", "steps"), &TerrainGenerator::set_terrace_steps);
+    ObjectTypeDB::bind_method(_MD("get_terrace_steps"), &TerrainGenerator::get_terrace_steps);
+    ADD_PROPERTY(PropertyInfo(Variant::INT, "terrace/steps"), _SCS("set_terrace_steps"), _SCS("get_terrace_steps"));
+
+    ObjectTypeDB::bind_method(_MD("set_terrace_sharpness", "sharpness"), &TerrainGenerator::set_terrace_sharpness);
+    ObjectTypeDB::bind_method(_MD("get_terrace_sharpness"), &TerrainGenerator::get_terrace_sharpness);
+    ADD_PROPERTY(PropertyInfo(Variant::REAL, "terrace/sharpness", PROPERTY_HINT_RANGE, "0,1,0.01"), _SCS("set_terrace_sharpness"), _SCS("get_terrace_sharpness"));
+
+    ObjectTypeDB::bind_method(_MD("set_mask", "mask"), &TerrainGenerator::set_mask);
+    ObjectTypeDB::bind_method(_MD("get_mask"), &TerrainGenerator::get_mask);
+    ADD_PROPERTY(PropertyInfo(Variant::IMAGE, "mask/image"), _SCS("set_mask"), _SCS("get_mask"));
+
+    ObjectTypeDB::bind_method(_MD("set_edge_falloff", "falloff"), &TerrainGenerator::set_edge_falloff);
+    ObjectTypeDB::bind_method(_MD("get_edge_falloff"), &TerrainGenerator::get_edge_falloff);
+    ADD_PROPERTY(PropertyInfo(Variant::REAL, "mask/edge_falloff", PROPERTY_HINT_RANGE, "0,0.5,0.01"), _SCS("set_edge_falloff"), _SCS("get_edge_falloff"));
+
+    ObjectTypeDB::bind_method(_MD("add_layer_rule", "layer", "min_height", "max_height", "min_slope", "max_slope", "blend"), &TerrainGenerator::add_layer_rule);
+    ObjectTypeDB::bind_method(_MD("clear_layer_rules"), &TerrainGenerator::clear_layer_rules);
+
+    ObjectTypeDB::bind_method(_MD("generate", "data:TerrainData"), &TerrainGenerator::generate);
+
+    BIND_CONSTANT(NOISE_FBM);
+    BIND_CONSTANT(NOISE_RIDGED);
+}
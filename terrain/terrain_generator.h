@@ -0,0 +1,117 @@
+#ifndef _TERRAIN_GENERATOR_H
+#define _TERRAIN_GENERATOR_H
+
+#include "reference.h"
+#include "image.h"
+#include "terrain_data.h"
+
+// procedural heights and splat layers written straight into TerrainData,
+// rows are generated in parallel and the result only depends on the seed
+class TerrainGenerator : public Reference {
+    OBJ_TYPE(TerrainGenerator, Reference)
+
+public:
+    enum NoiseType {
+        NOISE_FBM,
+        NOISE_RIDGED,
+    };
+
+    TerrainGenerator();
+
+    void set_seed(int seed);
+    int get_seed() const;
+
+    void set_noise_type(int type);
+    int get_noise_type() const;
+
+    void set_octaves(int octaves);
+    int get_octaves() const;
+
+    void set_frequency(float frequency);
+    float get_frequency() const;
+
+    void set_lacunarity(float lacunarity);
+    float get_lacunarity() const;
+
+    void set_gain(float gain);
+    float get_gain() const;
+
+    void set_height(float height);
+    float get_height() const;
+
+    void set_base_height(float height);
+    float get_base_height() const;
+
+    void set_warp_strength(float strength);
+    float get_warp_strength() const;
+
+    void set_warp_frequency(float frequency);
+    float get_warp_frequency() const;
+
+    void set_terrace_steps(int steps);
+    int get_terrace_steps() const;
+
+    void set_terrace_sharpness(float sharpness);
+    float get_terrace_sharpness() const;
+
+    void set_mask(const Image& mask);
+    Image get_mask() const;
+
+    void set_edge_falloff(float falloff);
+    float get_edge_falloff() const;
+
+    void add_layer_rule(int layer, float min_height, float max_height, float min_slope, float max_slope, float blend);
+    void clear_layer_rules();
+
+    void generate(const Ref<TerrainData>& data);
+
+private:
+    // splat layer chosen by height band and slope
+    struct LayerRule {
+        int layer;
+        float min_height;
+        float max_height;
+        float min_slope;
+        float max_slope;
+        float blend;
+    };
+
+    struct Job {
+        const TerrainGenerator* gen;
+        uint8_t* heights;
+        uint8_t* blends;
+        int size;
+    };
+
+    static void _heights_rows(void* userdata, int from, int to);
+    static void _blend_rows(void* userdata, int from, int to);
+
+    void _noise_row(const float* xs, const float* ys, float* out, int count, uint32_t seed, int octaves, bool ridged) const;
+    float _sample_mask(float u, float v) const;
+
+    int m_seed;
+    NoiseType m_noise_type;
+    int m_octaves;
+    float m_frequency; // noise periods across the whole map
+    float m_lacunarity;
+    float m_gain;
+    float m_height;
+    float m_base_height;
+    float m_warp_strength; // offset as a fraction of the map size
+    float m_warp_frequency;
+    int m_terrace_steps;
+    float m_terrace_sharpness;
+    Image m_mask;
+    float m_edge_falloff; // fraction of the map fading to base height at the borders
+
+    Vector<float> m_mask_values; // grayscale mask, converted once per generate()
+    int m_mask_w;
+    int m_mask_h;
+
+    Vector<LayerRule> m_rules;
+
+protected:
+    static void _bind_methods();
+};
+
+#endif
@@ -0,0 +1,471 @@
+#include "terrain_importer.h"
+#include "os/file_access.h"
+#include "os/os.h"
+
+#include "png.h"
+
+TerrainImporter::TerrainImporter()
+{
+    m_resample = true;
+    m_height_range = TERRAIN_MAX_HEIGHT; // lossless, 16 bit values are stored as they are
+    m_big_endian = false;
+
+    m_src_w = 0;
+    m_src_h = 0;
+    m_dst = 0;
+    m_src_y = 0;
+    m_dst_y = 0;
+    m_accum_count = 0;
+}
+
+void TerrainImporter::set_resample(bool enable)
+{
+    m_resample = enable;
+}
+
+bool TerrainImporter::get_resample() const
+{
+    return m_resample;
+}
+
+void TerrainImporter::set_height_range(float range)
+{
+    m_height_range = range;
+}
+
+float TerrainImporter::get_height_range() const
+{
+    return m_height_range;
+}
+
+void TerrainImporter::set_big_endian(bool enable)
+{
+    m_big_endian = enable;
+}
+
+bool TerrainImporter::get_big_endian() const
+{
+    return m_big_endian;
+}
+
+/* streaming */
+
+Error TerrainImporter::_begin(const Ref<TerrainData>& data, int width, int height)
+{
+    ERR_FAIL_COND_V(data.is_null(), ERR_INVALID_PARAMETER);
+    ERR_FAIL_COND_V(width < 2 || height < 2, ERR_INVALID_DATA);
+
+    if (!m_resample) {
+        // the map takes the size of the file, only the new map is allocated
+        ERR_EXPLAIN("Heightmap must be square to import without resampling");
+        ERR_FAIL_COND_V(width != height, ERR_INVALID_DATA);
+
+        data->set_size(width - 1);
+    }
+
+    ERR_FAIL_COND_V(data->get_size() <= 0, ERR_UNCONFIGURED);
+
+    m_data = data;
+    m_src_w = width;
+    m_src_h = height;
+    m_dst = data->get_size() + 1;
+    m_src_y = 0;
+    m_dst_y = 0;
+    m_accum_count = 0;
+
+    m_row.resize(m_dst);
+    m_prev_row.resize(m_dst);
+    m_accum.resize(m_dst);
+
+    for (int i = 0; i < m_dst; i++) {
+        m_accum[i] = 0;
+    }
+
+    // shrinking averages all source columns that land on a target column
+    m_col_map.clear();
+    m_col_weight.clear();
+
+    if (m_src_w > m_dst) {
+        m_col_map.resize(m_src_w);
+        m_col_weight.resize(m_dst);
+
+        for (int i = 0; i < m_dst; i++) {
+            m_col_weight[i] = 0;
+        }
+
+        for (int x = 0; x < m_src_w; x++) {
+            int tx = Math::fast_ftoi(x * (m_dst - 1) / (float)(m_src_w - 1));
+
+            m_col_map[x] = tx;
+            m_col_weight[tx] += 1.0f;
+        }
+
+        for (int i = 0; i < m_dst; i++) {
+            m_col_weight[i] = m_col_weight[i] > 0 ? 1.0f / m_col_weight[i] : 0;
+        }
+    }
+
+    m_heights = m_data->get_height_buffer().write();
+
+    return OK;
+}
+
+void TerrainImporter::_resample_row(const uint16_t* src, float* dst) const
+{
+    if (m_src_w == m_dst) {
+        for (int x = 0; x < m_dst; x++) {
+            dst[x] = src[x];
+        }
+    }
+    else if (m_src_w > m_dst) {
+        for (int x = 0; x < m_dst; x++) {
+            dst[x] = 0;
+        }
+
+        for (int x = 0; x < m_src_w; x++) {
+            dst[m_col_map[x]] += src[x];
+        }
+
+        for (int x = 0; x < m_dst; x++) {
+            dst[x] *= m_col_weight[x];
+        }
+    }
+    else {
+        float scale = (m_src_w - 1) / (float)(m_dst - 1);
+
+        for (int x = 0; x < m_dst; x++) {
+            float s = x * scale;
+            int i = MIN((int)s, m_src_w - 2);
+            float f = s - i;
+
+            dst[x] = src[i] + (src[i + 1] - src[i]) * f;
+        }
+    }
+}
+
+void TerrainImporter::_write_row(int y, const float* row)
+{
+    uint8_t* dst = m_heights.ptr() + y * m_dst * 2;
+    float scale = m_height_range / 65535.0f;
+
+    for (int x = 0; x < m_dst; x++) {
+        TerrainData::encode_height(dst + x * 2, row[x] * scale);
+    }
+}
+
+// takes source rows in order, emits target rows as soon as they are complete
+void TerrainImporter::_push_row(const uint16_t* src)
+{
+    int sy = m_src_y++;
+
+    _resample_row(src, &m_row[0]);
+
+    if (m_src_h == m_dst) {
+        _write_row(m_dst_y++, &m_row[0]);
+        return;
+    }
+
+    if (m_src_h > m_dst) {
+        // average all source rows that land on one target row
+        int ty = Math::fast_ftoi(sy * (m_dst - 1) / (float)(m_src_h - 1));
+
+        if (ty != m_dst_y && m_accum_count > 0) {
+            _end();
+        }
+
+        m_dst_y = ty;
+
+        for (int x = 0; x < m_dst; x++) {
+            m_accum[x] += m_row[x];
+        }
+
+        m_accum_count++;
+        return;
+    }
+
+    // growing interpolates between this and the previous source row
+    if (sy > 0) {
+        float scale = (m_dst - 1) / (float)(m_src_h - 1);
+
+        while (m_dst_y < m_dst && m_dst_y <= sy * scale + 0.0001f) {
+            float f = m_dst_y / scale - (sy - 1);
+
+            for (int x = 0; x < m_dst; x++) {
+                m_accum[x] = m_prev_row[x] + (m_row[x] - m_prev_row[x]) * f;
+            }
+
+            _write_row(m_dst_y++, &m_accum[0]);
+        }
+    }
+
+    copymem(&m_prev_row[0], &m_row[0], m_dst * sizeof(float));
+}
+
+// flushes the averaged row when shrinking
+void TerrainImporter::_end()
+{
+    if (m_accum_count == 0) {
+        return;
+    }
+
+    float inv = 1.0f / m_accum_count;
+
+    for (int x = 0; x < m_dst; x++) {
+        m_accum[x] *= inv;
+    }
+
+    _write_row(m_dst_y, &m_accum[0]);
+
+    for (int x = 0; x < m_dst; x++) {
+        m_accum[x] = 0;
+    }
+
+    m_accum_count = 0;
+}
+
+// a read that fails halfway leaves the rows written so far, so terrains,
+// the journal and deltas still hear about them
+void TerrainImporter::_abort()
+{
+    m_heights = DVector<uint8_t>::Write();
+
+    if (m_data.is_valid() && m_dst_y > 0) {
+        m_data->heights_changed(Rect2(0, 0, m_dst, MIN(m_dst_y, m_dst)));
+    }
+
+    m_data = Ref<TerrainData>();
+    m_file_row.clear();
+    m_src_row.clear();
+}
+
+/* formats */
+
+Error TerrainImporter::import_raw(const String& path, const Ref<TerrainData>& data, int width, int height)
+{
+    Error err;
+    FileAccess* f = FileAccess::open(path, FileAccess::READ, &err);
+    ERR_FAIL_COND_V(!f, err);
+
+    int texels = f->get_len() / 2;
+
+    if (width <= 0 || height <= 0) {
+        width = height = Math::fast_ftoi(Math::sqrt(texels));
+    }
+
+    if (width * height > texels) {
+        memdelete(f);
+        ERR_EXPLAIN("RAW heightmap is smaller than " + itos(width) + "x" + itos(height));
+        ERR_FAIL_V(ERR_FILE_CORRUPT);
+    }
+
+    err = _begin(data, width, height);
+
+    if (err != OK) {
+        memdelete(f);
+        return err;
+    }
+
+    uint32_t benchmark = OS::get_singleton()->get_ticks_msec();
+
+    m_file_row.resize(width * 2);
+    m_src_row.resize(width);
+
+    for (int y = 0; y < height; y++) {
+        if (f->get_buffer(&m_file_row[0], width * 2) != width * 2) {
+            memdelete(f);
+            _abort();
+
+            ERR_EXPLAIN("RAW heightmap ends after " + itos(y) + " rows: " + path);
+            ERR_FAIL_V(ERR_FILE_CORRUPT);
+        }
+
+        const uint8_t* b = &m_file_row[0];
+        uint16_t* r = &m_src_row[0];
+
+        if (m_big_endian) {
+            for (int x = 0; x < width; x++) {
+                r[x] = (b[x * 2] << 8) | b[x * 2 + 1];
+            }
+        }
+        else {
+            for (int x = 0; x < width; x++) {
+                r[x] = b[x * 2] | (b[x * 2 + 1] << 8);
+            }
+        }
+
+        _push_row(r);
+    }
+
+    memdelete(f);
+
+    _end();
+
+    m_heights = DVector<uint8_t>::Write();
+    m_data->heights_changed(Rect2(0, 0, m_dst, m_dst));
+    m_data = Ref<TerrainData>();
+    m_file_row.clear();
+    m_src_row.clear();
+
+    benchmark = OS::get_singleton()->get_ticks_msec() - benchmark;
+
+    if (OS::get_singleton()->is_stdout_verbose()) {
+        print_line("TerrainImporter::import_raw() benchmark:" + itos(benchmark));
+    }
+
+    return OK;
+}
+
+static void _png_read(png_structp png, png_bytep data, png_size_t length)
+{
+    FileAccess* f = (FileAccess*)png_get_io_ptr(png);
+
+    if (f->get_buffer(data, length) != (int)length) {
+        png_error(png, "unexpected end of file");
+    }
+}
+
+static void _png_error(png_structp png, png_const_charp message)
+{
+    ERR_PRINT(message);
+    longjmp(png_jmpbuf(png), 1);
+}
+
+static void _png_warning(png_structp png, png_const_charp message)
+{
+}
+
+Error TerrainImporter::import_png(const String& path, const Ref<TerrainData>& data)
+{
+    Error err;
+    FileAccess* f = FileAccess::open(path, FileAccess::READ, &err);
+    ERR_FAIL_COND_V(!f, err);
+
+    // row buffers are members, locals changed after setjmp() are lost on error
+    png_structp png = png_create_read_struct(PNG_LIBPNG_VER_STRING, NULL, _png_error, _png_warning);
+    png_infop info = png ? png_create_info_struct(png) : NULL;
+    uint32_t benchmark = OS::get_singleton()->get_ticks_msec();
+
+    if (!info) {
+        png_destroy_read_struct(&png, NULL, NULL);
+        memdelete(f);
+        ERR_FAIL_V(ERR_OUT_OF_MEMORY);
+    }
+
+    if (setjmp(png_jmpbuf(png))) {
+        png_destroy_read_struct(&png, &info, NULL);
+        memdelete(f);
+
+        _abort();
+
+        return ERR_FILE_CORRUPT;
+    }
+
+    png_set_read_fn(png, f, _png_read);
+    png_read_info(png, info);
+
+    png_uint_32 width, height;
+    int depth, color, interlace;
+
+    png_get_IHDR(png, info, &width, &height, &depth, &color, &interlace, NULL, NULL);
+
+    if (interlace != PNG_INTERLACE_NONE) {
+        // interlaced images can't be read one row at a time
+        png_error(png, "interlaced heightmaps are not supported");
+    }
+
+    if (color == PNG_COLOR_TYPE_PALETTE) {
+        png_set_palette_to_rgb(png);
+    }
+
+    if (color == PNG_COLOR_TYPE_GRAY && depth < 8) {
+        png_set_expand_gray_1_2_4_to_8(png);
+    }
+
+    if ((color & PNG_COLOR_MASK_COLOR) || color == PNG_COLOR_TYPE_PALETTE) {
+        png_set_rgb_to_gray_fixed(png, 1, -1, -1);
+    }
+
+    if ((color & PNG_COLOR_MASK_ALPHA) || png_get_valid(png, info, PNG_INFO_tRNS)) {
+        png_set_strip_alpha(png);
+    }
+
+    png_read_update_info(png, info);
+
+    depth = png_get_bit_depth(png, info);
+    m_file_row.resize(png_get_rowbytes(png, info));
+    m_src_row.resize(width);
+
+    if (_begin(data, width, height) != OK) {
+        png_error(png, "can't import into this terrain");
+    }
+
+    for (uint32_t y = 0; y < height; y++) {
+        png_read_row(png, &m_file_row[0], NULL);
+
+        const uint8_t* b = &m_file_row[0];
+        uint16_t* r = &m_src_row[0];
+
+        if (depth == 16) {
+            for (uint32_t x = 0; x < width; x++) {
+                r[x] = (b[x * 2] << 8) | b[x * 2 + 1];
+            }
+        }
+        else {
+            for (uint32_t x = 0; x < width; x++) {
+                r[x] = b[x] * 257;
+            }
+        }
+
+        _push_row(r);
+    }
+
+    png_read_end(png, NULL);
+    png_destroy_read_struct(&png, &info, NULL);
+    memdelete(f);
+
+    _end();
+
+    m_heights = DVector<uint8_t>::Write();
+    m_data->heights_changed(Rect2(0, 0, m_dst, m_dst));
+    m_data = Ref<TerrainData>();
+    m_file_row.clear();
+    m_src_row.clear();
+
+    benchmark = OS::get_singleton()->get_ticks_msec() - benchmark;
+
+    if (OS::get_singleton()->is_stdout_verbose()) {
+        print_line("TerrainImporter::import_png() benchmark:" + itos(benchmark));
+    }
+
+    return OK;
+}
+
+Error TerrainImporter::import_file(const String& path, const Ref<TerrainData>& data)
+{
+    String ext = path.extension().to_lower();
+
+    if (ext == "png") {
+        return import_png(path, data);
+    }
+
+    return import_raw(path, data);
+}
+
+void TerrainImporter::_bind_methods()
+{
+    ObjectTypeDB::bind_method(_MD("set_resample", "enable"), &TerrainImporter::set_resample);
+    ObjectTypeDB::bind_method(_MD("get_resample"), &TerrainImporter::get_resample);
+    ADD_PROPERTY(PropertyInfo(Variant::BOOL, "resample"), _SCS("set_resample"), _SCS("get_resample"));
+
+    ObjectTypeDB::bind_method(_MD("set_height_range", "range"), &TerrainImporter::set_height_range);
+    ObjectTypeDB::bind_method(_MD("get_height_range"), &TerrainImporter::get_height_range);
+    ADD_PROPERTY(PropertyInfo(Variant::REAL, "height_range"), _SCS("set_height_range"), _SCS("get_height_range"));
+
+    ObjectTypeDB::bind_method(_MD("set_big_endian", "enable"), &TerrainImporter::set_big_endian);
+    ObjectTypeDB::bind_method(_MD("get_big_endian"), &TerrainImporter::get_big_endian);
+    ADD_PROPERTY(PropertyInfo(Variant::BOOL, "big_endian"), _SCS("set_big_endian"), _SCS("get_big_endian"));
+
+    ObjectTypeDB::bind_method(_MD("import_raw", "path", "data:TerrainData", "width", "height"), &TerrainImporter::import_raw, DEFVAL(0), DEFVAL(0));
+    ObjectTypeDB::bind_method(_MD("import_png", "path", "data:TerrainData"), &TerrainImporter::import_png);
+    ObjectTypeDB::bind_method(_MD("import_file", "path", "data:TerrainData"), &TerrainImporter::import_file);
+}
@@ -0,0 +1,67 @@
+#ifndef _TERRAIN_IMPORTER_H
+#define _TERRAIN_IMPORTER_H
+
+#include "reference.h"
+#include "terrain_data.h"
+
+// streams 16 bit RAW and PNG heightmaps row by row into TerrainData, only a
+// few rows of the source are ever held in memory
+class TerrainImporter : public Reference {
+    OBJ_TYPE(TerrainImporter, Reference)
+
+public:
+    TerrainImporter();
+
+    // resample to the current (size + 1)^2 of the data instead of resizing it
+    void set_resample(bool enable);
+    bool get_resample() const;
+
+    // height the largest 16 bit value maps to
+    void set_height_range(float range);
+    float get_height_range() const;
+
+    void set_big_endian(bool enable);
+    bool get_big_endian() const;
+
+    // width/height of 0 assume a square file
+    Error import_raw(const String& path, const Ref<TerrainData>& data, int width = 0, int height = 0);
+    Error import_png(const String& path, const Ref<TerrainData>& data);
+    Error import_file(const String& path, const Ref<TerrainData>& data);
+
+private:
+    Error _begin(const Ref<TerrainData>& data, int width, int height);
+    void _push_row(const uint16_t* row);
+    void _end();
+    void _abort();
+
+    void _resample_row(const uint16_t* src, float* dst) const;
+    void _write_row(int y, const float* row);
+
+    bool m_resample;
+    float m_height_range;
+    bool m_big_endian;
+
+    /* streaming state */
+
+    Ref<TerrainData> m_data;
+    DVector<uint8_t>::Write m_heights;
+    int m_src_w;
+    int m_src_h;
+    int m_dst; // target texels per side
+    int m_src_y; // next source row
+    int m_dst_y; // next target row
+
+    Vector<int> m_col_map; // target column of each source column when shrinking
+    Vector<float> m_col_weight; // 1 / source columns per target column
+    Vector<uint8_t> m_file_row; // source row as read from the file
+    Vector<uint16_t> m_src_row;
+    Vector<float> m_row; // current source row at target width
+    Vector<float> m_prev_row;
+    Vector<float> m_accum; // rows averaged into the current target row
+    int m_accum_count;
+
+protected:
+    static void _bind_methods();
+};
+
+#endif
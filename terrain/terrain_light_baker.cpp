@@ -0,0 +1,398 @@
+#include "terrain_light_baker.h"
+#include "terrain_threads.h"
+#include "os/os.h"
+
+#define AO_BIAS 0.01 // keeps flat ground from occluding itself through quantization
+
+TerrainLightBaker::TerrainLightBaker()
+{
+    m_ao_directions = 8;
+    m_ao_distance = 32.0;
+    m_ao_strength = 1.0;
+    m_sun_direction = Vector3(0.5, -0.6, 0.4).normalized();
+    m_shadow_distance = 256.0;
+    m_shadow_softness = 0.05;
+    m_shadow_strength = 0.7;
+    m_tile_size = 64;
+}
+
+void TerrainLightBaker::set_ao_directions(int directions)
+{
+    m_ao_directions = CLAMP(directions, 1, (int)MAX_AO_DIRECTIONS);
+}
+
+int TerrainLightBaker::get_ao_directions() const
+{
+    return m_ao_directions;
+}
+
+void TerrainLightBaker::set_ao_distance(float distance)
+{
+    m_ao_distance = MAX(distance, 1.0f);
+}
+
+float TerrainLightBaker::get_ao_distance() const
+{
+    return m_ao_distance;
+}
+
+void TerrainLightBaker::set_ao_strength(float strength)
+{
+    m_ao_strength = CLAMP(strength, 0.0f, 1.0f);
+}
+
+float TerrainLightBaker::get_ao_strength() const
+{
+    return m_ao_strength;
+}
+
+void TerrainLightBaker::set_sun_direction(const Vector3& direction)
+{
+    ERR_FAIL_COND(direction.length_squared() == 0);
+
+    m_sun_direction = direction.normalized();
+}
+
+Vector3 TerrainLightBaker::get_sun_direction() const
+{
+    return m_sun_direction;
+}
+
+void TerrainLightBaker::set_shadow_distance(float distance)
+{
+    m_shadow_distance = MAX(distance, 0.0f);
+}
+
+float TerrainLightBaker::get_shadow_distance() const
+{
+    return m_shadow_distance;
+}
+
+void TerrainLightBaker::set_shadow_softness(float softness)
+{
+    m_shadow_softness = MAX(softness, 0.001f);
+}
+
+float TerrainLightBaker::get_shadow_softness() const
+{
+    return m_shadow_softness;
+}
+
+void TerrainLightBaker::set_shadow_strength(float strength)
+{
+    m_shadow_strength = CLAMP(strength, 0.0f, 1.0f);
+}
+
+float TerrainLightBaker::get_shadow_strength() const
+{
+    return m_shadow_strength;
+}
+
+void TerrainLightBaker::set_tile_size(int size)
+{
+    m_tile_size = CLAMP(size, 8, 1024);
+}
+
+int TerrainLightBaker::get_tile_size() const
+{
+    return m_tile_size;
+}
+
+// occlusion reaches ao_distance around an edit, shadows are only cast away
+// from the sun
+Rect2 TerrainLightBaker::get_affected_region(const Rect2& region) const
+{
+    float ao = Math::ceil(m_ao_distance) + 1;
+
+    Rect2 r = region.grow(ao);
+
+    float sx = m_sun_direction.x;
+    float sy = m_sun_direction.z;
+    float len = Math::sqrt(sx * sx + sy * sy);
+
+    if (len > 0) {
+        float dx = sx / len * m_shadow_distance;
+        float dy = sy / len * m_shadow_distance;
+
+        r = r.merge(Rect2(region.pos.x + dx, region.pos.y + dy, region.size.x, region.size.y).grow(1));
+    }
+
+    return r;
+}
+
+/* bake */
+
+void TerrainLightBaker::_decode_rows(void* userdata, int from, int to)
+{
+    Job& job = *(Job*)userdata;
+
+    for (int y = from; y < to; y++) {
+        const uint8_t* src = &job.src[((job.src_y + y) * job.stride + job.src_x) * 2];
+        float* dst = &job.heights[y * job.src_w];
+
+        for (int x = 0; x < job.src_w; x++) {
+            dst[x] = TerrainData::decode_height(src + x * 2);
+        }
+    }
+}
+
+// bilinear, positions are clamped to the decoded window
+float TerrainLightBaker::_sample(const Job& job, float x, float y)
+{
+    x = CLAMP(x - job.src_x, 0.0f, job.src_w - 1.001f);
+    y = CLAMP(y - job.src_y, 0.0f, job.src_h - 1.001f);
+
+    int ix = x;
+    int iy = y;
+    float fx = x - ix;
+    float fy = y - iy;
+
+    const float* row = &job.heights[iy * job.src_w + ix];
+    float h0 = row[0] + (row[1] - row[0]) * fx;
+    float h1 = row[job.src_w] + (row[job.src_w + 1] - row[job.src_w]) * fx;
+
+    return h0 + (h1 - h0) * fy;
+}
+
+void TerrainLightBaker::_bake_tiles(void* userdata, int from, int to)
+{
+    Job& job = *(Job*)userdata;
+    const TerrainLightBaker* baker = job.baker;
+    int tile_size = baker->m_tile_size;
+
+    for (int t = from; t < to; t++) {
+        int ty = t / job.tiles_x;
+        int tx = t - ty * job.tiles_x;
+
+        int x1 = job.region_x + tx * tile_size;
+        int y1 = job.region_y + ty * tile_size;
+        int x2 = MIN(x1 + tile_size, job.region_x + job.region_w);
+        int y2 = MIN(y1 + tile_size, job.region_y + job.region_h);
+
+        for (int y = y1; y < y2; y++) {
+            for (int x = x1; x < x2; x++) {
+                float h = job.heights[(y - job.src_y) * job.src_w + (x - job.src_x)] + AO_BIAS;
+
+                /* ambient occlusion */
+
+                float occlusion = 0;
+
+                for (int d = 0; d < job.ao_count; d++) {
+                    float dx = job.ao_dirs[d][0];
+                    float dy = job.ao_dirs[d][1];
+                    float horizon = 0;
+
+                    // steps grow with distance, far samples matter less
+                    for (float s = 1; s <= baker->m_ao_distance; s += MAX(1.0f, s * 0.25f)) {
+                        float slope = (_sample(job, x + dx * s, y + dy * s) - h) / s;
+                        horizon = MAX(horizon, slope);
+                    }
+
+                    // sine of the horizon angle
+                    occlusion += horizon / Math::sqrt(1 + horizon * horizon);
+                }
+
+                float ao = 1.0f - baker->m_ao_strength * occlusion / job.ao_count;
+
+                /* sun visibility */
+
+                float visibility = 0;
+
+                if (job.sun_up) {
+                    float horizon = 0;
+                    float sun_slope = Math::tan(job.sun_angle + baker->m_shadow_softness);
+                    float lit_slope = Math::tan(MAX(job.sun_angle - baker->m_shadow_softness, 0.0f));
+
+                    for (float s = 1; s <= baker->m_shadow_distance; s += MAX(1.0f, s * 0.1f)) {
+                        // nothing further out can rise into the penumbra
+                        if ((job.max_height - h) / s < MAX(horizon, lit_slope)) {
+                            break;
+                        }
+
+                        float slope = (_sample(job, x + job.sun_dir[0] * s, y + job.sun_dir[1] * s) - h) / s;
+                        horizon = MAX(horizon, slope);
+
+                        if (horizon >= sun_slope) {
+                            break;
+                        }
+                    }
+
+                    float angle = Math::atan(horizon);
+                    visibility = CLAMP((job.sun_angle - angle) / (baker->m_shadow_softness * 2.0f) + 0.5f, 0.0f, 1.0f);
+                }
+
+                float shadow = 1.0f - baker->m_shadow_strength * (1.0f - visibility);
+
+                uint8_t* texel = &job.lighting[(y * job.stride + x) * 2];
+                texel[0] = CLAMP(ao, 0.0f, 1.0f) * 255.0f;
+                texel[1] = CLAMP(shadow, 0.0f, 1.0f) * 255.0f;
+            }
+        }
+    }
+}
+
+void TerrainLightBaker::bake(const Ref<TerrainData>& data)
+{
+    ERR_FAIL_COND(data.is_null());
+
+    bake_region(data, Rect2(0, 0, data->get_size() + 1, data->get_size() + 1));
+}
+
+// rebakes the texels inside region, callers pass get_affected_region() of
+// whatever heights changed
+void TerrainLightBaker::bake_region(const Ref<TerrainData>& data, const Rect2& region)
+{
+    ERR_FAIL_COND(data.is_null());
+
+    Rect2 r = _bake(data, region);
+
+    if (r.has_no_area()) {
+        return;
+    }
+
+    data->lighting_changed(r);
+}
+
+void TerrainLightBaker::bake_regions(const Ref<TerrainData>& data, const Vector<Rect2>& regions)
+{
+    ERR_FAIL_COND(data.is_null());
+
+    Vector<Rect2> baked;
+
+    for (int i = 0; i < regions.size(); i++) {
+        Rect2 r = _bake(data, regions[i]);
+
+        if (!r.has_no_area()) {
+            baked.push_back(r);
+        }
+    }
+
+    if (baked.empty()) {
+        return;
+    }
+
+    data->lighting_changed_regions(baked);
+}
+
+// bakes into the lighting buffer without telling anyone, returns the
+// texels written
+Rect2 TerrainLightBaker::_bake(const Ref<TerrainData>& data, const Rect2& region)
+{
+    int stride = data->get_size() + 1;
+    Rect2 r = region.clip(Rect2(0, 0, stride, stride));
+
+    if (stride < 2 || r.size.x < 1 || r.size.y < 1) {
+        return Rect2();
+    }
+
+    uint32_t benchmark = OS::get_singleton()->get_ticks_msec();
+
+    Job job;
+    job.baker = this;
+    job.stride = stride;
+    job.region_x = r.pos.x;
+    job.region_y = r.pos.y;
+    job.region_w = r.size.x;
+    job.region_h = r.size.y;
+    job.tiles_x = (job.region_w + m_tile_size - 1) / m_tile_size;
+    job.tiles_y = (job.region_h + m_tile_size - 1) / m_tile_size;
+
+    job.ao_count = m_ao_directions;
+
+    for (int d = 0; d < job.ao_count; d++) {
+        float a = Math_PI * 2.0 * (d + 0.5) / job.ao_count;
+        job.ao_dirs[d][0] = Math::cos(a);
+        job.ao_dirs[d][1] = Math::sin(a);
+    }
+
+    float sx = -m_sun_direction.x;
+    float sy = -m_sun_direction.z;
+    float len = Math::sqrt(sx * sx + sy * sy);
+
+    job.sun_up = m_sun_direction.y < 0;
+    job.sun_angle = Math::atan2(-m_sun_direction.y, len);
+    job.sun_dir[0] = len > 0 ? sx / len : 0;
+    job.sun_dir[1] = len > 0 ? sy / len : 0;
+
+    /* decode every height a ray can reach */
+
+    int reach = Math::ceil(MAX(m_ao_distance, m_shadow_distance)) + 1;
+    Rect2 src = r.grow(reach).clip(Rect2(0, 0, stride, stride));
+
+    job.src_x = src.pos.x;
+    job.src_y = src.pos.y;
+    job.src_w = src.size.x;
+    job.src_h = src.size.y;
+
+    Vector<float> heights;
+    heights.resize(job.src_w * job.src_h);
+    job.heights = &heights[0];
+
+    DVector<uint8_t>::Read hr = data->get_height_buffer().read();
+    job.src = hr.ptr();
+
+    TerrainThreads::run(_decode_rows, &job, job.src_h, 16);
+
+    job.max_height = 0;
+
+    for (int i = 0; i < heights.size(); i++) {
+        job.max_height = MAX(job.max_height, heights[i]);
+    }
+
+    /* bake */
+
+    DVector<uint8_t>::Write w = data->get_lighting_buffer().write();
+    job.lighting = w.ptr();
+
+    TerrainThreads::run(_bake_tiles, &job, job.tiles_x * job.tiles_y);
+
+    w = DVector<uint8_t>::Write();
+    hr = DVector<uint8_t>::Read();
+
+    benchmark = OS::get_singleton()->get_ticks_msec() - benchmark;
+
+    if (OS::get_singleton()->is_stdout_verbose()) {
+        print_line("TerrainLightBaker::bake_region() benchmark:" + itos(benchmark));
+    }
+
+    return r;
+}
+
+void TerrainLightBaker::_bind_methods()
+{
+    ObjectTypeDB::bind_method(_MD("set_ao_directions", "directions"), &TerrainLightBaker::set_ao_directions);
+    ObjectTypeDB::bind_method(_MD("get_ao_directions"), &TerrainLightBaker::get_ao_directions);
+    ADD_PROPERTY(PropertyInfo(Variant::INT, "ao/directions", PROPERTY_HINT_RANGE, "1," + itos(MAX_AO_DIRECTIONS) + ",1"), _SCS("set_ao_directions"), _SCS("get_ao_directions"));
+
+    ObjectTypeDB::bind_method(_MD("set_ao_distance", "distance"), &TerrainLightBaker::set_ao_distance);
+    ObjectTypeDB::bind_method(_MD("get_ao_distance"), &TerrainLightBaker::get_ao_distance);
+    ADD_PROPERTY(PropertyInfo(Variant::REAL, "ao/distance"), _SCS("set_ao_distance"), _SCS("get_ao_distance"));
+
+    ObjectTypeDB::bind_method(_MD("set_ao_strength", "strength"), &TerrainLightBaker::set_ao_strength);
+    ObjectTypeDB::bind_method(_MD("get_ao_strength"), &TerrainLightBaker::get_ao_strength);
+    ADD_PROPERTY(PropertyInfo(Variant::REAL, "ao/strength", PROPERTY_HINT_RANGE, "0,1,0.01"), _SCS("set_ao_strength"), _SCS("get_ao_strength"));
+
+    ObjectTypeDB::bind_method(_MD("set_sun_direction", "direction"), &TerrainLightBaker::set_sun_direction);
+    ObjectTypeDB::bind_method(_MD("get_sun_direction"), &TerrainLightBaker::get_sun_direction);
+    ADD_PROPERTY(PropertyInfo(Variant::VECTOR3, "shadow/sun_direction"), _SCS("set_sun_direction"), _SCS("get_sun_direction"));
+
+    ObjectTypeDB::bind_method(_MD("set_shadow_distance", "distance"), &TerrainLightBaker::set_shadow_distance);
+    ObjectTypeDB::bind_method(_MD("get_shadow_distance"), &TerrainLightBaker::get_shadow_distance);
+    ADD_PROPERTY(PropertyInfo(Variant::REAL, "shadow/distance"), _SCS("set_shadow_distance"), _SCS("get_shadow_distance"));
+
+    ObjectTypeDB::bind_method(_MD("set_shadow_softness", "softness"), &TerrainLightBaker::set_shadow_softness);
+    ObjectTypeDB::bind_method(_MD("get_shadow_softness"), &TerrainLightBaker::get_shadow_softness);
+    ADD_PROPERTY(PropertyInfo(Variant::REAL, "shadow/softness", PROPERTY_HINT_RANGE, "0.001,0.5,0.001"), _SCS("set_shadow_softness"), _SCS("get_shadow_softness"));
+
+    ObjectTypeDB::bind_method(_MD("set_shadow_strength", "strength"), &TerrainLightBaker::set_shadow_strength);
+    ObjectTypeDB::bind_method(_MD("get_shadow_strength"), &TerrainLightBaker::get_shadow_strength);
+    ADD_PROPERTY(PropertyInfo(Variant::REAL, "shadow/strength", PROPERTY_HINT_RANGE, "0,1,0.01"), _SCS("set_shadow_strength"), _SCS("get_shadow_strength"));
+
+    ObjectTypeDB::bind_method(_MD("set_tile_size", "size"), &TerrainLightBaker::set_tile_size);
+    ObjectTypeDB::bind_method(_MD("get_tile_size"), &TerrainLightBaker::get_tile_size);
+    ADD_PROPERTY(PropertyInfo(Variant::INT, "tile_size", PROPERTY_HINT_RANGE, "8,1024,8"), _SCS("set_tile_size"), _SCS("get_tile_size"));
+
+    ObjectTypeDB::bind_method(_MD("get_affected_region", "region"), &TerrainLightBaker::get_affected_region);
+    ObjectTypeDB::bind_method(_MD("bake", "data:TerrainData"), &TerrainLightBaker::bake);
+    ObjectTypeDB::bind_method(_MD("bake_region", "data:TerrainData", "region"), &TerrainLightBaker::bake_region);
+}
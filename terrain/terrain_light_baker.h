@@ -0,0 +1,105 @@
+#ifndef _TERRAIN_LIGHT_BAKER_H
+#define _TERRAIN_LIGHT_BAKER_H
+
+#include "reference.h"
+#include "terrain_data.h"
+
+// bakes heightfield ambient occlusion and sun visibility into the lighting
+// layer of TerrainData. Every texel marches the heights for the highest
+// horizon in a few directions, tiles of the region run in parallel
+class TerrainLightBaker : public Reference {
+    OBJ_TYPE(TerrainLightBaker, Reference)
+
+public:
+    enum {
+        MAX_AO_DIRECTIONS = 32,
+    };
+
+    TerrainLightBaker();
+
+    void set_ao_directions(int directions);
+    int get_ao_directions() const;
+
+    // in texels
+    void set_ao_distance(float distance);
+    float get_ao_distance() const;
+
+    void set_ao_strength(float strength);
+    float get_ao_strength() const;
+
+    // direction the light travels in, terrain space
+    void set_sun_direction(const Vector3& direction);
+    Vector3 get_sun_direction() const;
+
+    void set_shadow_distance(float distance);
+    float get_shadow_distance() const;
+
+    // angular size of the penumbra in radians
+    void set_shadow_softness(float softness);
+    float get_shadow_softness() const;
+
+    void set_shadow_strength(float strength);
+    float get_shadow_strength() const;
+
+    void set_tile_size(int size);
+    int get_tile_size() const;
+
+    // texels whose lighting depends on the heights inside region
+    Rect2 get_affected_region(const Rect2& region) const;
+
+    void bake(const Ref<TerrainData>& data);
+    void bake_region(const Ref<TerrainData>& data, const Rect2& region);
+
+    // bakes scattered regions with a single lighting upload
+    void bake_regions(const Ref<TerrainData>& data, const Vector<Rect2>& regions);
+
+private:
+    struct Job {
+        const TerrainLightBaker* baker;
+
+        // decoded heights of the region plus everything the rays can reach
+        const uint8_t* src;
+        float* heights;
+        int src_x;
+        int src_y;
+        int src_w;
+        int src_h;
+        float max_height;
+
+        int region_x;
+        int region_y;
+        int region_w;
+        int region_h;
+        int tiles_x;
+        int tiles_y;
+        int stride;
+        uint8_t* lighting;
+
+        int ao_count;
+        float ao_dirs[MAX_AO_DIRECTIONS][2];
+        float sun_dir[2]; // towards the sun
+        float sun_angle;
+        bool sun_up;
+    };
+
+    static void _decode_rows(void* userdata, int from, int to);
+    static void _bake_tiles(void* userdata, int from, int to);
+
+    Rect2 _bake(const Ref<TerrainData>& data, const Rect2& region);
+
+    static float _sample(const Job& job, float x, float y);
+
+    int m_ao_directions;
+    float m_ao_distance;
+    float m_ao_strength;
+    Vector3 m_sun_direction;
+    float m_shadow_distance;
+    float m_shadow_softness;
+    float m_shadow_strength;
+    int m_tile_size;
+
+protected:
+    static void _bind_methods();
+};
+
+#endif
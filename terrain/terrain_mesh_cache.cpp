@@ -0,0 +1,144 @@
+#include "terrain_mesh_cache.h"
+#include "os/file_access.h"
+#include "os/dir_access.h"
+#include "servers/visual_server.h"
+
+#define CACHE_MAGIC "TMC1"
+
+// fnv-1a, 64 bits keeps collisions out of the picture for a map's worth of regions
+static inline uint64_t _hash_bytes(const uint8_t* data, int len, uint64_t hash)
+{
+    for (int i = 0; i < len; i++) {
+        hash ^= data[i];
+        hash *= 1099511628211ULL;
+    }
+
+    return hash;
+}
+
+// hashes the heights of a region plus border texels around it (normals read those)
+uint64_t TerrainMeshCache::hash_region(const Ref<TerrainData>& data, int x, int y, int w, int h, int border, uint64_t params)
+{
+    int stride = data->get_size() + 1;
+
+    int x1 = MAX(x - border, 0);
+    int y1 = MAX(y - border, 0);
+    int x2 = MIN(x + w + border, stride - 1);
+    int y2 = MIN(y + h + border, stride - 1);
+
+    uint64_t hash = 14695981039346656037ULL;
+    hash = _hash_bytes((const uint8_t*)&params, sizeof(params), hash);
+
+    DVector<uint8_t>::Read r = data->get_height_buffer().read();
+
+    for (int j = y1; j <= y2; j++) {
+        hash = _hash_bytes(&r[(j * stride + x1) * 2], (x2 - x1 + 1) * 2, hash);
+    }
+
+    return hash;
+}
+
+String TerrainMeshCache::get_file(const String& dir, int x, int y, int w, int h, int step)
+{
+    return dir.plus_file(itos(x) + "_" + itos(y) + "_" + itos(w) + "x" + itos(h) + "_" + itos(step) + ".tmesh");
+}
+
+template <class T>
+static bool _read_array(FileAccess* f, DVector<T>& array)
+{
+    uint32_t count = f->get_32();
+
+    if (count > f->get_len() / sizeof(T)) {
+        return false;
+    }
+
+    array.resize(count);
+
+    if (count == 0) {
+        return true;
+    }
+
+    typename DVector<T>::Write w = array.write();
+    int len = count * sizeof(T);
+
+    return f->get_buffer((uint8_t*)w.ptr(), len) == len;
+}
+
+template <class T>
+static void _write_array(FileAccess* f, const DVector<T>& array)
+{
+    f->store_32(array.size());
+
+    if (array.size() == 0) {
+        return;
+    }
+
+    typename DVector<T>::Read r = array.read();
+    f->store_buffer((const uint8_t*)r.ptr(), array.size() * sizeof(T));
+}
+
+bool TerrainMeshCache::load(const String& file, uint64_t hash, Array& arrays)
+{
+    FileAccess* f = FileAccess::open(file, FileAccess::READ);
+
+    if (!f) {
+        return false;
+    }
+
+    uint8_t magic[4];
+    f->get_buffer(magic, 4);
+
+    if (magic[0] != CACHE_MAGIC[0] || magic[1] != CACHE_MAGIC[1] || magic[2] != CACHE_MAGIC[2] || magic[3] != CACHE_MAGIC[3] || f->get_64() != hash) {
+        memdelete(f);
+        return false;
+    }
+
+    DVector<Vector3> points;
+    DVector<Vector3> normals;
+    DVector<Vector2> uvs;
+    DVector<Vector2> uv2s;
+    DVector<int> indices;
+
+    bool ok = _read_array(f, points) && _read_array(f, normals) && _read_array(f, uvs) && _read_array(f, uv2s) && _read_array(f, indices);
+
+    memdelete(f);
+
+    if (!ok) {
+        return false;
+    }
+
+    arrays.resize(VS::ARRAY_MAX);
+    arrays[VS::ARRAY_VERTEX] = points;
+    arrays[VS::ARRAY_NORMAL] = normals;
+    arrays[VS::ARRAY_TEX_UV] = uvs;
+    arrays[VS::ARRAY_TEX_UV2] = uv2s;
+    arrays[VS::ARRAY_INDEX] = indices;
+
+    return true;
+}
+
+void TerrainMeshCache::store(const String& file, uint64_t hash, const Array& arrays)
+{
+    FileAccess* f = FileAccess::open(file, FileAccess::WRITE);
+
+    if (!f) {
+        // first write, the folder may not exist yet
+        DirAccess* da = DirAccess::create_for_path(file.get_base_dir());
+        da->make_dir_recursive(file.get_base_dir());
+        memdelete(da);
+
+        f = FileAccess::open(file, FileAccess::WRITE);
+        ERR_FAIL_COND(!f);
+    }
+
+    f->store_buffer((const uint8_t*)CACHE_MAGIC, 4);
+    f->store_64(hash);
+
+    _write_array<Vector3>(f, arrays[VS::ARRAY_VERTEX]);
+    _write_array<Vector3>(f, arrays[VS::ARRAY_NORMAL]);
+    _write_array<Vector2>(f, arrays[VS::ARRAY_TEX_UV]);
+    _write_array<Vector2>(f, arrays[VS::ARRAY_TEX_UV2]);
+    _write_array<int>(f, arrays[VS::ARRAY_INDEX]);
+
+    memdelete(f);
+}
@@ -0,0 +1,21 @@
+#ifndef _TERRAIN_MESH_CACHE_H
+#define _TERRAIN_MESH_CACHE_H
+
+#include "ustring.h"
+#include "array.h"
+#include "terrain_data.h"
+
+// baked mesh arrays on disk, one file per map region. Files remember the hash
+// of the heights they were built from and are ignored once it no longer
+// matches. The data is raw and meant for the machine that wrote it.
+class TerrainMeshCache {
+public:
+    static uint64_t hash_region(const Ref<TerrainData>& data, int x, int y, int w, int h, int border, uint64_t params);
+
+    static String get_file(const String& dir, int x, int y, int w, int h, int step);
+
+    static bool load(const String& file, uint64_t hash, Array& arrays);
+    static void store(const String& file, uint64_t hash, const Array& arrays);
+};
+
+#endif
@@ -2,56 +2,132 @@
 
 #include "servers/visual_server.h"
 #include "servers/physics_server.h"
+#include "scene/main/viewport.h"
+#include "scene/3d/camera.h"
+#include "terrain_mesh_cache.h"
 
-static const char* frag_shader = "uniform texture blendmap;"
-                                 "uniform texture texture0;"
-                                 "uniform texture texture1;"
-                                 "uniform texture texture2;"
-                                 "uniform texture texture3;"
-                                 "uniform texture texture4;"
-                                 "uniform float s;"
-                                 "vec2 coord = s * UV;"
-                                 "vec3 sample0 = tex(texture0, coord).rgb;"
-                                 "vec3 sample1 = tex(texture1, coord).rgb;"
-                                 "vec3 sample2 = tex(texture2, coord).rgb;"
-                                 "vec3 sample3 = tex(texture3, coord).rgb;"
-                                 "vec3 sample4 = tex(texture4, coord).rgb;"
-                                 "vec4 blend = tex(blendmap, UV).rgba;"
-                                 "vec3 c = sample0;"
-                                 "c = mix(c, sample1, blend.r);"
-                                 "c = mix(c, sample2, blend.g);"
-                                 "c = mix(c, sample3, blend.b);"
-                                 "c = mix(c, sample4, blend.a);"
-                                 "DIFFUSE = c;";
+#define EDIT_HOLD_MSEC 5000
+#define DETAIL_BUILDS_PER_FRAME 4 // chunks scattering details in one frame
+#define LIGHTING_REBAKE_MSEC 300 // edits settle this long before lighting is rebaked
+#define MEMORY_CHECK_MSEC 500
+#define RESIZE_BUILDS_PER_FRAME 8 // meshes rebuilt per frame after the map was resized
+#define BLEND_PIN_MSEC 2000 // blends stay pinned this long after pieces or details last read them
 
 static const char* vert_shader = "";
 
+// fragment code drawing 'layers' splat layers, layer0 takes whatever
+// weight the blendmap channels leave. Baked ambient occlusion and sun
+// visibility are multiplied in when 'lit' is set
+static String _make_frag_shader(int layers)
+{
+    static const char* channels[] = { "", "r", "g", "b" };
+
+    String code = "uniform float s;";
+
+    code += "uniform texture lighting;";
+    code += "uniform float lit;";
+    code += "uniform float lsize;";
+
+    for (int i = 0; i < layers; i++) {
+        code += "uniform texture layer" + itos(i) + ";";
+    }
+
+    if (layers > 1) {
+        code += "uniform texture blendmap;";
+    }
+
+    code += "vec2 coord = s * UV;";
+
+    // lighting texels sit on the height samples
+    code += "vec2 luv = (UV * (lsize - 1.0) + vec2(0.5, 0.5)) / (lsize + 1.0);";
+    code += "vec4 l = tex(lighting, luv);";
+    code += "float light = mix(1.0, l.r * l.a, lit);";
+
+    if (layers == 1) {
+        code += "DIFFUSE = tex(layer0, coord).rgb * light;";
+        return code;
+    }
+
+    code += "vec3 blend = tex(blendmap, UV2).rgb;";
+    code += "float w0 = 1.0";
+
+    for (int i = 1; i < layers; i++) {
+        code += String(" - blend.") + channels[i];
+    }
+
+    code += ";";
+    code += "vec3 c = tex(layer0, coord).rgb * max(w0, 0.0);";
+
+    for (int i = 1; i < layers; i++) {
+        code += "c += tex(layer" + itos(i) + ", coord).rgb * blend." + channels[i] + ";";
+    }
+
+    code += "DIFFUSE = c * light;";
+
+    return code;
+}
+
 TerrainNode::TerrainNode()
 {
     m_scale = 1.0;
     m_chunk_size = 16;
     m_uv_scale = 10.0;
     m_chunk_count = 0;
+    m_lod_distance = 50.0;
+    m_batch_size = 8;
+    m_batch_count = 0;
     m_chunks_created = false;
+    m_blends_pinned = false;
+    m_blends_read_time = 0;
     m_generate_collisions = true;
+    m_simplify_error = 0;
+    m_rtin_size = 0;
+    m_collision_dirty = false;
+    m_collision_step = 1;
+    m_headless = false;
+    m_transforms_dirty = false;
+    m_throttle_builds = false;
+    m_retire_pieces = false;
+
+    m_light_baker.instance();
+    m_rebake_lighting = true;
+    m_lighting_time = 0;
+    m_lighting_enabled = false;
+
+    m_memory_budget = 0;
+    m_budget_scale = 1.0;
+    m_budget_time = 0;
+
+    m_blend_thread = NULL;
+    m_blend_semaphore = NULL;
+    m_blend_mutex = NULL;
+    m_blend_thread_exit = false;
+    m_blend_generation = 0;
+    m_warned_layers = false;
 
     /* material */
 
-    m_material = VS::get_singleton()->material_create();
-    m_shader = VS::get_singleton()->shader_create();
-    VS::get_singleton()->shader_set_code(m_shader, vert_shader, frag_shader, "");
-    VS::get_singleton()->material_set_shader(m_material, m_shader);
-    VS::get_singleton()->material_set_param(m_material, "s", m_uv_scale);
+    m_layers.resize(5);
+
+    for (int i = 0; i < MAX_CHUNK_LAYERS; i++) {
+        m_shaders[i] = VS::get_singleton()->shader_create();
+        VS::get_singleton()->shader_set_code(m_shaders[i], vert_shader, _make_frag_shader(i + 1), "");
+    }
 
     /* physics */
 
-    m_body = PhysicsServer::get_singleton()->body_create();
+    m_body = PhysicsServer::get_singleton()->body_create(PhysicsServer::BODY_MODE_STATIC);
+    PhysicsServer::get_singleton()->body_attach_object_instance_ID(m_body, get_instance_ID());
 }
 
 TerrainNode::~TerrainNode()
 {
-    VS::get_singleton()->free(m_shader);
-    VS::get_singleton()->free(m_material);
+    _stop_blend_thread();
+    _clear_piece_pool();
+
+    for (int i = 0; i < MAX_CHUNK_LAYERS; i++) {
+        VS::get_singleton()->free(m_shaders[i]);
+    }
 
     PhysicsServer::get_singleton()->free(m_body);
 }
@@ -61,53 +137,88 @@ void TerrainNode::_notification(int what)
     switch (what) {
     case NOTIFICATION_ENTER_TREE: {
 
-        if (!m_chunks_created) {
-            for (int i = 0; i < m_chunk_count * m_chunk_count; i++) {
-                _create_chunk(i);
-            }
+        _start_blend_thread();
 
-            m_chunks_created = true;
+        PhysicsServer::get_singleton()->body_set_space(m_body, get_world()->get_space());
+        _update_body();
 
-            update_dirty_chunks();
+        if (!m_chunks_created) {
+            _create_batches();
         }
 
+        set_process(true);
+
         break;
     }
     case NOTIFICATION_EXIT_TREE: {
 
-        for (int i = 0; i < m_chunk_count * m_chunk_count; i++) {
-            _delete_chunk(i);
-        }
-
-        m_chunks_created = false;
+        _clear_chunks();
+        _stop_blend_thread();
+        PhysicsServer::get_singleton()->body_set_space(m_body, RID());
+        set_process(false);
 
         break;
     }
-    case NOTIFICATION_TRANSFORM_CHANGED: {
+    case NOTIFICATION_PROCESS: {
 
         if (m_chunks_created) {
-            for (int i = 0; i < m_chunk_count * m_chunk_count; i++) {
-                _update_chunk_transform(i);
+            _apply_blend_jobs();
+            _update_memory_budget();
+            _update_lod();
+            update_dirty_chunks();
+            _update_details();
+            _update_lighting();
+
+            _unpin_idle_blends();
+
+            // the editor keeps everything at hand
+            if (m_data.is_valid() && !get_tree()->is_editor_hint()) {
+                m_data->trim_residency();
             }
         }
 
         break;
     }
+    case NOTIFICATION_TRANSFORM_CHANGED: {
+
+        // a terrain on something moving changes many times a frame, the
+        // visual server only needs to hear about the last one
+        if (!m_transforms_dirty) {
+            m_transforms_dirty = true;
+            call_deferred("_update_transforms");
+        }
+
+        _update_body();
+
+        break;
+    }
     }
 }
 
 void TerrainNode::set_data(const Ref<TerrainData>& heightmap)
 {
+    // the old data gets its pieces freed and layers unpinned
+    _clear_chunks();
+
     if (m_data.is_valid()) {
         m_data->disconnect("size_changed", this, "_size_changed");
+        m_data->disconnect("heights_changed", this, "_heights_changed");
+        m_data->disconnect("blends_changed", this, "_blends_changed");
+        m_data->disconnect("lighting_changed", this, "_lighting_changed");
     }
 
     m_data = heightmap;
 
     if (m_data.is_valid()) {
         m_data->connect("size_changed", this, "_size_changed");
+        m_data->connect("heights_changed", this, "_heights_changed");
+        m_data->connect("blends_changed", this, "_blends_changed");
+        m_data->connect("lighting_changed", this, "_lighting_changed");
     }
 
+    m_lighting_regions.clear();
+    m_lighting_enabled = m_data.is_valid() && m_data->has_lighting();
+
     _heightmap_changed();
 }
 
@@ -116,66 +227,227 @@ Ref<TerrainData> TerrainNode::get_data() const
     return m_data;
 }
 
-void TerrainNode::set_texture0(const Ref<Texture>& texture)
+void TerrainNode::set_layer_count(int count)
 {
-    m_texture0 = texture;
-    VS::get_singleton()->material_set_param(m_material, "texture0", m_texture0);
-}
+    count = CLAMP(count, 1, (int)TerrainData::MAX_LAYERS);
 
-void TerrainNode::set_texture1(const Ref<Texture>& texture)
-{
-    m_texture1 = texture;
-    VS::get_singleton()->material_set_param(m_material, "texture1", m_texture1);
-}
+    if (count == m_layers.size()) {
+        return;
+    }
 
-void TerrainNode::set_texture2(const Ref<Texture>& texture)
-{
-    m_texture2 = texture;
-    VS::get_singleton()->material_set_param(m_material, "texture2", m_texture2);
-}
+    m_layers.resize(count);
 
-void TerrainNode::set_texture3(const Ref<Texture>& texture)
-{
-    m_texture3 = texture;
-    VS::get_singleton()->material_set_param(m_material, "texture3", m_texture3);
+    DVector<Chunk>::Write cw = m_chunks.write();
+
+    for (int i = 0; i < m_chunk_count * m_chunk_count; i++) {
+        cw[i].material_dirty = true;
+    }
+
+    DVector<Batch>::Write bw = m_batches.write();
+
+    for (int i = 0; i < m_batch_count * m_batch_count; i++) {
+        bw[i].material_dirty = true;
+    }
+
+    _change_notify();
 }
 
-void TerrainNode::set_texture4(const Ref<Texture>& texture)
+int TerrainNode::get_layer_count() const
 {
-    m_texture4 = texture;
-    VS::get_singleton()->material_set_param(m_material, "texture4", m_texture4);
+    return m_layers.size();
 }
 
-Ref<Texture> TerrainNode::get_texture0() const
+void TerrainNode::set_layer_texture(int layer, const Ref<Texture>& texture)
 {
-    return m_texture0;
+    ERR_FAIL_INDEX(layer, TerrainData::MAX_LAYERS);
+
+    if (layer >= m_layers.size()) {
+        set_layer_count(layer + 1);
+    }
+
+    m_layers[layer] = texture;
+
+    // only chunks drawing this layer need new parameters
+    DVector<Chunk>::Write cw = m_chunks.write();
+
+    for (int i = 0; i < m_chunk_count * m_chunk_count; i++) {
+        for (int k = 0; k < cw[i].layer_count; k++) {
+            if (cw[i].layers[k] == layer) {
+                cw[i].material_dirty = true;
+            }
+        }
+    }
+
+    DVector<Batch>::Write bw = m_batches.write();
+
+    for (int i = 0; i < m_batch_count * m_batch_count; i++) {
+        for (int k = 0; k < bw[i].layer_count; k++) {
+            if (bw[i].layers[k] == layer) {
+                bw[i].material_dirty = true;
+            }
+        }
+    }
 }
 
-Ref<Texture> TerrainNode::get_texture1() const
+Ref<Texture> TerrainNode::get_layer_texture(int layer) const
 {
-    return m_texture1;
+    ERR_FAIL_INDEX_V(layer, m_layers.size(), Ref<Texture>());
+
+    return m_layers[layer];
 }
 
-Ref<Texture> TerrainNode::get_texture2() const
+bool TerrainNode::_set(const StringName& name, const Variant& value)
 {
-    return m_texture2;
+    String n = name;
+
+    if (n == "layers/count") {
+        set_layer_count(value);
+        return true;
+    }
+
+    if (n.begins_with("layers/")) {
+        set_layer_texture(n.get_slicec('/', 1).to_int(), value);
+        return true;
+    }
+
+    if (n == "details/count") {
+        set_detail_count(value);
+        return true;
+    }
+
+    if (n.begins_with("details/")) {
+        int detail = n.get_slicec('/', 1).to_int();
+        String what = n.get_slicec('/', 2);
+
+        if (what == "mesh") {
+            set_detail_mesh(detail, value);
+        }
+        else if (what == "layer") {
+            set_detail_layer(detail, value);
+        }
+        else if (what == "density") {
+            set_detail_density(detail, value);
+        }
+        else if (what == "distance") {
+            set_detail_distance(detail, value);
+        }
+        else if (what == "scale") {
+            set_detail_scale(detail, value);
+        }
+        else {
+            return false;
+        }
+
+        return true;
+    }
+
+    // scenes saved with the fixed texture0..texture4 properties
+    if (n.begins_with("texture") && n.length() == 8) {
+        set_layer_texture(n.substr(7, 1).to_int(), value);
+        return true;
+    }
+
+    return false;
 }
 
-Ref<Texture> TerrainNode::get_texture3() const
+bool TerrainNode::_get(const StringName& name, Variant& ret) const
 {
-    return m_texture3;
+    String n = name;
+
+    if (n == "layers/count") {
+        ret = m_layers.size();
+        return true;
+    }
+
+    if (n.begins_with("layers/")) {
+        int layer = n.get_slicec('/', 1).to_int();
+
+        if (layer < 0 || layer >= m_layers.size()) {
+            return false;
+        }
+
+        ret = m_layers[layer];
+        return true;
+    }
+
+    if (n == "details/count") {
+        ret = m_details.size();
+        return true;
+    }
+
+    if (n.begins_with("details/")) {
+        int detail = n.get_slicec('/', 1).to_int();
+        String what = n.get_slicec('/', 2);
+
+        if (detail < 0 || detail >= m_details.size()) {
+            return false;
+        }
+
+        if (what == "mesh") {
+            ret = m_details[detail].mesh;
+        }
+        else if (what == "layer") {
+            ret = m_details[detail].layer;
+        }
+        else if (what == "density") {
+            ret = m_details[detail].density;
+        }
+        else if (what == "distance") {
+            ret = m_details[detail].distance;
+        }
+        else if (what == "scale") {
+            ret = Vector2(m_details[detail].scale_min, m_details[detail].scale_max);
+        }
+        else {
+            return false;
+        }
+
+        return true;
+    }
+
+    return false;
 }
 
-Ref<Texture> TerrainNode::get_texture4() const
+void TerrainNode::_get_property_list(List<PropertyInfo>* list) const
 {
-    return m_texture4;
+    list->push_back(PropertyInfo(Variant::INT, "layers/count", PROPERTY_HINT_RANGE, "1," + itos(TerrainData::MAX_LAYERS) + ",1"));
+
+    for (int i = 0; i < m_layers.size(); i++) {
+        list->push_back(PropertyInfo(Variant::OBJECT, "layers/" + itos(i), PROPERTY_HINT_RESOURCE_TYPE, "Texture"));
+    }
+
+    list->push_back(PropertyInfo(Variant::INT, "details/count", PROPERTY_HINT_RANGE, "0," + itos(MAX_DETAIL_LAYERS) + ",1"));
+
+    for (int i = 0; i < m_details.size(); i++) {
+        String prefix = "details/" + itos(i) + "/";
+
+        list->push_back(PropertyInfo(Variant::OBJECT, prefix + "mesh", PROPERTY_HINT_RESOURCE_TYPE, "Mesh"));
+        list->push_back(PropertyInfo(Variant::INT, prefix + "layer", PROPERTY_HINT_RANGE, "0," + itos(TerrainData::MAX_LAYERS - 1) + ",1"));
+        list->push_back(PropertyInfo(Variant::REAL, prefix + "density", PROPERTY_HINT_RANGE, "0,16,0.01"));
+        list->push_back(PropertyInfo(Variant::REAL, prefix + "distance"));
+        list->push_back(PropertyInfo(Variant::VECTOR2, prefix + "scale"));
+    }
 }
 
 void TerrainNode::set_chunk_scale(const float scale)
 {
     m_scale = scale;
 
+    _clear_details();
+
     _chunks_mark_all_dirty();
+
+    // collision faces are built scaled too
+    DVector<Chunk>::Write cw = m_chunks.write();
+
+    for (int i = 0; i < m_chunk_count * m_chunk_count; i++) {
+        cw[i].collision_dirty = true;
+    }
+
+    cw = DVector<Chunk>::Write();
+
+    m_collision_dirty = true;
+
     update_dirty_chunks();
 }
 
@@ -187,7 +459,18 @@ float TerrainNode::get_chunk_scale() const
 void TerrainNode::set_uv_scale(const float scale)
 {
     m_uv_scale = scale;
-    VS::get_singleton()->material_set_param(m_material, "s", m_uv_scale);
+
+    for (int i = 0; i < m_chunk_count * m_chunk_count; i++) {
+        if (m_chunks[i].material.is_valid()) {
+            VS::get_singleton()->material_set_param(m_chunks[i].material, "s", m_uv_scale);
+        }
+    }
+
+    for (int i = 0; i < m_batch_count * m_batch_count; i++) {
+        if (m_batches[i].material.is_valid()) {
+            VS::get_singleton()->material_set_param(m_batches[i].material, "s", m_uv_scale);
+        }
+    }
 }
 
 float TerrainNode::get_uv_scale() const
@@ -195,6 +478,80 @@ float TerrainNode::get_uv_scale() const
     return m_uv_scale;
 }
 
+void TerrainNode::set_chunk_size(int size)
+{
+    // chunks and batch LOD steps need power of two sizes
+    size = nearest_power_of_2(CLAMP(size, 4, 256));
+
+    if (size == m_chunk_size) {
+        return;
+    }
+
+    _clear_chunks();
+    m_chunk_size = size;
+    _heightmap_changed();
+}
+
+int TerrainNode::get_chunk_size() const
+{
+    return m_chunk_size;
+}
+
+void TerrainNode::set_batch_size(int size)
+{
+    size = CLAMP(size, 1, 64);
+
+    if (size == m_batch_size) {
+        return;
+    }
+
+    _clear_chunks();
+    m_batch_size = size;
+    _heightmap_changed();
+}
+
+int TerrainNode::get_batch_size() const
+{
+    return m_batch_size;
+}
+
+void TerrainNode::set_lod_distance(float distance)
+{
+    m_lod_distance = MAX(distance, 0.0f);
+}
+
+float TerrainNode::get_lod_distance() const
+{
+    return m_lod_distance;
+}
+
+void TerrainNode::set_simplify_error(float error)
+{
+    m_simplify_error = MAX(error, 0.0f);
+
+    // only chunks use it, merged batches have their own lods
+    DVector<Chunk>::Write w = m_chunks.write();
+
+    for (int i = 0; i < m_chunk_count * m_chunk_count; i++) {
+        w[i].mesh_dirty = true;
+    }
+}
+
+float TerrainNode::get_simplify_error() const
+{
+    return m_simplify_error;
+}
+
+void TerrainNode::set_mesh_cache_path(const String& path)
+{
+    m_mesh_cache_path = path;
+}
+
+String TerrainNode::get_mesh_cache_path() const
+{
+    return m_mesh_cache_path;
+}
+
 int TerrainNode::get_pixel_x_at(const Vector3 pos, const float offset) const
 {
     if (m_data.is_null()) {
@@ -235,22 +592,114 @@ int TerrainNode::get_chunk_offset_at(int x, int y)
 // mark chunks dirty that contain point
 void TerrainNode::mark_height_dirty(int x, int y)
 {
+    _mark_height_dirty_rect(x, y, x, y, true);
+}
+
+// mark chunks dirty that overlap the texel rect, 'edit' keeps their
+// batch split for a while like an editor stroke does
+void TerrainNode::_mark_height_dirty_rect(int x1, int y1, int x2, int y2, bool edit)
+{
+    if (m_chunk_count == 0) {
+        return;
+    }
+
+    if (m_rebake_lighting && m_lighting_enabled) {
+        _add_lighting_region(Rect2(x1, y1, x2 - x1 + 1, y2 - y1 + 1));
+        m_lighting_time = OS::get_singleton()->get_ticks_msec();
+    }
+
+    // normals are taken from neighbouring heights, so a point also
+    // touches chunks one texel away
+    int cx1 = MAX((x1 - 1) / m_chunk_size - 1, 0);
+    int cy1 = MAX((y1 - 1) / m_chunk_size - 1, 0);
+    int cx2 = MIN((x2 + 1) / m_chunk_size, m_chunk_count - 1);
+    int cy2 = MIN((y2 + 1) / m_chunk_size, m_chunk_count - 1);
+
+    uint64_t now = OS::get_singleton()->get_ticks_msec();
+
     DVector<Chunk>::Write w = m_chunks.write();
+    DVector<Batch>::Write bw = m_batches.write();
 
-    for (int i = 0; i < m_chunk_count * m_chunk_count; i++) {
-        if (is_hmap_pixel_inside_chunk(i, x, y)) {
-            w[i].mesh_dirty = true;
+    for (int cy = cy1; cy <= cy2; cy++) {
+        for (int cx = cx1; cx <= cx2; cx++) {
+            int offset = cy * m_chunk_count + cx;
+
+            // same range as is_hmap_pixel_inside_chunk()
+            if (x2 < cx * m_chunk_size - 1 || x1 > cx * m_chunk_size + m_chunk_size + 1) {
+                continue;
+            }
+
+            if (y2 < cy * m_chunk_size - 1 || y1 > cy * m_chunk_size + m_chunk_size + 1) {
+                continue;
+            }
+
+            int b = (cy / m_batch_size) * m_batch_count + (cx / m_batch_size);
+
+            w[offset].mesh_dirty = true;
+            w[offset].collision_dirty = true;
+            w[offset].details_dirty = true;
+            bw[b].mesh_dirty = true;
+
+            if (edit) {
+                bw[b].edit_time = now;
+            }
         }
     }
+
+    m_collision_dirty = true;
 }
 
-void TerrainNode::_mark_blend_dirty(int x, int y)
+// mark chunks dirty whose blendmap (including its border) contains texel
+void TerrainNode::mark_blend_dirty(int x, int y)
 {
+    _mark_blend_dirty_rect(x, y, x, y);
+}
+
+void TerrainNode::mark_height_dirty_rect(const Rect2& region)
+{
+    _mark_height_dirty_rect(region.pos.x, region.pos.y, region.pos.x + region.size.x - 1, region.pos.y + region.size.y - 1, true);
+}
+
+void TerrainNode::mark_blend_dirty_rect(const Rect2& region)
+{
+    _mark_blend_dirty_rect(region.pos.x, region.pos.y, region.pos.x + region.size.x - 1, region.pos.y + region.size.y - 1);
+}
+
+void TerrainNode::_mark_blend_dirty_rect(int x1, int y1, int x2, int y2)
+{
+    if (m_chunk_count == 0) {
+        return;
+    }
+
+    uint64_t now = OS::get_singleton()->get_ticks_msec();
+
+    int cx1 = MAX((x1 - 1) / m_chunk_size - 1, 0);
+    int cy1 = MAX((y1 - 1) / m_chunk_size - 1, 0);
+    int cx2 = MIN((x2 + 1) / m_chunk_size, m_chunk_count - 1);
+    int cy2 = MIN((y2 + 1) / m_chunk_size, m_chunk_count - 1);
+
     DVector<Chunk>::Write w = m_chunks.write();
+    DVector<Batch>::Write bw = m_batches.write();
 
-    for (int i = 0; i < m_chunk_count * m_chunk_count; i++) {
-        if (is_hmap_pixel_inside_chunk(i, x, y)) {
-            w[i].blend_dirty = true;
+    for (int cy = cy1; cy <= cy2; cy++) {
+        for (int cx = cx1; cx <= cx2; cx++) {
+            int offset = cy * m_chunk_count + cx;
+
+            if (x2 < cx * m_chunk_size - 1 || x1 > cx * m_chunk_size + m_chunk_size + 1) {
+                continue;
+            }
+
+            if (y2 < cy * m_chunk_size - 1 || y1 > cy * m_chunk_size + m_chunk_size + 1) {
+                continue;
+            }
+
+            int b = (cy / m_batch_size) * m_batch_count + (cx / m_batch_size);
+
+            w[offset].blend_dirty = true;
+            w[offset].blend_time = now;
+            w[offset].details_dirty = true;
+            bw[b].blend_dirty = true;
+            bw[b].blend_time = now;
         }
     }
 }
@@ -261,10 +710,10 @@ bool TerrainNode::is_hmap_pixel_inside_chunk(int offset, int x, int y)
     int cx = offset - (cy * m_chunk_count);
     int map_x2, map_y2, map_x1, map_y1;
 
-    map_x1 = cx * m_chunk_size;
-    map_y1 = cy * m_chunk_size;
-    map_x2 = map_x1 + m_chunk_size + 1; // chunks share verices on edges
-    map_y2 = map_y1 + m_chunk_size + 1;
+    map_x1 = cx * m_chunk_size - 1;
+    map_y1 = cy * m_chunk_size - 1;
+    map_x2 = map_x1 + m_chunk_size + 2; // chunks share verices on edges
+    map_y2 = map_y1 + m_chunk_size + 2;
 
     if (x >= map_x1 && x <= map_x2) {
         if (y >= map_y1 && y <= map_y2) {
@@ -275,209 +724,2256 @@ bool TerrainNode::is_hmap_pixel_inside_chunk(int offset, int x, int y)
     return false;
 }
 
-void TerrainNode::_update_chunk_mesh(int ch_offset)
+Array TerrainNode::_build_mesh_arrays(int map_x1, int map_y1, int w, int h, int step, bool skirts)
 {
+    if (m_simplify_error > 0 && step == 1 && !skirts && w == h && nearest_power_of_2(w) == (unsigned int)w) {
+        return _build_adaptive_mesh_arrays(map_x1, map_y1, w);
+    }
+
     Array arr;
-    DVector<Vector3> points;
-    DVector<Vector3> normals;
-    DVector<Vector2> uvs;
-    DVector<int> indices;
 
     int map_size = m_data->get_size();
 
-    // get chunk coords
-    int chunk_y = ch_offset / m_chunk_count;
-    int chunk_x = ch_offset - (chunk_y * m_chunk_count);
+    // blendmap texels of this region, see _update_blendmap()
+    float blend_w = _get_blendmap_size(w);
+    float blend_h = _get_blendmap_size(h);
 
-    int map_x2, map_y2, map_x1, map_y1;
+    // vertices per side, the region shares its edge vertices with neighbours
+    int nx = w / step + 1;
+    int ny = h / step + 1;
 
-    // chunk xy to height map xy
-    map_x1 = chunk_x * m_chunk_size;
-    map_y1 = chunk_y * m_chunk_size;
-    map_x2 = map_x1 + m_chunk_size + 1;
-    map_y2 = map_y1 + m_chunk_size + 1;
+    MeshLayout& layout = _get_mesh_layout(nx, ny, skirts);
 
     /* build vertex array */
 
-    int vert_count = (map_y2 - map_y1) * (map_x2 - map_x1);
+    int grid_count = nx * ny;
+    int skirt_count = skirts ? (nx + ny) * 2 : 0;
+    int vert_count = grid_count + skirt_count;
+
+    // scratch of the layout, no allocation unless the visual server still holds the last ones
+    DVector<Vector3>& points = layout.points;
+    DVector<Vector3>& normals = layout.normals;
+    DVector<Vector2>& uvs = layout.uvs;
+    DVector<Vector2>& uv2s = layout.uv2s;
 
     points.resize(vert_count);
+    normals.resize(vert_count);
     uvs.resize(vert_count);
+    uv2s.resize(vert_count);
 
     DVector<Vector3>::Write pointsw = points.write();
+    DVector<Vector3>::Write normalsw = normals.write();
     DVector<Vector2>::Write uvsw = uvs.write();
-
-    Clock clk;
+    DVector<Vector2>::Write uv2sw = uv2s.write();
 
     int counter = 0;
+    float min_height = TERRAIN_MAX_HEIGHT;
 
-    for (int x = map_x1; x < map_x2; x++) {
-        for (int y = map_y1; y < map_y2; y++) {
+    for (int i = 0; i < nx; i++) {
+        for (int j = 0; j < ny; j++) {
+            int x = map_x1 + i * step;
+            int y = map_y1 + j * step;
             float h = m_data->get_height_at(x, y);
 
-            Vector3 point = Vector3(x * m_scale, h * m_scale, y * m_scale);
-            Vector2 uv = Vector2(x / (map_size - 1.0f), y / (map_size - 1.0f));
+            // normal from the height gradient, so it matches across chunks and lods
+            float dx = m_data->get_height_at(x + step, y) - m_data->get_height_at(x - step, y);
+            float dy = m_data->get_height_at(x, y + step) - m_data->get_height_at(x, y - step);
+
+            pointsw[counter] = Vector3(x * m_scale, h * m_scale, y * m_scale);
+            normalsw[counter] = Vector3(-dx, 2.0f * step, -dy).normalized();
+            uvsw[counter] = Vector2(x / (map_size - 1.0f), y / (map_size - 1.0f));
+            uv2sw[counter] = Vector2((x - map_x1 + 1) / blend_w, (y - map_y1 + 1) / blend_h);
 
-            pointsw[counter] = point;
-            uvsw[counter] = uv;
+            if (h < min_height) {
+                min_height = h;
+            }
 
             counter++;
         }
     }
 
-    pointsw = DVector<Vector3>::Write();
-    uvsw = DVector<Vector2>::Write();
-
-    clk.check("vertex buffer gen");
+    /* skirts hide the cracks against neighbours with a different lod */
 
-    /* build index buffer */
+    if (skirts) {
+        float skirt_y = (min_height - step) * m_scale;
 
-    int quads_w = map_x2 - map_x1 - 1;
-    int quads_h = map_y2 - map_y1 - 1;
+        int edge_start[4];
+        int edge_stride[4];
+        int edge_len[4];
+        _get_skirt_edges(nx, ny, edge_start, edge_stride, edge_len);
 
-    int tri_count = quads_w * quads_h * 2;
+        for (int e = 0; e < 4; e++) {
+            for (int i = 0; i < edge_len[e]; i++) {
+                int src = edge_start[e] + i * edge_stride[e];
+                Vector3 p = pointsw[src];
 
-    indices.resize(tri_count * 3);
+                pointsw[counter] = Vector3(p.x, skirt_y, p.z);
+                normalsw[counter] = normalsw[src];
+                uvsw[counter] = uvsw[src];
+                uv2sw[counter] = uv2sw[src];
+                counter++;
+            }
+        }
+    }
 
-    DVector<int>::Write indicesw = indices.write();
+    pointsw = DVector<Vector3>::Write();
+    normalsw = DVector<Vector3>::Write();
+    uvsw = DVector<Vector2>::Write();
+    uv2sw = DVector<Vector2>::Write();
+
+    arr.resize(VS::ARRAY_MAX);
+    arr[VS::ARRAY_VERTEX] = points;
+    arr[VS::ARRAY_NORMAL] = normals;
+    arr[VS::ARRAY_TEX_UV] = uvs;
+    arr[VS::ARRAY_TEX_UV2] = uv2s;
+    arr[VS::ARRAY_INDEX] = layout.indices;
+
+    return arr;
+}
+
+// each edge is walked so that its skirt faces outwards
+void TerrainNode::_get_skirt_edges(int nx, int ny, int* start, int* stride, int* len)
+{
+    start[0] = 0;
+    start[1] = (nx - 1) * ny;
+    start[2] = (nx - 1) * ny + ny - 1;
+    start[3] = ny - 1;
+
+    stride[0] = ny;
+    stride[1] = 1;
+    stride[2] = -ny;
+    stride[3] = -1;
+
+    len[0] = nx;
+    len[1] = ny;
+    len[2] = nx;
+    len[3] = ny;
+}
+
+// the index buffer of a grid only depends on its vertex counts, built once
+// and shared by every mesh with the same layout
+TerrainNode::MeshLayout& TerrainNode::_get_mesh_layout(int nx, int ny, bool skirts)
+{
+    uint32_t key = nx | (ny << 15) | ((skirts ? 1 : 0) << 30);
+
+    Map<uint32_t, MeshLayout>::Element* E = m_mesh_layouts.find(key);
+
+    if (E) {
+        return E->get();
+    }
+
+    if (m_mesh_layouts.size() >= MAX_MESH_LAYOUTS) {
+        m_mesh_layouts.clear();
+    }
+
+    int quads_w = nx - 1;
+    int quads_h = ny - 1;
+
+    int tri_count = quads_w * quads_h * 2;
+
+    if (skirts) {
+        tri_count += (quads_w + quads_h) * 4;
+    }
+
+    DVector<int> indices;
+    indices.resize(tri_count * 3);
+
+    DVector<int>::Write indicesw = indices.write();
+
+    int index = 0;
+
+    // loop for each quad
+    for (int x = 0; x < quads_w; x++) {
+        for (int y = 0; y < quads_h; y++) {
+            int offset = x * ny + y;
+
+            indicesw[index++] = offset;
+            indicesw[index++] = offset + ny + 1;
+            indicesw[index++] = offset + 1;
+
+            indicesw[index++] = offset;
+            indicesw[index++] = offset + ny;
+            indicesw[index++] = offset + ny + 1;
+        }
+    }
+
+    // skirt vertices follow the grid, one run per edge
+    if (skirts) {
+        int edge_start[4];
+        int edge_stride[4];
+        int edge_len[4];
+        _get_skirt_edges(nx, ny, edge_start, edge_stride, edge_len);
+
+        int first = nx * ny;
+
+        for (int e = 0; e < 4; e++) {
+            for (int i = 0; i < edge_len[e] - 1; i++) {
+                int top0 = edge_start[e] + i * edge_stride[e];
+                int top1 = top0 + edge_stride[e];
+                int bottom0 = first + i;
+                int bottom1 = bottom0 + 1;
+
+                indicesw[index++] = top0;
+                indicesw[index++] = bottom0;
+                indicesw[index++] = top1;
+
+                indicesw[index++] = top1;
+                indicesw[index++] = bottom0;
+                indicesw[index++] = bottom1;
+            }
+
+            first += edge_len[e];
+        }
+    }
+
+    indicesw = DVector<int>::Write();
+
+    MeshLayout layout;
+    layout.indices = indices;
+
+    return m_mesh_layouts.insert(key, layout)->get();
+}
+
+// triangles of a right triangulated irregular network over a size^2 grid,
+// ordered so that parents come before their children
+void TerrainNode::_update_rtin_coords()
+{
+    if (m_rtin_size == m_chunk_size) {
+        return;
+    }
+
+    int size = m_chunk_size;
+    int count = size * size * 2 - 2;
+
+    m_rtin_size = size;
+    m_rtin_coords.resize(count * 4);
+
+    for (int i = 0; i < count; i++) {
+        int id = i + 2;
+        int ax = 0, ay = 0, bx = 0, by = 0, cx = 0, cy = 0;
+
+        if (id & 1) {
+            bx = by = cx = size;
+        }
+        else {
+            ax = ay = cy = size;
+        }
+
+        while ((id >>= 1) > 1) {
+            int mx = (ax + bx) >> 1;
+            int my = (ay + by) >> 1;
+
+            if (id & 1) {
+                bx = ax;
+                by = ay;
+                ax = cx;
+                ay = cy;
+            }
+            else {
+                ax = bx;
+                ay = by;
+                bx = cx;
+                by = cy;
+            }
+
+            cx = mx;
+            cy = my;
+        }
+
+        m_rtin_coords[i * 4] = ax;
+        m_rtin_coords[i * 4 + 1] = ay;
+        m_rtin_coords[i * 4 + 2] = bx;
+        m_rtin_coords[i * 4 + 3] = by;
+    }
+}
+
+// chunk mesh with fewer triangles where the heights allow it. Border vertices
+// are always kept, so the chunk meets any neighbour without cracks
+Array TerrainNode::_build_adaptive_mesh_arrays(int map_x1, int map_y1, int size)
+{
+    _update_rtin_coords();
+
+    int n = size + 1;
+    int map_size = m_data->get_size();
+    int stride = map_size + 1;
+    float max_error = m_simplify_error / m_scale;
+    float blend_size = _get_blendmap_size(size);
+
+    /* heights and error of every vertex */
+
+    m_rtin_heights.resize(n * n);
+    m_rtin_errors.resize(n * n);
+
+    float* hs = &m_rtin_heights[0];
+    float* es = &m_rtin_errors[0];
+
+    DVector<uint8_t>::Read r = m_data->get_height_buffer().read();
+
+    for (int j = 0; j < n; j++) {
+        for (int i = 0; i < n; i++) {
+            int x = MIN(map_x1 + i, map_size);
+            int y = MIN(map_y1 + j, map_size);
+
+            hs[j * n + i] = TerrainData::decode_height(&r[(y * stride + x) * 2]);
+            es[j * n + i] = (i == 0 || j == 0 || i == size || j == size) ? 1e20f : 0.0f;
+        }
+    }
+
+    r = DVector<uint8_t>::Read();
+
+    int count = m_rtin_coords.size() / 4;
+    int parents = count - size * size;
+    const uint16_t* coords = &m_rtin_coords[0];
+
+    // children first, every vertex ends up with the largest error below it
+    for (int i = count - 1; i >= 0; i--) {
+        int ax = coords[i * 4];
+        int ay = coords[i * 4 + 1];
+        int bx = coords[i * 4 + 2];
+        int by = coords[i * 4 + 3];
+
+        int mx = (ax + bx) >> 1;
+        int my = (ay + by) >> 1;
+        int cx = mx + my - ay;
+        int cy = my + ax - mx;
+
+        int mid = my * n + mx;
+        float e = ABS((hs[ay * n + ax] + hs[by * n + bx]) * 0.5f - hs[mid]);
+
+        es[mid] = MAX(es[mid], e);
+
+        if (i < parents) {
+            int left = ((ay + cy) >> 1) * n + ((ax + cx) >> 1);
+            int right = ((by + cy) >> 1) * n + ((bx + cx) >> 1);
+
+            es[mid] = MAX(es[mid], MAX(es[left], es[right]));
+        }
+    }
+
+    /* split triangles top down while the error is too large */
+
+    Vector<int> vertex_map;
+    vertex_map.resize(n * n);
+
+    for (int i = 0; i < n * n; i++) {
+        vertex_map[i] = -1;
+    }
+
+    Vector<int> tris; // grid offsets, three per triangle
+    Vector<int> stack;
+
+    int roots[12] = { 0, 0, size, size, size, 0, size, size, 0, 0, 0, size };
+
+    for (int i = 0; i < 12; i++) {
+        stack.push_back(roots[i]);
+    }
+
+    while (stack.size()) {
+        int top = stack.size() - 6;
+        int ax = stack[top], ay = stack[top + 1];
+        int bx = stack[top + 2], by = stack[top + 3];
+        int cx = stack[top + 4], cy = stack[top + 5];
+
+        stack.resize(top);
+
+        int mx = (ax + bx) >> 1;
+        int my = (ay + by) >> 1;
+
+        if (ABS(ax - cx) + ABS(ay - cy) > 1 && es[my * n + mx] > max_error) {
+            int split[12] = { cx, cy, ax, ay, mx, my, bx, by, cx, cy, mx, my };
+
+            for (int k = 0; k < 12; k++) {
+                stack.push_back(split[k]);
+            }
+
+            continue;
+        }
+
+        int a = ay * n + ax;
+        int b = by * n + bx;
+        int c = cy * n + cx;
+
+        // same winding as the full grid
+        if ((bx - ax) * (cy - ay) - (by - ay) * (cx - ax) < 0) {
+            SWAP(b, c);
+        }
+
+        tris.push_back(a);
+        tris.push_back(b);
+        tris.push_back(c);
+
+        vertex_map[a] = vertex_map[b] = vertex_map[c] = 0;
+    }
+
+    /* vertices, same attributes as _build_mesh_arrays() */
+
+    int vert_count = 0;
+
+    for (int i = 0; i < n * n; i++) {
+        if (vertex_map[i] == 0) {
+            vertex_map[i] = vert_count++;
+        }
+    }
+
+    DVector<Vector3> points;
+    DVector<Vector3> normals;
+    DVector<Vector2> uvs;
+    DVector<Vector2> uv2s;
+    DVector<int> indices;
+
+    points.resize(vert_count);
+    normals.resize(vert_count);
+    uvs.resize(vert_count);
+    uv2s.resize(vert_count);
+    indices.resize(tris.size());
+
+    DVector<Vector3>::Write pointsw = points.write();
+    DVector<Vector3>::Write normalsw = normals.write();
+    DVector<Vector2>::Write uvsw = uvs.write();
+    DVector<Vector2>::Write uv2sw = uv2s.write();
+    DVector<int>::Write indicesw = indices.write();
+
+    for (int i = 0; i < n * n; i++) {
+        int v = vertex_map[i];
+
+        if (v < 0) {
+            continue;
+        }
+
+        int x = map_x1 + i % n;
+        int y = map_y1 + i / n;
+        float h = hs[i];
+
+        float dx = m_data->get_height_at(x + 1, y) - m_data->get_height_at(x - 1, y);
+        float dy = m_data->get_height_at(x, y + 1) - m_data->get_height_at(x, y - 1);
+
+        pointsw[v] = Vector3(x * m_scale, h * m_scale, y * m_scale);
+        normalsw[v] = Vector3(-dx, 2.0f, -dy).normalized();
+        uvsw[v] = Vector2(x / (map_size - 1.0f), y / (map_size - 1.0f));
+        uv2sw[v] = Vector2((x - map_x1 + 1) / blend_size, (y - map_y1 + 1) / blend_size);
+    }
+
+    for (int i = 0; i < tris.size(); i++) {
+        indicesw[i] = vertex_map[tris[i]];
+    }
+
+    pointsw = DVector<Vector3>::Write();
+    normalsw = DVector<Vector3>::Write();
+    uvsw = DVector<Vector2>::Write();
+    uv2sw = DVector<Vector2>::Write();
+    indicesw = DVector<int>::Write();
+
+    Array arr;
+    arr.resize(VS::ARRAY_MAX);
+    arr[VS::ARRAY_VERTEX] = points;
+    arr[VS::ARRAY_NORMAL] = normals;
+    arr[VS::ARRAY_TEX_UV] = uvs;
+    arr[VS::ARRAY_TEX_UV2] = uv2s;
+    arr[VS::ARRAY_INDEX] = indices;
+
+    return arr;
+}
+
+// mesh arrays from the disk cache when the heights still match, meshes
+// built while editing are not stored since they will change again soon
+Array TerrainNode::_get_mesh_arrays(int x, int y, int w, int h, int step, bool skirts, bool editing)
+{
+    // heights under the brush never match a cached file
+    if (m_mesh_cache_path == "" || editing) {
+        return _build_mesh_arrays(x, y, w, h, step, skirts);
+    }
+
+    // everything besides the heights that ends up in the vertices
+    uint64_t params = m_data->get_size();
+    params = params * 31 + (skirts ? 1 : 0);
+    params = params * 31 + (uint64_t)(m_scale * 65536.0f);
+    params = params * 31 + (uint64_t)(m_simplify_error * 65536.0f);
+
+    uint64_t hash = TerrainMeshCache::hash_region(m_data, x, y, w, h, step, params);
+    String file = TerrainMeshCache::get_file(m_mesh_cache_path, x, y, w, h, step);
+
+    Array arr;
+
+    if (TerrainMeshCache::load(file, hash, arr)) {
+        return arr;
+    }
+
+    arr = _build_mesh_arrays(x, y, w, h, step, skirts);
+    TerrainMeshCache::store(file, hash, arr);
+
+    return arr;
+}
+
+void TerrainNode::_update_chunk_mesh(int ch_offset)
+{
+    // get chunk coords
+    int chunk_y = ch_offset / m_chunk_count;
+    int chunk_x = ch_offset - (chunk_y * m_chunk_count);
+
+    // chunk xy to height map xy
+    int map_x1 = chunk_x * m_chunk_size;
+    int map_y1 = chunk_y * m_chunk_size;
+
+    int b = (chunk_y / m_batch_size) * m_batch_count + (chunk_x / m_batch_size);
+    bool editing = m_batches[b].edit_time != 0 && OS::get_singleton()->get_ticks_msec() - m_batches[b].edit_time < EDIT_HOLD_MSEC;
+
+    Array arr = _get_mesh_arrays(map_x1, map_y1, m_chunk_size, m_chunk_size, 1, false, editing);
+
+    /* remove surface if exists */
+
+    if (m_chunks[ch_offset].surface_added) {
+        VS::get_singleton()->mesh_remove_surface(m_chunks[ch_offset].mesh, 0);
+    }
+
+    /* give arrays to visual server */
+
+    VS::get_singleton()->mesh_add_surface(
+        m_chunks[ch_offset].mesh,
+        VS::PRIMITIVE_TRIANGLES,
+        arr);
+
+    VS::get_singleton()->mesh_surface_set_material(m_chunks[ch_offset].mesh, 0, m_chunks[ch_offset].material);
+
+    /* remove dirty flag */
+    DVector<Chunk>::Write cw = m_chunks.write();
+
+    cw[ch_offset].mesh_dirty = false;
+    cw[ch_offset].surface_added = true;
+    cw[ch_offset].mesh_bytes = _get_mesh_array_bytes(arr);
+
+    cw = DVector<Chunk>::Write();
+}
+
+void TerrainNode::_create_chunk(int offset)
+{
+    DVector<Chunk>::Write w = m_chunks.write();
+
+    _init_piece(w[offset]);
+
+    w = DVector<Chunk>::Write();
+
+    _update_chunk_transform(offset);
+}
+
+void TerrainNode::_delete_chunk(int offset)
+{
+    DVector<Chunk>::Write w = m_chunks.write();
+
+    _free_piece(w[offset]);
+}
+
+void TerrainNode::_update_chunk_transform(int offset)
+{
+    Transform t = get_global_transform();
+    VS::get_singleton()->instance_set_transform(m_chunks[offset].instance, t);
+}
+
+// only what is drawn, split batches catch up when they merge again
+void TerrainNode::_update_transforms()
+{
+    m_transforms_dirty = false;
+
+    if (!is_inside_tree() || !m_chunks_created || is_headless()) {
+        return;
+    }
+
+    Transform t = get_global_transform();
+
+    for (int i = 0; i < m_batch_count * m_batch_count; i++) {
+        if (!m_batches[i].split) {
+            VS::get_singleton()->instance_set_transform(m_batches[i].instance, t);
+            continue;
+        }
+
+        int by = i / m_batch_count;
+        int bx = i - (by * m_batch_count);
+
+        int cx2 = MIN((bx + 1) * m_batch_size, m_chunk_count);
+        int cy2 = MIN((by + 1) * m_batch_size, m_chunk_count);
+
+        for (int cy = by * m_batch_size; cy < cy2; cy++) {
+            for (int cx = bx * m_batch_size; cx < cx2; cx++) {
+                VS::get_singleton()->instance_set_transform(m_chunks[cy * m_chunk_count + cx].instance, t);
+            }
+        }
+    }
+
+    for (Map<int, DetailChunk>::Element* E = m_detail_chunks.front(); E; E = E->next()) {
+        for (int d = 0; d < MAX_DETAIL_LAYERS; d++) {
+            if (E->get().instance[d].is_valid()) {
+                VS::get_singleton()->instance_set_transform(E->get().instance[d], t);
+            }
+        }
+    }
+}
+
+void TerrainNode::_init_piece(Piece& piece)
+{
+    if (m_piece_pool.size()) {
+        const PooledPiece& pooled = m_piece_pool[m_piece_pool.size() - 1];
+
+        piece.mesh = pooled.mesh;
+        piece.instance = pooled.instance;
+        piece.material = pooled.material;
+
+        m_piece_pool.resize(m_piece_pool.size() - 1);
+    }
+    else {
+        piece.mesh = VS::get_singleton()->mesh_create();
+        piece.instance = VS::get_singleton()->instance_create();
+        piece.material = VS::get_singleton()->material_create();
+    }
+    piece.blend_tex = RID();
+    piece.blend_bytes = 0;
+    piece.layer_count = 0;
+    piece.blend_time = 0;
+    piece.blend_compressed = false;
+    piece.surface_added = false;
+    piece.mesh_bytes = 0;
+    piece.mesh_dirty = true;
+    piece.material_dirty = true;
+    piece.blend_dirty = true;
+
+    VS::get_singleton()->instance_set_scenario(piece.instance, get_world()->get_scenario());
+    VS::get_singleton()->instance_set_base(piece.instance, piece.mesh);
+}
+
+// the mesh, instance and material go back to the pool, splitting and
+// merging batches or resizing the map then creates nothing new
+void TerrainNode::_free_piece(Piece& piece)
+{
+    if (piece.surface_added) {
+        VS::get_singleton()->mesh_remove_surface(piece.mesh, 0);
+    }
+
+    if (m_piece_pool.size() < MAX_POOLED_PIECES) {
+        VS::get_singleton()->instance_set_scenario(piece.instance, RID());
+
+        PooledPiece pooled;
+        pooled.mesh = piece.mesh;
+        pooled.instance = piece.instance;
+        pooled.material = piece.material;
+
+        m_piece_pool.push_back(pooled);
+    }
+    else {
+        VS::get_singleton()->free(piece.mesh);
+        VS::get_singleton()->free(piece.instance);
+        VS::get_singleton()->free(piece.material);
+    }
+
+    if (piece.blend_tex.is_valid()) {
+        VS::get_singleton()->free(piece.blend_tex);
+    }
+
+    piece.mesh = RID();
+    piece.instance = RID();
+    piece.material = RID();
+    piece.blend_tex = RID();
+    piece.blend_bytes = 0;
+    piece.layer_count = 0;
+    piece.blend_version++; // drops compression jobs still in flight
+    piece.surface_added = false;
+}
+
+void TerrainNode::_clear_piece_pool()
+{
+    for (int i = 0; i < m_piece_pool.size(); i++) {
+        VS::get_singleton()->free(m_piece_pool[i].mesh);
+        VS::get_singleton()->free(m_piece_pool[i].instance);
+        VS::get_singleton()->free(m_piece_pool[i].material);
+    }
+
+    m_piece_pool.clear();
+}
+
+int TerrainNode::_get_blendmap_size(int size) const
+{
+    // one border texel on each side so filtering matches the neighbours,
+    // rounded up to whole compression blocks
+    return (size + 2 + 3) & ~3;
+}
+
+// picks the strongest layers of a region and resolves its texel weights
+// for them, returns true when the picked layers changed
+bool TerrainNode::_resolve_blendmap(int x, int y, int w, int h, Image& image, int* layers, int& layer_count)
+{
+    int map_size = m_data->get_size();
+    int tex_w = _get_blendmap_size(w);
+    int tex_h = _get_blendmap_size(h);
+
+    _pin_blends();
+    DVector<uint8_t> blends = m_data->get_blend_data();
+
+    if (blends.size() < map_size * map_size * 4) {
+        return false;
+    }
+
+    DVector<uint8_t>::Read r = blends.read();
+    /* find the layers covering most of the region */
+
+    float coverage[TerrainData::MAX_LAYERS];
+
+    for (int i = 0; i < TerrainData::MAX_LAYERS; i++) {
+        coverage[i] = 0;
+    }
+
+    for (int j = y - 1; j <= y + h; j++) {
+        for (int i = x - 1; i <= x + w; i++) {
+            int sx = CLAMP(i, 0, map_size - 1);
+            int sy = CLAMP(j, 0, map_size - 1);
+
+            int texel_layers[3];
+            float texel_weights[3];
+
+            TerrainData::decode_blend(&r[(sy * map_size + sx) * 4], texel_layers, texel_weights);
+
+            for (int k = 0; k < 3; k++) {
+                coverage[texel_layers[k]] += texel_weights[k];
+            }
+        }
+    }
+
+    int picked[MAX_CHUNK_LAYERS];
+    int count = 0;
+
+    while (count < MAX_CHUNK_LAYERS) {
+        int best = -1;
+        float best_coverage = 0;
+
+        for (int i = 0; i < TerrainData::MAX_LAYERS; i++) {
+            if (coverage[i] > best_coverage) {
+                best = i;
+                best_coverage = coverage[i];
+            }
+        }
+
+        if (best < 0) {
+            break;
+        }
+
+        picked[count++] = best;
+        coverage[best] = 0;
+    }
+
+    if (count == 0) {
+        picked[count++] = 0;
+    }
+
+    // whatever is left over gets folded into the picked layers below
+    if (!m_warned_layers) {
+        for (int i = 0; i < TerrainData::MAX_LAYERS; i++) {
+            if (coverage[i] > 0) {
+                WARN_PRINT("TerrainNode: a chunk uses more than 4 layers, the weakest ones are merged into their neighbours.");
+                m_warned_layers = true;
+                break;
+            }
+        }
+    }
+
+    bool changed = count != layer_count;
+
+    for (int i = 0; i < count; i++) {
+        changed = changed || layers[i] != picked[i];
+        layers[i] = picked[i];
+    }
+
+    layer_count = count;
+
+    /* a single layer needs no blendmap at all */
+
+    if (count == 1) {
+        image = Image();
+        return changed;
+    }
+
+    /* resolve texel weights against the picked layers */
+
+    DVector<uint8_t> data;
+    data.resize(tex_w * tex_h * 3);
+
+    DVector<uint8_t>::Write dw = data.write();
+
+    for (int j = 0; j < tex_h; j++) {
+        for (int i = 0; i < tex_w; i++) {
+            int sx = CLAMP(x - 1 + MIN(i, w + 1), 0, map_size - 1);
+            int sy = CLAMP(y - 1 + MIN(j, h + 1), 0, map_size - 1);
+
+            int texel_layers[3];
+            float texel_weights[3];
+            float slots[MAX_CHUNK_LAYERS] = { 0, 0, 0, 0 };
+
+            TerrainData::decode_blend(&r[(sy * map_size + sx) * 4], texel_layers, texel_weights);
+
+            // layers that didn't make it are merged into the strongest
+            // picked layer of the same texel, so the surface keeps the
+            // look of whatever was painted there instead of the base
+            int texel_slots[3];
+            int strongest = -1;
+
+            for (int k = 0; k < 3; k++) {
+                texel_slots[k] = -1;
+
+                for (int l = 0; l < count; l++) {
+                    if (layers[l] == texel_layers[k]) {
+                        texel_slots[k] = l;
+                    }
+                }
+
+                if (texel_slots[k] >= 0 && (strongest < 0 || texel_weights[k] > texel_weights[strongest])) {
+                    strongest = k;
+                }
+            }
+
+            for (int k = 0; k < 3; k++) {
+                int slot = texel_slots[k];
+
+                if (slot < 0) {
+                    slot = strongest >= 0 ? texel_slots[strongest] : 0;
+                }
+
+                slots[slot] += texel_weights[k];
+            }
+
+            uint8_t* out = &dw[(j * tex_w + i) * 3];
+
+            for (int k = 0; k < 3; k++) {
+                out[k] = CLAMP(Math::fast_ftoi(slots[k + 1] * 255.0f), 0, 255);
+            }
+        }
+    }
+
+    dw = DVector<uint8_t>::Write();
+
+    image = Image(tex_w, tex_h, false, Image::FORMAT_RGB, data);
+
+    return changed;
+}
+
+// recently painted pieces get raw weights, everything else is handed to
+// the worker thread and swapped for a block compressed texture when done
+void TerrainNode::_update_blendmap(Piece& piece, int x, int y, int w, int h, int offset, bool batch)
+{
+    Image image;
+
+    if (_resolve_blendmap(x, y, w, h, image, piece.layers, piece.layer_count)) {
+        piece.material_dirty = true;
+    }
+
+    piece.blend_dirty = false;
+    piece.blend_version++;
+
+    if (image.empty()) {
+        if (piece.blend_tex.is_valid()) {
+            VS::get_singleton()->free(piece.blend_tex);
+            piece.blend_tex = RID();
+        }
+
+        piece.blend_bytes = 0;
+        piece.blend_compressed = false;
+        return;
+    }
+
+    uint64_t now = OS::get_singleton()->get_ticks_msec();
+    bool painted = piece.blend_time != 0 && now - piece.blend_time < EDIT_HOLD_MSEC;
+    bool compress = !painted && m_blend_thread && Image::_image_compress_bc_func;
+
+    bool created = false;
+
+    if (!piece.blend_tex.is_valid()) {
+        piece.blend_tex = VS::get_singleton()->texture_create();
+        piece.material_dirty = true;
+        created = true;
+    }
+
+    // a compressed update keeps showing the previous weights until the
+    // worker is done, only a brand new texture needs the raw ones first
+    if (!compress || created) {
+        RID tex = piece.blend_tex;
+
+        if (VS::get_singleton()->texture_get_format(tex) != image.get_format() || VS::get_singleton()->texture_get_width(tex) != image.get_width()) {
+            VS::get_singleton()->texture_allocate(tex, image.get_width(), image.get_height(), image.get_format(), VS::TEXTURE_FLAG_FILTER);
+        }
+
+        VS::get_singleton()->texture_set_data(tex, image);
+        piece.blend_bytes = image.get_data().size();
+    }
+
+    piece.blend_compressed = compress;
+
+    if (compress) {
+        BlendJob job;
+        job.offset = offset;
+        job.batch = batch;
+        job.version = piece.blend_version;
+        job.generation = m_blend_generation;
+        job.image = image;
+
+        m_blend_mutex->lock();
+        m_blend_jobs.push_back(job);
+        m_blend_mutex->unlock();
+
+        m_blend_semaphore->post();
+    }
+}
+
+void TerrainNode::_update_material(Piece& piece)
+{
+    VS::get_singleton()->material_set_shader(piece.material, m_shaders[piece.layer_count - 1]);
+    VS::get_singleton()->material_set_param(piece.material, "s", m_uv_scale);
+
+    VS::get_singleton()->material_set_param(piece.material, "lit", m_lighting_enabled ? 1.0 : 0.0);
+
+    if (m_data.is_valid()) {
+        VS::get_singleton()->material_set_param(piece.material, "lighting", m_data->get_lighting_texture());
+        VS::get_singleton()->material_set_param(piece.material, "lsize", m_data->get_size());
+    }
+
+    for (int i = 0; i < piece.layer_count; i++) {
+        Ref<Texture> texture;
+
+        if (piece.layers[i] < m_layers.size()) {
+            texture = m_layers[piece.layers[i]];
+        }
+
+        VS::get_singleton()->material_set_param(piece.material, "layer" + itos(i), texture);
+    }
+
+    if (piece.layer_count > 1) {
+        VS::get_singleton()->material_set_param(piece.material, "blendmap", piece.blend_tex);
+    }
+
+    piece.material_dirty = false;
+}
+
+void TerrainNode::_update_chunk_blendmap(int offset)
+{
+    int cy = offset / m_chunk_count;
+    int cx = offset - (cy * m_chunk_count);
+
+    DVector<Chunk>::Write w = m_chunks.write();
+
+    _update_blendmap(w[offset], cx * m_chunk_size, cy * m_chunk_size, m_chunk_size, m_chunk_size, offset, false);
+}
+
+void TerrainNode::_update_chunk_material(int offset)
+{
+    DVector<Chunk>::Write w = m_chunks.write();
+
+    _update_material(w[offset]);
+}
+
+void TerrainNode::_update_batch_blendmap(int offset)
+{
+    int x, y, bw, bh;
+    _get_batch_rect(offset, x, y, bw, bh);
+
+    DVector<Batch>::Write w = m_batches.write();
+
+    _update_blendmap(w[offset], x, y, bw, bh, offset, true);
+}
+
+void TerrainNode::_update_batch_material(int offset)
+{
+    DVector<Batch>::Write w = m_batches.write();
+
+    _update_material(w[offset]);
+}
+
+void TerrainNode::_start_blend_thread()
+{
+    if (m_blend_thread) {
+        return;
+    }
+
+    m_blend_thread_exit = false;
+    m_blend_semaphore = Semaphore::create();
+    m_blend_mutex = Mutex::create();
+    m_blend_thread = Thread::create(_blend_thread_func, this);
+}
+
+void TerrainNode::_stop_blend_thread()
+{
+    if (!m_blend_thread) {
+        return;
+    }
+
+    m_blend_mutex->lock();
+    m_blend_thread_exit = true;
+    m_blend_jobs.clear();
+    m_blend_mutex->unlock();
+
+    m_blend_semaphore->post();
+
+    Thread::wait_to_finish(m_blend_thread);
+    memdelete(m_blend_thread);
+    memdelete(m_blend_semaphore);
+    memdelete(m_blend_mutex);
+
+    m_blend_thread = NULL;
+    m_blend_semaphore = NULL;
+    m_blend_mutex = NULL;
+    m_blend_results.clear();
+}
+
+void TerrainNode::_blend_thread_func(void* userdata)
+{
+    TerrainNode* node = (TerrainNode*)userdata;
+
+    while (true) {
+        node->m_blend_semaphore->wait();
+
+        node->m_blend_mutex->lock();
+
+        if (node->m_blend_thread_exit) {
+            node->m_blend_mutex->unlock();
+            break;
+        }
+
+        if (node->m_blend_jobs.empty()) {
+            node->m_blend_mutex->unlock();
+            continue;
+        }
+
+        BlendJob job = node->m_blend_jobs.front()->get();
+        node->m_blend_jobs.pop_front();
+
+        node->m_blend_mutex->unlock();
+
+        job.image.compress(Image::COMPRESS_BC);
+
+        node->m_blend_mutex->lock();
+        node->m_blend_results.push_back(job);
+        node->m_blend_mutex->unlock();
+    }
+}
+
+// swap in blendmaps the worker finished compressing
+void TerrainNode::_apply_blend_jobs()
+{
+    if (!m_blend_thread) {
+        return;
+    }
+
+    m_blend_mutex->lock();
+    List<BlendJob> results = m_blend_results;
+    m_blend_results.clear();
+    m_blend_mutex->unlock();
+
+    for (List<BlendJob>::Element* E = results.front(); E; E = E->next()) {
+        const BlendJob& job = E->get();
+
+        if (job.generation != m_blend_generation) {
+            continue;
+        }
+
+        DVector<Batch>::Write bw;
+        DVector<Chunk>::Write cw;
+        Piece* piece;
+
+        if (job.batch) {
+            if (job.offset >= m_batches.size() || m_batches[job.offset].blend_version != job.version) {
+                continue;
+            }
+
+            bw = m_batches.write();
+            piece = &bw[job.offset];
+        }
+        else {
+            if (job.offset >= m_chunks.size() || m_chunks[job.offset].blend_version != job.version) {
+                continue;
+            }
+
+            cw = m_chunks.write();
+            piece = &cw[job.offset];
+        }
+
+        if (!piece->blend_tex.is_valid()) {
+            continue;
+        }
+
+        VS::get_singleton()->texture_allocate(piece->blend_tex, job.image.get_width(), job.image.get_height(), job.image.get_format(), VS::TEXTURE_FLAG_FILTER);
+        VS::get_singleton()->texture_set_data(piece->blend_tex, job.image);
+        piece->blend_bytes = job.image.get_data().size();
+    }
+}
+
+void TerrainNode::set_generate_collisions(bool enable)
+{
+    if (m_generate_collisions == enable) {
+        return;
+    }
+
+    m_generate_collisions = enable;
+
+    DVector<Chunk>::Write w = m_chunks.write();
+
+    for (int i = 0; i < m_chunk_count * m_chunk_count; i++) {
+        if (!enable && w[i].shape.is_valid()) {
+            PhysicsServer::get_singleton()->free(w[i].shape);
+            w[i].shape = RID();
+        }
+
+        w[i].collision_dirty = true;
+    }
+
+    w = DVector<Chunk>::Write();
+
+    if (!enable) {
+        PhysicsServer::get_singleton()->body_clear_shapes(m_body);
+    }
+
+    m_collision_dirty = enable;
+}
+
+bool TerrainNode::get_generate_collisions() const
+{
+    return m_generate_collisions;
+}
+
+void TerrainNode::set_collision_step(int step)
+{
+    step = CLAMP(step, 1, m_chunk_size);
+
+    if (step == m_collision_step) {
+        return;
+    }
+
+    m_collision_step = step;
+
+    DVector<Chunk>::Write w = m_chunks.write();
+
+    for (int i = 0; i < m_chunk_count * m_chunk_count; i++) {
+        w[i].collision_dirty = true;
+    }
+
+    w = DVector<Chunk>::Write();
+
+    m_collision_dirty = true;
+    update_dirty_chunks();
+}
+
+int TerrainNode::get_collision_step() const
+{
+    return m_collision_step;
+}
+
+void TerrainNode::set_headless(bool enable)
+{
+    if (enable == m_headless) {
+        return;
+    }
+
+    // pieces are freed the way they were created
+    _clear_chunks();
+    m_headless = enable;
+    _heightmap_changed();
+}
+
+bool TerrainNode::is_headless() const
+{
+    return m_headless || !OS::get_singleton()->can_draw();
+}
+
+// position is global, radius and strength in world units
+void TerrainNode::add_deformation(const Vector3& position, float radius, float strength, int mode, float falloff)
+{
+    ERR_FAIL_COND(m_data.is_null());
+    ERR_FAIL_INDEX(mode, TerrainData::STAMP_FLATTEN + 1);
+
+    Vector3 local = get_global_transform().affine_inverse().xform(position);
+
+    Deformation d;
+    d.mode = mode;
+    d.center = Vector2(local.x, local.z) / m_scale;
+    d.radius = radius / m_scale;
+    d.strength = mode == TerrainData::STAMP_FLATTEN ? strength : strength / m_scale;
+    d.falloff = falloff;
+    d.height = local.y / m_scale;
+
+    // everything queued this frame goes out in one upload
+    if (m_deformations.empty()) {
+        call_deferred("_apply_deformations");
+    }
+
+    m_deformations.push_back(d);
+}
+
+void TerrainNode::_apply_deformations()
+{
+    if (m_data.is_null() || m_deformations.empty()) {
+        m_deformations.clear();
+        return;
+    }
+
+    // each stamp is marked on its own, a bounding rect of scattered stamps
+    // would rebuild everything between them
+    Vector<Rect2> dirty;
+
+    for (int i = 0; i < m_deformations.size(); i++) {
+        const Deformation& d = m_deformations[i];
+        Rect2 r = m_data->stamp_height(d.mode, d.center, d.radius, d.strength, d.falloff, d.height);
+
+        if (!r.has_no_area()) {
+            dirty.push_back(r);
+        }
+    }
+
+    m_deformations.clear();
+
+    if (dirty.empty()) {
+        return;
+    }
+
+    // uploads once and marks the chunks through _heights_changed(), and
+    // lets make_delta() see the edits
+    m_data->heights_changed_regions(dirty);
+    update_dirty_chunks();
+}
+
+void TerrainNode::_update_body()
+{
+    if (!is_inside_tree()) {
+        return;
+    }
+
+    PhysicsServer::get_singleton()->body_set_state(m_body, PhysicsServer::BODY_STATE_TRANSFORM, get_global_transform());
+}
+
+void TerrainNode::_update_chunk_collision(int offset)
+{
+    int cy = offset / m_chunk_count;
+    int cx = offset - (cy * m_chunk_count);
+
+    int map_x1 = cx * m_chunk_size;
+    int map_y1 = cy * m_chunk_size;
+    int cells = (m_chunk_size + m_collision_step - 1) / m_collision_step;
+    int n = cells + 1;
+
+    // chunk grid in local space, faces wind like the render mesh. The last
+    // row and column snap to the chunk edge so neighbours stay sealed
+    Vector<Vector3>& points = m_collision_points;
+    points.resize(n * n);
+
+    for (int i = 0; i < n; i++) {
+        for (int j = 0; j < n; j++) {
+            int x = map_x1 + MIN(i * m_collision_step, m_chunk_size);
+            int y = map_y1 + MIN(j * m_collision_step, m_chunk_size);
+
+            points[i * n + j] = Vector3(x, m_data->get_height_at(x, y), y) * m_scale;
+        }
+    }
+
+    // the physics server copies the faces, so the buffer is reused
+    DVector<Vector3>& faces = m_collision_faces;
+    faces.resize(cells * cells * 6);
+
+    DVector<Vector3>::Write fw = faces.write();
+
+    int index = 0;
+
+    for (int x = 0; x < cells; x++) {
+        for (int y = 0; y < cells; y++) {
+            int o = x * n + y;
+
+            fw[index++] = points[o];
+            fw[index++] = points[o + n + 1];
+            fw[index++] = points[o + 1];
+
+            fw[index++] = points[o];
+            fw[index++] = points[o + n];
+            fw[index++] = points[o + n + 1];
+        }
+    }
+
+    fw = DVector<Vector3>::Write();
+
+    DVector<Chunk>::Write w = m_chunks.write();
+
+    if (!w[offset].shape.is_valid()) {
+        w[offset].shape = PhysicsServer::get_singleton()->shape_create(PhysicsServer::SHAPE_CONCAVE_POLYGON);
+        PhysicsServer::get_singleton()->body_add_shape(m_body, w[offset].shape);
+    }
+
+    PhysicsServer::get_singleton()->shape_set_data(w[offset].shape, faces);
+
+    w[offset].collision_bytes = (int64_t)faces.size() * sizeof(Vector3);
+    w[offset].collision_dirty = false;
+}
+
+void TerrainNode::_update_collisions()
+{
+    if (!m_generate_collisions || !m_collision_dirty) {
+        return;
+    }
+
+    for (int i = 0; i < m_chunk_count * m_chunk_count; i++) {
+        if (m_chunks[i].collision_dirty) {
+            _update_chunk_collision(i);
+        }
+    }
+
+    m_collision_dirty = false;
+}
+
+void TerrainNode::_get_batch_rect(int offset, int& x, int& y, int& w, int& h) const
+{
+    int by = offset / m_batch_count;
+    int bx = offset - (by * m_batch_count);
+
+    // batches on the far edges may hold fewer chunks
+    int chunks_x = MIN(m_batch_size, m_chunk_count - bx * m_batch_size);
+    int chunks_y = MIN(m_batch_size, m_chunk_count - by * m_batch_size);
+
+    x = bx * m_batch_size * m_chunk_size;
+    y = by * m_batch_size * m_chunk_size;
+    w = chunks_x * m_chunk_size;
+    h = chunks_y * m_chunk_size;
+}
+
+int TerrainNode::_get_batch_lod(float distance) const
+{
+    int step = 1;
+    float limit = m_lod_distance * 2.0f;
+
+    while (distance > limit && step < m_chunk_size) {
+        step *= 2;
+        limit *= 2.0f;
+    }
+
+    return step;
+}
+
+void TerrainNode::_create_batch(int offset)
+{
+    DVector<Batch>::Write w = m_batches.write();
+
+    _init_piece(w[offset]);
+
+    w[offset].lod = 1;
+    w[offset].split = false;
+    w[offset].edit_time = 0;
+
+    w = DVector<Batch>::Write();
+
+    VS::get_singleton()->instance_set_transform(m_batches[offset].instance, get_global_transform());
+}
+
+void TerrainNode::_delete_batch(int offset)
+{
+    if (m_batches[offset].split) {
+        _merge_batch(offset);
+    }
+
+    DVector<Batch>::Write w = m_batches.write();
+
+    _free_piece(w[offset]);
+}
+
+// the batch keeps drawing the old map until _free_retired_pieces()
+void TerrainNode::_retire_batch(int offset)
+{
+    if (m_batches[offset].split) {
+        int by = offset / m_batch_count;
+        int bx = offset - (by * m_batch_count);
+
+        int cx2 = MIN((bx + 1) * m_batch_size, m_chunk_count);
+        int cy2 = MIN((by + 1) * m_batch_size, m_chunk_count);
+
+        for (int cy = by * m_batch_size; cy < cy2; cy++) {
+            for (int cx = bx * m_batch_size; cx < cx2; cx++) {
+                m_retired_pieces.push_back(m_chunks[cy * m_chunk_count + cx]);
+            }
+        }
+    }
+
+    m_retired_pieces.push_back(m_batches[offset]);
+}
+
+void TerrainNode::_free_retired_pieces()
+{
+    for (int i = 0; i < m_retired_pieces.size(); i++) {
+        _free_piece(m_retired_pieces[i]);
+    }
+
+    m_retired_pieces.clear();
+}
+
+void TerrainNode::_update_batch_mesh(int offset)
+{
+    int x, y, w, h;
+    _get_batch_rect(offset, x, y, w, h);
+
+    bool editing = m_batches[offset].edit_time != 0 && OS::get_singleton()->get_ticks_msec() - m_batches[offset].edit_time < EDIT_HOLD_MSEC;
+
+    Array arr = _get_mesh_arrays(x, y, w, h, m_batches[offset].lod, true, editing);
+
+    if (m_batches[offset].surface_added) {
+        VS::get_singleton()->mesh_remove_surface(m_batches[offset].mesh, 0);
+    }
+
+    VS::get_singleton()->mesh_add_surface(m_batches[offset].mesh, VS::PRIMITIVE_TRIANGLES, arr);
+    VS::get_singleton()->mesh_surface_set_material(m_batches[offset].mesh, 0, m_batches[offset].material);
+
+    DVector<Batch>::Write bw = m_batches.write();
+
+    bw[offset].mesh_dirty = false;
+    bw[offset].surface_added = true;
+    bw[offset].mesh_bytes = _get_mesh_array_bytes(arr);
+}
+
+// replace the merged mesh with full detail chunks
+void TerrainNode::_split_batch(int offset)
+{
+    int by = offset / m_batch_count;
+    int bx = offset - (by * m_batch_count);
+
+    int cx2 = MIN((bx + 1) * m_batch_size, m_chunk_count);
+    int cy2 = MIN((by + 1) * m_batch_size, m_chunk_count);
+
+    for (int cy = by * m_batch_size; cy < cy2; cy++) {
+        for (int cx = bx * m_batch_size; cx < cx2; cx++) {
+            _create_chunk(cy * m_chunk_count + cx);
+        }
+    }
+
+    if (m_batches[offset].surface_added) {
+        VS::get_singleton()->mesh_remove_surface(m_batches[offset].mesh, 0);
+    }
+
+    if (m_batches[offset].blend_tex.is_valid()) {
+        VS::get_singleton()->free(m_batches[offset].blend_tex);
+    }
+
+    DVector<Batch>::Write w = m_batches.write();
+
+    w[offset].blend_tex = RID();
+    w[offset].blend_bytes = 0;
+    w[offset].layer_count = 0;
+    w[offset].blend_version++;
+    w[offset].blend_compressed = false;
+    w[offset].split = true;
+    w[offset].lod = 0;
+    w[offset].surface_added = false;
+    w[offset].mesh_dirty = true;
+}
+
+void TerrainNode::_merge_batch(int offset)
+{
+    int by = offset / m_batch_count;
+    int bx = offset - (by * m_batch_count);
+
+    int cx2 = MIN((bx + 1) * m_batch_size, m_chunk_count);
+    int cy2 = MIN((by + 1) * m_batch_size, m_chunk_count);
+
+    for (int cy = by * m_batch_size; cy < cy2; cy++) {
+        for (int cx = bx * m_batch_size; cx < cx2; cx++) {
+            _delete_chunk(cy * m_chunk_count + cx);
+        }
+    }
+
+    DVector<Batch>::Write w = m_batches.write();
+
+    w[offset].split = false;
+    w[offset].lod = 1;
+    w[offset].mesh_dirty = true;
+    w[offset].blend_dirty = true;
+
+    w = DVector<Batch>::Write();
+
+    VS::get_singleton()->instance_set_transform(m_batches[offset].instance, get_global_transform());
+}
+
+// split batches that are close or being edited, pick merged mesh detail by distance
+void TerrainNode::_update_lod()
+{
+    if (!m_chunks_created || is_headless()) {
+        return;
+    }
+
+    bool has_camera = false;
+    Vector3 cam_pos;
+    Camera* cam = get_viewport() ? get_viewport()->get_camera() : NULL;
+
+    if (cam) {
+        cam_pos = get_global_transform().affine_inverse().xform(cam->get_global_transform().origin);
+        has_camera = true;
+    }
+
+    uint64_t now = OS::get_singleton()->get_ticks_msec();
+
+    for (int i = 0; i < m_batch_count * m_batch_count; i++) {
+        int x, y, w, h;
+        _get_batch_rect(i, x, y, w, h);
+
+        // without a camera (e.g. in the editor) keep batches at full detail
+        float distance = 0;
+
+        if (has_camera) {
+            AABB box(Vector3(x * m_scale, 0, y * m_scale), Vector3(w * m_scale, TERRAIN_MAX_HEIGHT * m_scale, h * m_scale));
+            Vector3 closest = cam_pos;
+
+            closest.x = CLAMP(closest.x, box.pos.x, box.pos.x + box.size.x);
+            closest.y = CLAMP(closest.y, box.pos.y, box.pos.y + box.size.y);
+            closest.z = CLAMP(closest.z, box.pos.z, box.pos.z + box.size.z);
+
+            distance = closest.distance_to(cam_pos);
+        }
+
+        bool edited = m_batches[i].edit_time != 0 && now - m_batches[i].edit_time < EDIT_HOLD_MSEC;
+        bool close = has_camera && distance < m_lod_distance * m_budget_scale;
+
+        if (close || edited) {
+            if (!m_batches[i].split) {
+                _split_batch(i);
+            }
+        }
+        else {
+            if (m_batches[i].split) {
+                _merge_batch(i);
+            }
+
+            int lod = _get_batch_lod(distance / m_budget_scale);
+
+            if (lod != m_batches[i].lod) {
+                DVector<Batch>::Write bw = m_batches.write();
+                bw[i].lod = lod;
+                bw[i].mesh_dirty = true;
+            }
+        }
+    }
+}
+
+void TerrainNode::update_dirty_chunks()
+{
+    uint32_t benchmark = OS::get_singleton()->get_ticks_msec();
+
+    if (!is_inside_tree() || !m_chunks_created) {
+        return;
+    }
+
+    _update_collisions();
+
+    if (is_headless()) {
+        return;
+    }
+
+    int updated = 0;
+    bool pending = false;
+    uint64_t now = OS::get_singleton()->get_ticks_msec();
+    bool can_compress = m_blend_thread && Image::_image_compress_bc_func;
+
+    for (int i = 0; i < m_batch_count * m_batch_count; i++) {
+
+        if (!m_batches[i].split) {
+            if (m_throttle_builds && updated >= RESIZE_BUILDS_PER_FRAME && m_batches[i].mesh_dirty) {
+                pending = true;
+                continue;
+            }
+
+            if (can_compress && m_batches[i].blend_tex.is_valid() && !m_batches[i].blend_compressed && now - m_batches[i].blend_time >= EDIT_HOLD_MSEC) {
+                m_batches.write()[i].blend_dirty = true;
+            }
+
+            if (m_batches[i].blend_dirty) {
+                _update_batch_blendmap(i);
+            }
+
+            if (m_batches[i].material_dirty) {
+                _update_batch_material(i);
+            }
+
+            if (m_batches[i].mesh_dirty) {
+                _update_batch_mesh(i);
+                updated++;
+            }
+
+            continue;
+        }
+
+        int by = i / m_batch_count;
+        int bx = i - (by * m_batch_count);
+
+        int cx2 = MIN((bx + 1) * m_batch_size, m_chunk_count);
+        int cy2 = MIN((by + 1) * m_batch_size, m_chunk_count);
+
+        for (int cy = by * m_batch_size; cy < cy2; cy++) {
+            for (int cx = bx * m_batch_size; cx < cx2; cx++) {
+                int offset = cy * m_chunk_count + cx;
+
+                if (m_throttle_builds && updated >= RESIZE_BUILDS_PER_FRAME && m_chunks[offset].mesh_dirty) {
+                    pending = true;
+                    continue;
+                }
+
+                // painting stopped, time to compress
+                if (can_compress && m_chunks[offset].blend_tex.is_valid() && !m_chunks[offset].blend_compressed && now - m_chunks[offset].blend_time >= EDIT_HOLD_MSEC) {
+                    m_chunks.write()[offset].blend_dirty = true;
+                }
+
+                if (m_chunks[offset].blend_dirty) {
+                    _update_chunk_blendmap(offset);
+                }
+
+                if (m_chunks[offset].material_dirty) {
+                    _update_chunk_material(offset);
+                }
+
+                if (m_chunks[offset].mesh_dirty) {
+                    _update_chunk_mesh(offset);
+                    updated++;
+                }
+            }
+        }
+    }
+
+    m_throttle_builds = pending;
+
+    // every piece of the new map has a mesh, the old one can go
+    if (!pending && !m_retired_pieces.empty()) {
+        _free_retired_pieces();
+    }
+
+    if (updated == 0) {
+        return;
+    }
+
+    benchmark = OS::get_singleton()->get_ticks_msec() - benchmark;
+
+    if (OS::get_singleton()->is_stdout_verbose()) {
+        print_line("TerrainNode::_update_dirty_chunks() benchmark:" + itos(benchmark));
+    }
+}
+
+/* details */
+
+void TerrainNode::set_detail_count(int count)
+{
+    count = CLAMP(count, 0, (int)MAX_DETAIL_LAYERS);
+
+    if (count == m_details.size()) {
+        return;
+    }
+
+    int old = m_details.size();
+    m_details.resize(count);
+
+    for (int i = old; i < count; i++) {
+        m_details[i].layer = 0;
+        m_details[i].density = 0.5;
+        m_details[i].distance = 30.0;
+        m_details[i].scale_min = 0.8;
+        m_details[i].scale_max = 1.2;
+    }
+
+    _details_changed();
+    _change_notify();
+}
+
+int TerrainNode::get_detail_count() const
+{
+    return m_details.size();
+}
+
+void TerrainNode::set_detail_mesh(int detail, const Ref<Mesh>& mesh)
+{
+    ERR_FAIL_INDEX(detail, MAX_DETAIL_LAYERS);
+
+    if (detail >= m_details.size()) {
+        set_detail_count(detail + 1);
+    }
+
+    m_details[detail].mesh = mesh;
+    _details_changed();
+}
+
+Ref<Mesh> TerrainNode::get_detail_mesh(int detail) const
+{
+    ERR_FAIL_INDEX_V(detail, m_details.size(), Ref<Mesh>());
+
+    return m_details[detail].mesh;
+}
+
+void TerrainNode::set_detail_layer(int detail, int layer)
+{
+    ERR_FAIL_INDEX(detail, m_details.size());
+    ERR_FAIL_INDEX(layer, TerrainData::MAX_LAYERS);
+
+    m_details[detail].layer = layer;
+    _details_changed();
+}
+
+int TerrainNode::get_detail_layer(int detail) const
+{
+    ERR_FAIL_INDEX_V(detail, m_details.size(), 0);
+
+    return m_details[detail].layer;
+}
+
+void TerrainNode::set_detail_density(int detail, float density)
+{
+    ERR_FAIL_INDEX(detail, m_details.size());
+
+    m_details[detail].density = MAX(density, 0.0f);
+    _details_changed();
+}
+
+float TerrainNode::get_detail_density(int detail) const
+{
+    ERR_FAIL_INDEX_V(detail, m_details.size(), 0);
+
+    return m_details[detail].density;
+}
+
+// fading only needs the distance, instances stay as they are
+void TerrainNode::set_detail_distance(int detail, float distance)
+{
+    ERR_FAIL_INDEX(detail, m_details.size());
+
+    m_details[detail].distance = MAX(distance, 0.0f);
+}
+
+float TerrainNode::get_detail_distance(int detail) const
+{
+    ERR_FAIL_INDEX_V(detail, m_details.size(), 0);
+
+    return m_details[detail].distance;
+}
+
+void TerrainNode::set_detail_scale(int detail, const Vector2& range)
+{
+    ERR_FAIL_INDEX(detail, m_details.size());
+
+    m_details[detail].scale_min = range.x;
+    m_details[detail].scale_max = range.y;
+    _details_changed();
+}
+
+Vector2 TerrainNode::get_detail_scale(int detail) const
+{
+    ERR_FAIL_INDEX_V(detail, m_details.size(), Vector2());
+
+    return Vector2(m_details[detail].scale_min, m_details[detail].scale_max);
+}
+
+// distance from the camera (terrain space) to the chunk bounds
+float TerrainNode::_get_chunk_distance(int offset, const Vector3& cam_pos) const
+{
+    int cy = offset / m_chunk_count;
+    int cx = offset - (cy * m_chunk_count);
+
+    float size = m_chunk_size * m_scale;
+    Vector3 closest = cam_pos;
+
+    closest.x = CLAMP(closest.x, cx * size, cx * size + size);
+    closest.y = CLAMP(closest.y, 0, TERRAIN_MAX_HEIGHT * m_scale);
+    closest.z = CLAMP(closest.z, cy * size, cy * size + size);
+
+    return closest.distance_to(cam_pos);
+}
+
+static inline float _detail_rand(uint32_t* seed)
+{
+    return (Math::rand_from_seed(seed) & 0xFFFF) / 65536.0f;
+}
+
+// scatters instances over the chunk, every texel has its own seed so the
+// result only changes where the blends or heights did
+void TerrainNode::_build_details(int offset, DetailChunk& details)
+{
+    int cy = offset / m_chunk_count;
+    int cx = offset - (cy * m_chunk_count);
+    int x1 = cx * m_chunk_size;
+    int y1 = cy * m_chunk_size;
+
+    int map_size = m_data->get_size();
+    int stride = map_size + 1;
+
+    _pin_blends();
+    DVector<uint8_t>::Read hr = m_data->get_height_buffer().read();
+    DVector<uint8_t> blends = m_data->get_blend_data();
+    DVector<uint8_t>::Read br = blends.read();
+
+    for (int d = 0; d < m_details.size(); d++) {
+        const DetailLayer& detail = m_details[d];
+        Vector<Transform> xforms;
+        float min_h = TERRAIN_MAX_HEIGHT;
+        float max_h = 0;
+
+        for (int j = 0; j < m_chunk_size && detail.mesh.is_valid(); j++) {
+            for (int i = 0; i < m_chunk_size; i++) {
+                int x = x1 + i;
+                int y = y1 + j;
+
+                int layers[3];
+                float weights[3];
+                TerrainData::decode_blend(&br[(y * map_size + x) * 4], layers, weights);
+
+                float weight = 0;
+
+                for (int k = 0; k < 3; k++) {
+                    if (layers[k] == detail.layer) {
+                        weight += weights[k];
+                    }
+                }
+
+                float expected = detail.density * weight;
+
+                if (expected <= 0) {
+                    continue;
+                }
+
+                uint32_t seed = (uint32_t)(y * map_size + x) * 2654435761u + d * 40503u + 1;
+                int count = (int)expected + (_detail_rand(&seed) < expected - (int)expected ? 1 : 0);
+
+                for (int k = 0; k < count; k++) {
+                    float fx = _detail_rand(&seed);
+                    float fy = _detail_rand(&seed);
+
+                    const uint8_t* row = &hr[(y * stride + x) * 2];
+                    float h00 = TerrainData::decode_height(row);
+                    float h10 = TerrainData::decode_height(row + 2);
+                    float h01 = TerrainData::decode_height(row + stride * 2);
+                    float h11 = TerrainData::decode_height(row + stride * 2 + 2);
+
+                    float h0 = h00 + (h10 - h00) * fx;
+                    float h1 = h01 + (h11 - h01) * fx;
+                    float h = h0 + (h1 - h0) * fy;
+
+                    float scale = detail.scale_min + (detail.scale_max - detail.scale_min) * _detail_rand(&seed);
+
+                    Transform t;
+                    t.basis = Matrix3(Vector3(0, 1, 0), _detail_rand(&seed) * Math_PI * 2.0f);
+                    t.basis.scale(Vector3(scale, scale, scale));
+                    t.origin = Vector3((x + fx) * m_scale, h * m_scale, (y + fy) * m_scale);
+
+                    xforms.push_back(t);
+
+                    min_h = MIN(min_h, h);
+                    max_h = MAX(max_h, h);
+                }
+            }
+        }
+
+        details.count[d] = xforms.size();
+
+        if (xforms.empty()) {
+            if (details.instance[d].is_valid()) {
+                VS::get_singleton()->free(details.instance[d]);
+                VS::get_singleton()->free(details.multimesh[d]);
+                details.instance[d] = RID();
+                details.multimesh[d] = RID();
+            }
+
+            continue;
+        }
+
+        // shuffled, so lowering the visible count thins out evenly
+        uint32_t seed = offset * 92821u + d;
 
-    int index = 0;
+        for (int i = xforms.size() - 1; i > 0; i--) {
+            int k = Math::rand_from_seed(&seed) % (i + 1);
+            SWAP(xforms[i], xforms[k]);
+        }
 
-    // loop for each quad
-    for (int x = 0; x < quads_w; x++) {
-        for (int y = 0; y < quads_h; y++) {
-            int offset = y * (quads_w + 1) + x;
+        if (!details.multimesh[d].is_valid()) {
+            details.multimesh[d] = VS::get_singleton()->multimesh_create();
+            details.instance[d] = VS::get_singleton()->instance_create();
 
-            indicesw[index++] = offset;
-            indicesw[index++] = offset + quads_w + 2;
-            indicesw[index++] = offset + 1;
+            VS::get_singleton()->instance_set_scenario(details.instance[d], get_world()->get_scenario());
+            VS::get_singleton()->instance_set_base(details.instance[d], details.multimesh[d]);
+            VS::get_singleton()->instance_set_transform(details.instance[d], get_global_transform());
+        }
 
-            indicesw[index++] = offset;
-            indicesw[index++] = offset + quads_w + 1;
-            indicesw[index++] = offset + quads_w + 2;
+        RID mm = details.multimesh[d];
+
+        VS::get_singleton()->multimesh_set_mesh(mm, detail.mesh->get_rid());
+        VS::get_singleton()->multimesh_set_instance_count(mm, xforms.size());
+
+        for (int i = 0; i < xforms.size(); i++) {
+            VS::get_singleton()->multimesh_instance_set_transform(mm, i, xforms[i]);
         }
+
+        // chunk bounds, grown by the largest instance for culling
+        AABB box(Vector3(x1 * m_scale, min_h * m_scale, y1 * m_scale), Vector3(m_chunk_size * m_scale, (max_h - min_h) * m_scale, m_chunk_size * m_scale));
+        AABB mesh_box = detail.mesh->get_aabb();
+
+        box.grow_by(mesh_box.size.length() * MAX(detail.scale_max, detail.scale_min));
+
+        VS::get_singleton()->multimesh_set_aabb(mm, box);
     }
 
-    indicesw = DVector<int>::Write();
+    m_chunks.write()[offset].details_dirty = false;
+}
 
-    clk.check("index buffer gen");
+void TerrainNode::_free_details(DetailChunk& details)
+{
+    for (int d = 0; d < MAX_DETAIL_LAYERS; d++) {
+        if (details.instance[d].is_valid()) {
+            VS::get_singleton()->free(details.instance[d]);
+            VS::get_singleton()->free(details.multimesh[d]);
+        }
 
-    /* generate normals */
+        details.instance[d] = RID();
+        details.multimesh[d] = RID();
+        details.count[d] = 0;
+    }
+}
 
-    normals.resize(vert_count);
-    DVector<Vector3>::Write normalsw = normals.write();
-    DVector<Vector3>::Read pointsr = points.read();
-    DVector<int>::Read indicesr = indices.read();
+void TerrainNode::_clear_details()
+{
+    for (Map<int, DetailChunk>::Element* E = m_detail_chunks.front(); E; E = E->next()) {
+        _free_details(E->get());
+    }
 
-    for (int i = 0; i < indices.size(); i += 3) {
-        Vector3 v0 = pointsr[indicesr[i + 0]];
-        Vector3 v1 = pointsr[indicesr[i + 1]];
-        Vector3 v2 = pointsr[indicesr[i + 2]];
+    m_detail_chunks.clear();
+}
 
-        Vector3 normal = Plane(v0, v1, v2).normal;
+void TerrainNode::_details_changed()
+{
+    _clear_details();
+}
 
-        normalsw[indicesr[i + 0]] += normal;
-        normalsw[indicesr[i + 1]] += normal;
-        normalsw[indicesr[i + 2]] += normal;
+// keeps details scattered on chunks around the camera, builds a few chunks
+// per frame and fades the instance count out with distance
+void TerrainNode::_update_details()
+{
+    if (!m_chunks_created || m_chunk_count == 0 || is_headless()) {
+        return;
     }
 
-    for (int i = 0; i < normals.size(); i++) {
-        normalsw[i] = normalsw[i].normalized();
+    Camera* cam = get_viewport() ? get_viewport()->get_camera() : NULL;
+    float max_distance = 0;
+
+    for (int d = 0; d < m_details.size(); d++) {
+        if (m_details[d].mesh.is_valid()) {
+            max_distance = MAX(max_distance, m_details[d].distance * m_budget_scale);
+        }
     }
 
-    normalsw = DVector<Vector3>::Write();
+    if (!cam || max_distance <= 0) {
+        _clear_details();
+        return;
+    }
 
-    clk.check("normal buffer gen");
+    Vector3 cam_pos = get_global_transform().affine_inverse().xform(cam->get_global_transform().origin);
 
-    /* remove surface if exists */
+    /* drop chunks that went out of range */
 
-    if (m_chunks[ch_offset].surface_added) {
-        VS::get_singleton()->mesh_remove_surface(m_chunks[ch_offset].mesh, 0);
+    Map<int, DetailChunk>::Element* E = m_detail_chunks.front();
+
+    while (E) {
+        Map<int, DetailChunk>::Element* next = E->next();
+
+        if (_get_chunk_distance(E->key(), cam_pos) >= max_distance) {
+            _free_details(E->get());
+            m_detail_chunks.erase(E);
+        }
+
+        E = next;
     }
 
-    /* give arrays to visual server */
+    /* build and fade chunks in range */
 
-    arr.resize(VS::ARRAY_MAX);
-    arr[VS::ARRAY_VERTEX] = points;
-    arr[VS::ARRAY_NORMAL] = normals;
-    arr[VS::ARRAY_TEX_UV] = uvs;
-    arr[VS::ARRAY_INDEX] = indices;
+    float size = m_chunk_size * m_scale;
+    int range = Math::ceil(max_distance / size);
+    int ccx = Math::floor(cam_pos.x / size);
+    int ccy = Math::floor(cam_pos.z / size);
+    int built = 0;
 
-    VS::get_singleton()->mesh_add_surface(
-        m_chunks[ch_offset].mesh,
-        VS::PRIMITIVE_TRIANGLES,
-        arr);
+    for (int cy = MAX(ccy - range, 0); cy <= MIN(ccy + range, m_chunk_count - 1); cy++) {
+        for (int cx = MAX(ccx - range, 0); cx <= MIN(ccx + range, m_chunk_count - 1); cx++) {
+            int offset = cy * m_chunk_count + cx;
+            float distance = _get_chunk_distance(offset, cam_pos);
 
-    VS::get_singleton()->mesh_surface_set_material(m_chunks[ch_offset].mesh, 0, m_material);
+            if (distance >= max_distance) {
+                continue;
+            }
 
-    /* remove dirty flag */
-    DVector<Chunk>::Write cw = m_chunks.write();
+            E = m_detail_chunks.find(offset);
 
-    cw[ch_offset].mesh_dirty = false;
-    cw[ch_offset].surface_added = true;
+            if (!E || m_chunks[offset].details_dirty) {
+                if (built >= DETAIL_BUILDS_PER_FRAME) {
+                    continue;
+                }
 
-    cw = DVector<Chunk>::Write();
+                if (!E) {
+                    DetailChunk details;
+
+                    for (int d = 0; d < MAX_DETAIL_LAYERS; d++) {
+                        details.count[d] = 0;
+                    }
+
+                    E = m_detail_chunks.insert(offset, details);
+                }
+
+                _build_details(offset, E->get());
+                built++;
+            }
+
+            for (int d = 0; d < m_details.size(); d++) {
+                if (!E->get().multimesh[d].is_valid()) {
+                    continue;
+                }
+
+                float detail_distance = m_details[d].distance * m_budget_scale;
+                float fade = CLAMP((detail_distance - distance) / (detail_distance * 0.25f), 0.0f, 1.0f);
+
+                VS::get_singleton()->multimesh_set_visible_instances(E->get().multimesh[d], E->get().count[d] * fade);
+            }
+        }
+    }
+}
 
-    clk.check("array upload");
+/* memory */
+
+// what the visual server keeps for the surface, positions, normals and two uvs
+int64_t TerrainNode::_get_mesh_array_bytes(const Array& arr)
+{
+    DVector<Vector3> points = arr[VS::ARRAY_VERTEX];
+    DVector<int> indices = arr[VS::ARRAY_INDEX];
+
+    return (int64_t)points.size() * (sizeof(Vector3) * 2 + sizeof(Vector2) * 2) + (int64_t)indices.size() * sizeof(int);
 }
 
-void TerrainNode::_create_chunk(int offset)
+static Dictionary _memory_entry(int64_t cpu, int64_t gpu)
 {
-    DVector<Chunk>::Write w = m_chunks.write();
+    Dictionary d;
+    d["cpu"] = cpu;
+    d["gpu"] = gpu;
+    return d;
+}
 
-    w[offset].mesh = VS::get_singleton()->mesh_create();
-    w[offset].instance = VS::get_singleton()->instance_create();
-    w[offset].surface_added = false;
-    w[offset].mesh_dirty = true;
-    w[offset].material_dirty = true;
-    w[offset].blend_dirty = true;
+static int64_t _texture_bytes(RID texture)
+{
+    if (!texture.is_valid()) {
+        return 0;
+    }
 
-    w = DVector<Chunk>::Write();
+    int w = VS::get_singleton()->texture_get_width(texture);
+    int h = VS::get_singleton()->texture_get_height(texture);
 
-    VS::get_singleton()->instance_set_scenario(m_chunks[offset].instance, get_world()->get_scenario());
-    VS::get_singleton()->instance_set_base(m_chunks[offset].instance, m_chunks[offset].mesh);
+    if (w == 0 || h == 0) {
+        return 0;
+    }
 
-    _update_chunk_transform(offset);
+    return Image::get_image_data_size(w, h, VS::get_singleton()->texture_get_format(texture));
 }
 
-void TerrainNode::_delete_chunk(int offset)
+Dictionary TerrainNode::get_memory_usage() const
 {
-    VS::get_singleton()->free(m_chunks[offset].mesh);
-    VS::get_singleton()->free(m_chunks[offset].instance);
+    int64_t heights_cpu = 0;
+    int64_t heights_gpu = 0;
+    int64_t lighting_cpu = 0;
+    int64_t lighting_gpu = 0;
+    int64_t blends_cpu = 0;
+    int64_t blends_gpu = 0;
+    int64_t meshes = 0;
+    int64_t collision = 0;
+    int64_t details = 0;
+    int64_t caches = 0;
 
-    DVector<Chunk>::Write w = m_chunks.write();
+    if (m_data.is_valid()) {
+        TerrainData* data = m_data.ptr();
 
-    w[offset].surface_added = false;
+        heights_cpu = data->get_height_buffer().size();
+
+        // paged out layers cost nothing until read again, and looking
+        // at them here mustn't keep them in
+        if (data->is_resident(TerrainData::LAYER_BLENDS)) {
+            blends_cpu = data->get_layer_bytes(TerrainData::LAYER_BLENDS);
+        }
+
+        if (data->is_resident(TerrainData::LAYER_LIGHTING)) {
+            lighting_cpu = data->get_layer_bytes(TerrainData::LAYER_LIGHTING);
+        }
+
+        // asking for them would create them
+        if (data->has_heights_texture()) {
+            heights_gpu = _texture_bytes(data->get_heights_texture());
+        }
+
+        if (data->has_lighting_texture()) {
+            lighting_gpu = _texture_bytes(data->get_lighting_texture());
+        }
+    }
+
+    DVector<Chunk>::Read cr = m_chunks.read();
+
+    for (int i = 0; i < m_chunk_count * m_chunk_count; i++) {
+        const Chunk& chunk = cr[i];
+
+        if (chunk.surface_added) {
+            meshes += chunk.mesh_bytes;
+        }
+
+        if (chunk.shape.is_valid()) {
+            collision += chunk.collision_bytes;
+        }
+
+        blends_gpu += chunk.blend_bytes;
+    }
+
+    DVector<Batch>::Read br = m_batches.read();
+
+    for (int i = 0; i < m_batch_count * m_batch_count; i++) {
+        const Batch& batch = br[i];
+
+        if (batch.surface_added) {
+            meshes += batch.mesh_bytes;
+        }
+
+        blends_gpu += batch.blend_bytes;
+    }
+
+    for (const Map<int, DetailChunk>::Element* E = m_detail_chunks.front(); E; E = E->next()) {
+        for (int d = 0; d < MAX_DETAIL_LAYERS; d++) {
+            details += E->get().count[d] * sizeof(Transform);
+        }
+    }
+
+    // bookkeeping and things waiting to be applied
+    caches += m_chunks.size() * sizeof(Chunk) + m_batches.size() * sizeof(Batch);
+    caches += m_rtin_coords.size() * sizeof(uint16_t);
+    caches += (m_rtin_heights.size() + m_rtin_errors.size()) * sizeof(float);
+    caches += m_collision_points.size() * sizeof(Vector3) + m_collision_faces.size() * sizeof(Vector3);
+
+    for (const Map<uint32_t, MeshLayout>::Element* E = m_mesh_layouts.front(); E; E = E->next()) {
+        const MeshLayout& layout = E->get();
+
+        caches += layout.indices.size() * sizeof(int);
+        caches += (layout.points.size() + layout.normals.size()) * sizeof(Vector3);
+        caches += (layout.uvs.size() + layout.uv2s.size()) * sizeof(Vector2);
+    }
+    caches += m_deformations.size() * sizeof(Deformation);
+
+    Dictionary d;
+    d["heights"] = _memory_entry(heights_cpu, heights_gpu);
+    d["blends"] = _memory_entry(blends_cpu, blends_gpu);
+    d["lighting"] = _memory_entry(lighting_cpu, lighting_gpu);
+    d["meshes"] = _memory_entry(0, meshes);
+    d["collision"] = _memory_entry(collision, 0);
+    d["details"] = _memory_entry(details, 0);
+    d["caches"] = _memory_entry(caches, 0);
+    d["total_cpu"] = heights_cpu + blends_cpu + lighting_cpu + collision + details + caches;
+    d["total_gpu"] = heights_gpu + blends_gpu + lighting_gpu + meshes;
+
+    return d;
 }
 
-void TerrainNode::_update_chunk_transform(int offset)
+void TerrainNode::set_memory_budget(int64_t bytes)
 {
-    Transform t = get_global_transform();
-    VS::get_singleton()->instance_set_transform(m_chunks[offset].instance, t);
+    m_memory_budget = MAX(bytes, (int64_t)0);
 }
 
-void TerrainNode::update_dirty_chunks()
+int64_t TerrainNode::get_memory_budget() const
 {
-    uint32_t benchmark = OS::get_singleton()->get_ticks_msec();
+    return m_memory_budget;
+}
 
-    if (!is_inside_tree()) {
+// heights and blends are a fixed cost, what scales with view distance are
+// split chunks, merged mesh detail and details. Shrink those distances
+// while over budget and let them grow back once well below it
+void TerrainNode::_update_memory_budget()
+{
+    if (m_memory_budget == 0) {
+        m_budget_scale = 1.0;
         return;
     }
 
-    for (int i = 0; i < m_chunk_count * m_chunk_count; i++) {
+    uint64_t now = OS::get_singleton()->get_ticks_msec();
 
-        if (m_chunks[i].mesh_dirty) {
-            _update_chunk_mesh(i);
-        }
+    if (now - m_budget_time < MEMORY_CHECK_MSEC) {
+        return;
     }
 
-    benchmark = OS::get_singleton()->get_ticks_msec() - benchmark;
+    m_budget_time = now;
+
+    Dictionary usage = get_memory_usage();
+    int64_t total = (int64_t)usage["total_cpu"] + (int64_t)usage["total_gpu"];
+
+    if (total > m_memory_budget) {
+        m_budget_scale = MAX(m_budget_scale * 0.8f, 0.1f);
+    }
+    else if (total < m_memory_budget * 0.8f) {
+        m_budget_scale = MIN(m_budget_scale * 1.1f, 1.0f);
+    }
+}
+
+/* lighting */
+
+Ref<TerrainLightBaker> TerrainNode::get_light_baker() const
+{
+    return m_light_baker;
+}
+
+void TerrainNode::set_rebake_lighting(bool enable)
+{
+    m_rebake_lighting = enable;
+    m_lighting_regions.clear();
+}
+
+bool TerrainNode::get_rebake_lighting() const
+{
+    return m_rebake_lighting;
+}
+
+// rebakes around the heights edited since the last bake, waits until the
+// brush has rested a moment so strokes don't bake every frame
+void TerrainNode::_update_lighting()
+{
+    if (m_lighting_regions.empty() || m_data.is_null() || is_headless()) {
+        return;
+    }
+
+    if (OS::get_singleton()->get_ticks_msec() - m_lighting_time < LIGHTING_REBAKE_MSEC) {
+        return;
+    }
+
+    Vector<Rect2> regions = m_lighting_regions;
+    m_lighting_regions.clear();
+
+    m_light_baker->bake_regions(m_data, regions);
+}
+
+// edits whose baked texels overlap share a bake, distant ones stay apart so
+// the texels between them aren't rebaked
+void TerrainNode::_add_lighting_region(const Rect2& region)
+{
+    Rect2 r = m_light_baker->get_affected_region(region);
+
+    for (int i = 0; i < m_lighting_regions.size(); i++) {
+        if (m_lighting_regions[i].intersects(r)) {
+            r = r.merge(m_lighting_regions[i]);
+            m_lighting_regions.remove(i);
+            i = -1; // the grown region may reach earlier ones
+        }
+    }
 
-    print_line("TerrainNode::_update_dirty_chunks() benchmark:" + itos(benchmark));
+    m_lighting_regions.push_back(r);
 }
 
-void TerrainNode::_update_material()
+void TerrainNode::_lighting_changed(const Rect2& region)
 {
+    bool enabled = m_data.is_valid() && m_data->has_lighting();
+
+    if (enabled == m_lighting_enabled) {
+        return;
+    }
+
+    m_lighting_enabled = enabled;
+
+    DVector<Chunk>::Write cw = m_chunks.write();
+
+    for (int i = 0; i < m_chunk_count * m_chunk_count; i++) {
+        cw[i].material_dirty = true;
+    }
+
+    DVector<Batch>::Write bw = m_batches.write();
+
+    for (int i = 0; i < m_batch_count * m_batch_count; i++) {
+        bw[i].material_dirty = true;
+    }
 }
 
 void TerrainNode::_chunks_mark_all_dirty()
@@ -486,21 +2982,113 @@ void TerrainNode::_chunks_mark_all_dirty()
 
     for (int i = 0; i < m_chunk_count * m_chunk_count; i++) {
         cw[i].mesh_dirty = true;
+        cw[i].material_dirty = true;
+    }
+
+    DVector<Batch>::Write bw = m_batches.write();
+
+    for (int i = 0; i < m_batch_count * m_batch_count; i++) {
+        bw[i].mesh_dirty = true;
+        bw[i].material_dirty = true;
+    }
+}
+
+void TerrainNode::_clear_chunks()
+{
+    if (!m_chunks_created) {
+        return;
+    }
+
+    if (!is_headless()) {
+        for (int i = 0; i < m_batch_count * m_batch_count; i++) {
+            if (m_retire_pieces) {
+                _retire_batch(i);
+            }
+            else {
+                _delete_batch(i);
+            }
+        }
+    }
+
+    if (!m_retire_pieces) {
+        _free_retired_pieces();
+    }
+
+    _clear_details();
+
+    DVector<Chunk>::Write w = m_chunks.write();
+
+    for (int i = 0; i < m_chunk_count * m_chunk_count; i++) {
+        if (w[i].shape.is_valid()) {
+            PhysicsServer::get_singleton()->free(w[i].shape);
+            w[i].shape = RID();
+        }
+
+        w[i].collision_dirty = true;
+    }
+
+    w = DVector<Chunk>::Write();
+
+    PhysicsServer::get_singleton()->body_clear_shapes(m_body);
+
+    if (m_blends_pinned) {
+        m_data->unpin_layer(TerrainData::LAYER_BLENDS);
+        m_blends_pinned = false;
+    }
+
+    m_chunks_created = false;
+    m_collision_dirty = true;
+    m_blend_generation++;
+}
+
+// pieces and details read blends in bursts while the camera moves, the
+// pin keeps a burst from paging them in and out every frame
+void TerrainNode::_pin_blends()
+{
+    if (!m_blends_pinned) {
+        m_data->pin_layer(TerrainData::LAYER_BLENDS);
+        m_blends_pinned = true;
+    }
+
+    m_blends_read_time = OS::get_singleton()->get_ticks_msec();
+}
+
+// once nothing was built for a while the data's residency policy applies
+void TerrainNode::_unpin_idle_blends()
+{
+    if (!m_blends_pinned || OS::get_singleton()->get_ticks_msec() - m_blends_read_time < BLEND_PIN_MSEC) {
+        return;
     }
+
+    m_data->unpin_layer(TerrainData::LAYER_BLENDS);
+    m_blends_pinned = false;
 }
 
 void TerrainNode::_blendmap_changed()
 {
+    DVector<Chunk>::Write cw = m_chunks.write();
+
+    for (int i = 0; i < m_chunk_count * m_chunk_count; i++) {
+        cw[i].blend_dirty = true;
+    }
+
+    DVector<Batch>::Write bw = m_batches.write();
+
+    for (int i = 0; i < m_batch_count * m_batch_count; i++) {
+        bw[i].blend_dirty = true;
+    }
 }
 
 void TerrainNode::_heightmap_changed()
 {
+    // remove existing chunks
+    _clear_chunks();
+
     if (m_data.is_null()) {
-        if (m_chunks_created) {
-            for (int i = 0; i < m_chunk_count * m_chunk_count; i++) {
-                _delete_chunk(i);
-            }
-        }
+        m_chunk_count = 0;
+        m_batch_count = 0;
+        m_chunks.resize(0);
+        m_batches.resize(0);
 
         return;
     }
@@ -509,26 +3097,64 @@ void TerrainNode::_heightmap_changed()
     m_chunk_count = wmap_size / m_chunk_size;
     m_chunks.resize(m_chunk_count * m_chunk_count);
 
-    VS::get_singleton()->material_set_param(m_material, "blendmap", m_data->get_blends_texture());
+    m_batch_count = (m_chunk_count + m_batch_size - 1) / m_batch_size;
+    m_batches.resize(m_batch_count * m_batch_count);
+
+    DVector<Chunk>::Write cw = m_chunks.write();
+
+    for (int i = 0; i < m_chunk_count * m_chunk_count; i++) {
+        cw[i].mesh = RID();
+        cw[i].instance = RID();
+        cw[i].material = RID();
+        cw[i].blend_tex = RID();
+        cw[i].blend_bytes = 0;
+        cw[i].layer_count = 0;
+        cw[i].blend_version = 0;
+        cw[i].blend_time = 0;
+        cw[i].surface_added = false;
+        cw[i].mesh_bytes = 0;
+        cw[i].mesh_dirty = true;
+        cw[i].material_dirty = true;
+        cw[i].blend_dirty = true;
+        cw[i].shape = RID();
+        cw[i].collision_bytes = 0;
+        cw[i].collision_dirty = true;
+        cw[i].details_dirty = true;
+    }
+
+    cw = DVector<Chunk>::Write();
+
+    m_collision_dirty = true;
+
+    DVector<Batch>::Write bw = m_batches.write();
+
+    for (int i = 0; i < m_batch_count * m_batch_count; i++) {
+        bw[i].blend_version = 0;
+        bw[i].split = false;
+    }
+
+    bw = DVector<Batch>::Write();
 
     if (!is_inside_tree()) {
         return;
     }
 
-    if (m_chunks_created) {
-        // remove existing chunks
-        for (int i = 0; i < m_chunk_count * m_chunk_count; i++) {
-            _delete_chunk(i);
-        }
-    }
+    _create_batches();
+}
 
-    // create new chunks
-    for (int i = 0; i < m_chunk_count * m_chunk_count; i++) {
-        _create_chunk(i);
+void TerrainNode::_create_batches()
+{
+    // create new batches, they split into chunks on demand. Headless
+    // terrains only keep the chunk grid for collisions
+    if (!is_headless()) {
+        for (int i = 0; i < m_batch_count * m_batch_count; i++) {
+            _create_batch(i);
+        }
     }
 
     m_chunks_created = true;
 
+    _update_lod();
     update_dirty_chunks();
 }
 
@@ -546,33 +3172,108 @@ void TerrainNode::_bind_methods()
     ObjectTypeDB::bind_method(_MD("get_uv_scale"), &TerrainNode::get_uv_scale);
     ADD_PROPERTY(PropertyInfo(Variant::REAL, "uv_scale"), _SCS("set_uv_scale"), _SCS("get_uv_scale"));
 
+    ObjectTypeDB::bind_method(_MD("set_chunk_size", "size"), &TerrainNode::set_chunk_size);
+    ObjectTypeDB::bind_method(_MD("get_chunk_size"), &TerrainNode::get_chunk_size);
+    ADD_PROPERTY(PropertyInfo(Variant::INT, "chunk_size", PROPERTY_HINT_RANGE, "4,256,4"), _SCS("set_chunk_size"), _SCS("get_chunk_size"));
+
+    ObjectTypeDB::bind_method(_MD("set_batch_size", "size"), &TerrainNode::set_batch_size);
+    ObjectTypeDB::bind_method(_MD("get_batch_size"), &TerrainNode::get_batch_size);
+    ADD_PROPERTY(PropertyInfo(Variant::INT, "batch_size", PROPERTY_HINT_RANGE, "1,64,1"), _SCS("set_batch_size"), _SCS("get_batch_size"));
+
+    ObjectTypeDB::bind_method(_MD("set_lod_distance", "distance"), &TerrainNode::set_lod_distance);
+    ObjectTypeDB::bind_method(_MD("get_lod_distance"), &TerrainNode::get_lod_distance);
+    ADD_PROPERTY(PropertyInfo(Variant::REAL, "lod_distance"), _SCS("set_lod_distance"), _SCS("get_lod_distance"));
+
+    ObjectTypeDB::bind_method(_MD("set_detail_count", "count"), &TerrainNode::set_detail_count);
+    ObjectTypeDB::bind_method(_MD("get_detail_count"), &TerrainNode::get_detail_count);
+    ObjectTypeDB::bind_method(_MD("set_detail_mesh", "detail", "mesh:Mesh"), &TerrainNode::set_detail_mesh);
+    ObjectTypeDB::bind_method(_MD("get_detail_mesh:Mesh", "detail"), &TerrainNode::get_detail_mesh);
+    ObjectTypeDB::bind_method(_MD("set_detail_layer", "detail", "layer"), &TerrainNode::set_detail_layer);
+    ObjectTypeDB::bind_method(_MD("get_detail_layer", "detail"), &TerrainNode::get_detail_layer);
+    ObjectTypeDB::bind_method(_MD("set_detail_density", "detail", "density"), &TerrainNode::set_detail_density);
+    ObjectTypeDB::bind_method(_MD("get_detail_density", "detail"), &TerrainNode::get_detail_density);
+    ObjectTypeDB::bind_method(_MD("set_detail_distance", "detail", "distance"), &TerrainNode::set_detail_distance);
+    ObjectTypeDB::bind_method(_MD("get_detail_distance", "detail"), &TerrainNode::get_detail_distance);
+    ObjectTypeDB::bind_method(_MD("set_detail_scale", "detail", "range"), &TerrainNode::set_detail_scale);
+    ObjectTypeDB::bind_method(_MD("get_detail_scale", "detail"), &TerrainNode::get_detail_scale);
+
+    ObjectTypeDB::bind_method(_MD("set_simplify_error", "error"), &TerrainNode::set_simplify_error);
+    ObjectTypeDB::bind_method(_MD("get_simplify_error"), &TerrainNode::get_simplify_error);
+    ADD_PROPERTY(PropertyInfo(Variant::REAL, "simplify_error", PROPERTY_HINT_RANGE, "0,10,0.01"), _SCS("set_simplify_error"), _SCS("get_simplify_error"));
+
+    ObjectTypeDB::bind_method(_MD("set_mesh_cache_path", "path"), &TerrainNode::set_mesh_cache_path);
+    ObjectTypeDB::bind_method(_MD("get_mesh_cache_path"), &TerrainNode::get_mesh_cache_path);
+    ADD_PROPERTY(PropertyInfo(Variant::STRING, "mesh_cache_path", PROPERTY_HINT_DIR), _SCS("set_mesh_cache_path"), _SCS("get_mesh_cache_path"));
+
+    ObjectTypeDB::bind_method(_MD("set_generate_collisions", "enable"), &TerrainNode::set_generate_collisions);
+    ObjectTypeDB::bind_method(_MD("get_generate_collisions"), &TerrainNode::get_generate_collisions);
+    ADD_PROPERTY(PropertyInfo(Variant::BOOL, "generate_collisions"), _SCS("set_generate_collisions"), _SCS("get_generate_collisions"));
+
+    ObjectTypeDB::bind_method(_MD("set_collision_step", "step"), &TerrainNode::set_collision_step);
+    ObjectTypeDB::bind_method(_MD("get_collision_step"), &TerrainNode::get_collision_step);
+    ADD_PROPERTY(PropertyInfo(Variant::INT, "collision_step", PROPERTY_HINT_RANGE, "1,64,1"), _SCS("set_collision_step"), _SCS("get_collision_step"));
+
+    ObjectTypeDB::bind_method(_MD("set_headless", "enable"), &TerrainNode::set_headless);
+    ObjectTypeDB::bind_method(_MD("is_headless"), &TerrainNode::is_headless);
+    ADD_PROPERTY(PropertyInfo(Variant::BOOL, "headless"), _SCS("set_headless"), _SCS("is_headless"));
+
+    ObjectTypeDB::bind_method(_MD("get_memory_usage"), &TerrainNode::get_memory_usage);
+    ObjectTypeDB::bind_method(_MD("set_memory_budget", "bytes"), &TerrainNode::set_memory_budget);
+    ObjectTypeDB::bind_method(_MD("get_memory_budget"), &TerrainNode::get_memory_budget);
+    ADD_PROPERTY(PropertyInfo(Variant::INT, "memory_budget"), _SCS("set_memory_budget"), _SCS("get_memory_budget"));
+
+    ObjectTypeDB::bind_method(_MD("get_light_baker:TerrainLightBaker"), &TerrainNode::get_light_baker);
+    ObjectTypeDB::bind_method(_MD("set_rebake_lighting", "enable"), &TerrainNode::set_rebake_lighting);
+    ObjectTypeDB::bind_method(_MD("get_rebake_lighting"), &TerrainNode::get_rebake_lighting);
+    ADD_PROPERTY(PropertyInfo(Variant::BOOL, "rebake_lighting"), _SCS("set_rebake_lighting"), _SCS("get_rebake_lighting"));
+
     ObjectTypeDB::bind_method(_MD("get_pixel_x_at", "position"), &TerrainNode::get_pixel_x_at);
     ObjectTypeDB::bind_method(_MD("get_pixel_y_at", "position"), &TerrainNode::get_pixel_y_at);
 
-    ObjectTypeDB::bind_method(_MD("set_texture0", "texture"), &TerrainNode::set_texture0);
-    ObjectTypeDB::bind_method(_MD("get_texture0"), &TerrainNode::get_texture0);
-    ADD_PROPERTY(PropertyInfo(Variant::OBJECT, "texture0", PROPERTY_HINT_RESOURCE_TYPE, "Texture"), _SCS("set_texture0"), _SCS("get_texture0"));
-
-    ObjectTypeDB::bind_method(_MD("set_texture1", "texture"), &TerrainNode::set_texture1);
-    ObjectTypeDB::bind_method(_MD("get_texture1"), &TerrainNode::get_texture1);
-    ADD_PROPERTY(PropertyInfo(Variant::OBJECT, "texture1", PROPERTY_HINT_RESOURCE_TYPE, "Texture"), _SCS("set_texture1"), _SCS("get_texture1"));
+    ObjectTypeDB::bind_method(_MD("set_layer_count", "count"), &TerrainNode::set_layer_count);
+    ObjectTypeDB::bind_method(_MD("get_layer_count"), &TerrainNode::get_layer_count);
+    ObjectTypeDB::bind_method(_MD("set_layer_texture", "layer", "texture:Texture"), &TerrainNode::set_layer_texture);
+    ObjectTypeDB::bind_method(_MD("get_layer_texture:Texture", "layer"), &TerrainNode::get_layer_texture);
 
-    ObjectTypeDB::bind_method(_MD("set_texture2", "texture"), &TerrainNode::set_texture2);
-    ObjectTypeDB::bind_method(_MD("get_texture2"), &TerrainNode::get_texture2);
-    ADD_PROPERTY(PropertyInfo(Variant::OBJECT, "texture2", PROPERTY_HINT_RESOURCE_TYPE, "Texture"), _SCS("set_texture2"), _SCS("get_texture2"));
+    ObjectTypeDB::bind_method(_MD("mark_height_dirty", "x", "y"), &TerrainNode::mark_height_dirty);
+    ObjectTypeDB::bind_method(_MD("mark_blend_dirty", "x", "y"), &TerrainNode::mark_blend_dirty);
+    ObjectTypeDB::bind_method(_MD("mark_height_dirty_rect", "region"), &TerrainNode::mark_height_dirty_rect);
+    ObjectTypeDB::bind_method(_MD("mark_blend_dirty_rect", "region"), &TerrainNode::mark_blend_dirty_rect);
+    ObjectTypeDB::bind_method(_MD("update_dirty_chunks"), &TerrainNode::update_dirty_chunks);
 
-    ObjectTypeDB::bind_method(_MD("set_texture3", "texture"), &TerrainNode::set_texture3);
-    ObjectTypeDB::bind_method(_MD("get_texture3"), &TerrainNode::get_texture3);
-    ADD_PROPERTY(PropertyInfo(Variant::OBJECT, "texture3", PROPERTY_HINT_RESOURCE_TYPE, "Texture"), _SCS("set_texture3"), _SCS("get_texture3"));
-
-    ObjectTypeDB::bind_method(_MD("set_texture4", "texture"), &TerrainNode::set_texture4);
-    ObjectTypeDB::bind_method(_MD("get_texture4"), &TerrainNode::get_texture4);
-    ADD_PROPERTY(PropertyInfo(Variant::OBJECT, "texture4", PROPERTY_HINT_RESOURCE_TYPE, "Texture"), _SCS("set_texture4"), _SCS("get_texture4"));
+    ObjectTypeDB::bind_method(_MD("add_deformation", "position", "radius", "strength", "mode", "falloff"), &TerrainNode::add_deformation, DEFVAL(TerrainData::STAMP_CRATER), DEFVAL(0.5));
+    ObjectTypeDB::bind_method(_MD("_apply_deformations"), &TerrainNode::_apply_deformations);
+    ObjectTypeDB::bind_method(_MD("_update_transforms"), &TerrainNode::_update_transforms);
 
     ObjectTypeDB::bind_method(_MD("_size_changed"), &TerrainNode::_size_changed);
+    ObjectTypeDB::bind_method(_MD("_heights_changed", "region"), &TerrainNode::_heights_changed);
+    ObjectTypeDB::bind_method(_MD("_blends_changed", "region"), &TerrainNode::_blends_changed);
+    ObjectTypeDB::bind_method(_MD("_lighting_changed", "region"), &TerrainNode::_lighting_changed);
 }
 
 void TerrainNode::_size_changed()
 {
+    // resizing drops the baked lighting
+    m_lighting_regions.clear();
+    m_lighting_enabled = m_data->has_lighting();
+
+    // a live terrain rebuilds everything, spread it over a few frames. The
+    // old pieces keep drawing until then, overlapping the new ones already
+    // built rather than leaving holes. Collisions are rebuilt right away
+    m_throttle_builds = m_chunks_created;
+    m_retire_pieces = m_chunks_created;
+
     _heightmap_changed();
+
+    m_retire_pieces = false;
+}
+
+void TerrainNode::_heights_changed(const Rect2& region)
+{
+    _mark_height_dirty_rect(region.pos.x, region.pos.y, region.pos.x + region.size.x - 1, region.pos.y + region.size.y - 1, false);
+}
+
+void TerrainNode::_blends_changed(const Rect2& region)
+{
+    _mark_blend_dirty_rect(region.pos.x, region.pos.y, region.pos.x + region.size.x - 1, region.pos.y + region.size.y - 1);
 }
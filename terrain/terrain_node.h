@@ -4,8 +4,13 @@
 #include "rid.h"
 #include "scene/3d/spatial.h"
 #include "terrain_data.h"
+#include "terrain_light_baker.h"
 #include "scene/resources/texture.h"
+#include "scene/resources/mesh.h"
 #include "os/os.h"
+#include "os/thread.h"
+#include "os/semaphore.h"
+#include "os/mutex.h"
 
 class Clock {
     uint32_t m_time;
@@ -30,16 +35,98 @@ public:
 class TerrainNode : public Spatial {
     OBJ_TYPE(TerrainNode, Spatial)
 
-    struct Chunk {
+    enum {
+        MAX_CHUNK_LAYERS = 4, // layers one chunk can draw, picks the shader variant
+        MAX_DETAIL_LAYERS = 8,
+        MAX_MESH_LAYOUTS = 32,
+        MAX_POOLED_PIECES = 256,
+    };
+
+    // render state shared by chunks and merged batches
+    struct Piece {
         RID mesh;
         RID instance;
-        RID shape;
+        RID material;
+        RID blend_tex;
+        int64_t blend_bytes; // recorded on upload, asking the server is slow
+        int layers[MAX_CHUNK_LAYERS];
+        int layer_count;
+        uint32_t blend_version;
+        uint64_t blend_time; // last paint, blendmaps stay uncompressed for a while after
+        bool blend_compressed; // compressed or queued for compression
         bool surface_added;
+        int64_t mesh_bytes; // of the uploaded surface
         bool mesh_dirty;
         bool material_dirty;
         bool blend_dirty;
     };
 
+    struct Chunk : public Piece {
+        RID shape;
+        int64_t collision_bytes;
+        bool collision_dirty;
+        bool details_dirty;
+    };
+
+    // render resources of a freed piece, picked up by the next _init_piece()
+    struct PooledPiece {
+        RID mesh;
+        RID instance;
+        RID material;
+    };
+
+    // vertex grid of a mesh, the index buffer only depends on it
+    struct MeshLayout {
+        DVector<int> indices; // shared by every mesh of the layout, never written again
+        DVector<Vector3> points; // scratch, reused by the next mesh of the layout
+        DVector<Vector3> normals;
+        DVector<Vector2> uvs;
+        DVector<Vector2> uv2s;
+    };
+
+    // group of chunks drawn as one merged mesh while far from the camera
+    struct Batch : public Piece {
+        int lod; // vertex step of the merged mesh, 0 while split into chunks
+        bool split;
+        uint64_t edit_time;
+    };
+
+    // blendmap waiting for block compression on the worker thread
+    struct BlendJob {
+        int offset;
+        bool batch;
+        uint32_t version;
+        uint32_t generation;
+        Image image;
+    };
+
+    // instanced meshes scattered where a splat layer is painted
+    struct DetailLayer {
+        Ref<Mesh> mesh;
+        int layer;
+        float density; // instances per texel at full layer weight
+        float distance; // fades out towards it
+        float scale_min;
+        float scale_max;
+    };
+
+    // scattered instances of one chunk near the camera
+    struct DetailChunk {
+        RID multimesh[MAX_DETAIL_LAYERS];
+        RID instance[MAX_DETAIL_LAYERS];
+        int count[MAX_DETAIL_LAYERS];
+    };
+
+    // queued height stamp in texel space, see TerrainData::stamp_height()
+    struct Deformation {
+        int mode;
+        Vector2 center;
+        float radius;
+        float strength;
+        float falloff;
+        float height;
+    };
+
 public:
     TerrainNode();
     virtual ~TerrainNode();
@@ -47,17 +134,11 @@ public:
     void set_data(const Ref<TerrainData>& heightmap);
     Ref<TerrainData> get_data() const;
 
-    void set_texture0(const Ref<Texture>& texture);
-    void set_texture1(const Ref<Texture>& texture);
-    void set_texture2(const Ref<Texture>& texture);
-    void set_texture3(const Ref<Texture>& texture);
-    void set_texture4(const Ref<Texture>& texture);
+    void set_layer_count(int count);
+    int get_layer_count() const;
 
-    Ref<Texture> get_texture0() const;
-    Ref<Texture> get_texture1() const;
-    Ref<Texture> get_texture2() const;
-    Ref<Texture> get_texture3() const;
-    Ref<Texture> get_texture4() const;
+    void set_layer_texture(int layer, const Ref<Texture>& texture);
+    Ref<Texture> get_layer_texture(int layer) const;
 
     void set_chunk_scale(const float scale);
     float get_chunk_scale() const;
@@ -65,10 +146,83 @@ public:
     void set_uv_scale(const float scale);
     float get_uv_scale() const;
 
+    void set_chunk_size(int size);
+    int get_chunk_size() const;
+
+    void set_batch_size(int size);
+    int get_batch_size() const;
+
+    void set_lod_distance(float distance);
+    float get_lod_distance() const;
+
+    void set_detail_count(int count);
+    int get_detail_count() const;
+
+    void set_detail_mesh(int detail, const Ref<Mesh>& mesh);
+    Ref<Mesh> get_detail_mesh(int detail) const;
+
+    void set_detail_layer(int detail, int layer);
+    int get_detail_layer(int detail) const;
+
+    void set_detail_density(int detail, float density);
+    float get_detail_density(int detail) const;
+
+    void set_detail_distance(int detail, float distance);
+    float get_detail_distance(int detail) const;
+
+    void set_detail_scale(int detail, const Vector2& range);
+    Vector2 get_detail_scale(int detail) const;
+
+    // only the inside of a chunk is simplified, its border keeps every
+    // texel. Even a flat chunk keeps at least one triangle per border
+    // texel, about 4 * chunk_size
+    void set_simplify_error(float error);
+    float get_simplify_error() const;
+
+    void set_mesh_cache_path(const String& path);
+    String get_mesh_cache_path() const;
+
     int get_pixel_x_at(const Vector3 pos, const float offset) const;
     int get_pixel_y_at(const Vector3 pos, const float offset) const;
 
+    // shapes are built for every chunk up front, at 72 bytes per grid cell
+    // plus the physics server's own copy: a 2048 map at collision_step 1
+    // holds ~300 MB of faces, raise the step on large maps
+    void set_generate_collisions(bool enable);
+    bool get_generate_collisions() const;
+
+    // heightmap texels per collision face, coarser shapes for servers
+    void set_collision_step(int step);
+    int get_collision_step() const;
+
+    // collision only, no meshes, materials or textures. Always on when the
+    // platform can't draw (dedicated servers)
+    void set_headless(bool enable);
+    bool is_headless() const;
+
+    // bakes into the lighting layer of the data, see TerrainLightBaker
+    Ref<TerrainLightBaker> get_light_baker() const;
+
+    // rebake lighting around edited heights once they settle
+    void set_rebake_lighting(bool enable);
+    bool get_rebake_lighting() const;
+
+    void add_deformation(const Vector3& position, float radius, float strength, int mode, float falloff);
+
+    // bytes per category ("heights", "blends", ...) as { "cpu": n, "gpu": n },
+    // plus "total_cpu" and "total_gpu"
+    Dictionary get_memory_usage() const;
+
+    // cpu + gpu bytes, lod and detail distances shrink while above it, 0 disables
+    void set_memory_budget(int64_t bytes);
+    int64_t get_memory_budget() const;
+
     void mark_height_dirty(int x, int y);
+    void mark_blend_dirty(int x, int y);
+
+    // texel rects, marked as being edited like mark_height_dirty()
+    void mark_height_dirty_rect(const Rect2& region);
+    void mark_blend_dirty_rect(const Rect2& region);
 
     void update_dirty_chunks();
 
@@ -77,30 +231,80 @@ private:
     void _delete_chunk(int offset);
     void _update_chunk_mesh(int ch_offset);
     void _update_chunk_transform(int offset);
+    void _update_transforms();
     void _update_chunk_blendmap(int offset);
     void _update_chunk_material(int offset);
+    void _update_batch_blendmap(int offset);
+    void _update_batch_material(int offset);
+    void _update_chunk_collision(int offset);
+    void _update_collisions();
+    void _update_body();
+
+    void _create_batch(int offset);
+    void _delete_batch(int offset);
+    void _retire_batch(int offset);
+    void _free_retired_pieces();
+    void _update_batch_mesh(int offset);
+    void _split_batch(int offset);
+    void _merge_batch(int offset);
+    void _get_batch_rect(int offset, int& x, int& y, int& w, int& h) const;
+    int _get_batch_lod(float distance) const;
+    void _update_lod();
 
-    void _mark_blend_dirty(int x, int y);
+    Array _build_mesh_arrays(int x, int y, int w, int h, int step, bool skirts);
+    MeshLayout& _get_mesh_layout(int nx, int ny, bool skirts);
+    static void _get_skirt_edges(int nx, int ny, int* start, int* stride, int* len);
+    Array _build_adaptive_mesh_arrays(int x, int y, int size);
+    void _update_rtin_coords();
+    Array _get_mesh_arrays(int x, int y, int w, int h, int step, bool skirts, bool editing);
 
     int get_chunk_offset_at(int x, int y);
     bool is_hmap_pixel_inside_chunk(int offset, int x, int y);
+    void _mark_height_dirty_rect(int x1, int y1, int x2, int y2, bool edit);
+    void _mark_blend_dirty_rect(int x1, int y1, int x2, int y2);
+
+    void _apply_deformations();
+
+    void _init_piece(Piece& piece);
+    void _free_piece(Piece& piece);
+    void _clear_piece_pool();
+
+    bool _resolve_blendmap(int x, int y, int w, int h, Image& image, int* layers, int& layer_count);
+    void _update_blendmap(Piece& piece, int x, int y, int w, int h, int offset, bool batch);
+    void _update_material(Piece& piece);
+    int _get_blendmap_size(int size) const;
+
+    void _start_blend_thread();
+    void _stop_blend_thread();
+    void _apply_blend_jobs();
+    static void _blend_thread_func(void* userdata);
+
+    void _update_details();
+    float _get_chunk_distance(int offset, const Vector3& cam_pos) const;
+    void _build_details(int chunk, DetailChunk& details);
+    void _free_details(DetailChunk& details);
+    void _clear_details();
+    void _details_changed();
+
+    void _update_lighting();
+    void _add_lighting_region(const Rect2& region);
+    void _update_memory_budget();
+    static int64_t _get_mesh_array_bytes(const Array& arr);
 
-    void _update_material();
     void _chunks_mark_all_dirty();
+    void _clear_chunks();
+    void _create_batches();
 
     void _blendmap_changed();
+    void _pin_blends();
+    void _unpin_idle_blends();
     void _heightmap_changed();
 
     Ref<TerrainData> m_data;
 
-    Ref<Texture> m_texture0;
-    Ref<Texture> m_texture1;
-    Ref<Texture> m_texture2;
-    Ref<Texture> m_texture3;
-    Ref<Texture> m_texture4;
+    Vector<Ref<Texture> > m_layers;
 
-    RID m_material;
-    RID m_shader;
+    RID m_shaders[MAX_CHUNK_LAYERS]; // variant per number of drawn layers
 
     float m_scale;
     float m_uv_scale;
@@ -108,18 +312,88 @@ private:
     int m_chunk_count;
     DVector<Chunk> m_chunks;
 
+    float m_lod_distance;
+    int m_batch_size; // in chunks
+    int m_batch_count;
+    DVector<Batch> m_batches;
+
+    String m_mesh_cache_path; // baked meshes are kept here when set
+
+    float m_simplify_error; // max vertical error of simplified chunks, 0 keeps the full grid
+    Vector<uint16_t> m_rtin_coords; // a and b corners of every rtin triangle of a chunk
+    int m_rtin_size;
+    Vector<float> m_rtin_heights; // scratch of _build_adaptive_mesh_arrays()
+    Vector<float> m_rtin_errors;
+
+    // meshes are only built on the main thread, one set of scratch buffers is enough
+    Map<uint32_t, MeshLayout> m_mesh_layouts;
+    Vector<PooledPiece> m_piece_pool;
+    Vector<Vector3> m_collision_points; // scratch of _update_chunk_collision()
+    DVector<Vector3> m_collision_faces;
+
     bool m_chunks_dirty;
     bool m_chunks_created;
+    bool m_blends_pinned; // while pieces or details are being built
+    uint64_t m_blends_read_time;
+    bool m_transforms_dirty; // pushed once at the end of the frame
+    bool m_throttle_builds; // after a resize, until every mesh is rebuilt
+    bool m_retire_pieces; // _clear_chunks() keeps the pieces drawing
+    Vector<Piece> m_retired_pieces; // of the map before the resize
+
+    /* blendmap compression */
+
+    Thread* m_blend_thread;
+    Semaphore* m_blend_semaphore;
+    Mutex* m_blend_mutex;
+    List<BlendJob> m_blend_jobs;
+    List<BlendJob> m_blend_results;
+    bool m_blend_thread_exit;
+    uint32_t m_blend_generation; // bumped when chunks are recreated, drops stale jobs
+    bool m_warned_layers; // chunks dropping layers are only reported once
+
+    /* details */
+
+    Vector<DetailLayer> m_details;
+    Map<int, DetailChunk> m_detail_chunks; // by chunk offset
+
+    /* lighting */
+
+    Ref<TerrainLightBaker> m_light_baker;
+    bool m_rebake_lighting;
+    Vector<Rect2> m_lighting_regions; // affected by heights edited since the last bake
+    uint64_t m_lighting_time;
+    bool m_lighting_enabled; // materials sample the baked lighting
+
+    /* memory */
+
+    int64_t m_memory_budget;
+    float m_budget_scale; // applied to lod and detail distances, 1 while within budget
+    uint64_t m_budget_time;
+
+    /* deformation */
+
+    Vector<Deformation> m_deformations; // applied together at the end of the frame
 
     /* physics */
 
     bool m_generate_collisions;
+    bool m_collision_dirty;
+    int m_collision_step;
     RID m_body;
 
+    bool m_headless;
+
 protected:
+    bool _set(const StringName& name, const Variant& value);
+    bool _get(const StringName& name, Variant& ret) const;
+    void _get_property_list(List<PropertyInfo>* list) const;
+
     void _notification(int what);
     static void _bind_methods();
     void _size_changed();
+    void _heights_changed(const Rect2& region);
+    void _blends_changed(const Rect2& region);
+    void _lighting_changed(const Rect2& region);
 };
 
 #endif
@@ -0,0 +1,65 @@
+#include "terrain_threads.h"
+#include "os/os.h"
+#include "os/thread.h"
+#include "os/memory.h"
+
+struct Range {
+    TerrainThreads::RangeFunc func;
+    void* userdata;
+    int from;
+    int to;
+};
+
+static void _range_func(void* userdata)
+{
+    Range* r = (Range*)userdata;
+    r->func(r->userdata, r->from, r->to);
+}
+
+int TerrainThreads::get_thread_count()
+{
+    return CLAMP(OS::get_singleton()->get_processor_count(), 1, MAX_THREADS);
+}
+
+void TerrainThreads::run(RangeFunc func, void* userdata, int count, int min_range)
+{
+    if (count <= 0) {
+        return;
+    }
+
+    min_range = MAX(min_range, 1);
+
+    int threads = MIN(get_thread_count(), (count + min_range - 1) / min_range);
+
+    if (threads <= 1) {
+        func(userdata, 0, count);
+        return;
+    }
+
+    Range ranges[MAX_THREADS];
+    Thread* workers[MAX_THREADS];
+
+    for (int i = 0; i < threads; i++) {
+        ranges[i].func = func;
+        ranges[i].userdata = userdata;
+        ranges[i].from = (int64_t)count * i / threads;
+        ranges[i].to = (int64_t)count * (i + 1) / threads;
+    }
+
+    for (int i = 1; i < threads; i++) {
+        workers[i] = Thread::create(_range_func, &ranges[i]);
+    }
+
+    func(userdata, ranges[0].from, ranges[0].to);
+
+    for (int i = 1; i < threads; i++) {
+        if (!workers[i]) {
+            // no threads on this platform, do it here
+            _range_func(&ranges[i]);
+            continue;
+        }
+
+        Thread::wait_to_finish(workers[i]);
+        memdelete(workers[i]);
+    }
+}
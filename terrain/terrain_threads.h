@@ -0,0 +1,20 @@
+#ifndef _TERRAIN_THREADS_H
+#define _TERRAIN_THREADS_H
+
+#include "typedefs.h"
+
+// splits [0, count) into contiguous ranges and runs them on worker threads,
+// the calling thread takes the first range and run() returns when all are done
+class TerrainThreads {
+public:
+    enum {
+        MAX_THREADS = 32,
+    };
+
+    typedef void (*RangeFunc)(void* userdata, int from, int to);
+
+    static int get_thread_count();
+    static void run(RangeFunc func, void* userdata, int count, int min_range = 1);
+};
+
+#endif